@@ -51,6 +51,8 @@ LUALIB_API const char *(luaL_checklstring) (lua_State *L, int numArg,
                                                           size_t *l);
 LUALIB_API const char *(luaL_optlstring) (lua_State *L, int numArg,
                                           const char *def, size_t *l);
+LUALIB_API const char *(luaL_checkbytes) (lua_State *L, int numArg,
+                                          size_t *l);
 LUALIB_API lua_Number (luaL_checknumber) (lua_State *L, int numArg);
 LUALIB_API lua_Number (luaL_optnumber) (lua_State *L, int nArg, lua_Number def);
 
@@ -126,15 +128,22 @@ LUALIB_API const char *(luaL_findtable) (lua_State *L, int idx,
 
 
 
+/*
+** The contents are kept in `initb' until they don't fit, and then in a string
+** buffer (see lua_resizestringbuffer) which becomes the result without being
+** copied. Nothing is kept on the stack.
+*/
 typedef struct luaL_Buffer {
   char *p;			/* current position in buffer */
-  int lvl;  /* number of strings in the stack (level) */
+  char *b;			/* start of buffer (initb or the string buffer) */
+  char *end;			/* end of the space in buffer */
+  void *string;		/* string buffer, or NULL when using initb */
   lua_State *L;
-  char buffer[LUAL_BUFFERSIZE];
+  char initb[LUAL_BUFFERSIZE];
 } luaL_Buffer;
 
 #define luaL_addchar(B,c) \
-  ((void)((B)->p < ((B)->buffer+LUAL_BUFFERSIZE) || luaL_prepbuffer(B)), \
+  ((void)((B)->p < (B)->end || luaL_prepbuffer(B)), \
    (*(B)->p++ = (char)(c)))
 
 /* compatibility only */
@@ -153,6 +162,30 @@ LUALIB_API void (luaL_pushresult) (luaL_Buffer *B);
 /* }====================================================== */
 
 
+/*
+** {======================================================
+** String buffers (string.buffer objects, see lstrlib.c)
+** =======================================================
+*/
+
+#define LUAL_STRBUFFER	"string.buffer"  /* name of the metatable */
+
+/*
+** The bytes are stored in a userdata which is referenced from the
+** environment of the string buffer, and are always followed by a '\0'. The
+** contents are the bytes from `r' to `w'; the ones before `r' have been
+** removed with `get'.
+*/
+typedef struct luaL_StrBuffer {
+  char *b;
+  size_t r;  /* position of the first byte */
+  size_t w;  /* position after the last byte */
+  size_t size;  /* number of bytes that fit in b (not counting the '\0') */
+} luaL_StrBuffer;
+
+/* }====================================================== */
+
+
 /* compatibility with ref system */
 
 /* pre-defined references */
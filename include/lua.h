@@ -236,6 +236,9 @@ LUA_API int  (lua_status) (lua_State *L);
 #define LUA_GCSTEP		5
 #define LUA_GCSETPAUSE		6
 #define LUA_GCSETSTEPMUL	7
+/* switch the collector mode; lua_gc returns the previous mode */
+#define LUA_GCGEN		10
+#define LUA_GCINC		11
 
 LUA_API int (lua_gc) (lua_State *L, int what, int data);
 
@@ -348,6 +351,25 @@ typedef void (*lua_Hook) (lua_State *L, lua_Debug *ar);
 typedef void (*lua_GCHook) (lua_State *L, int);
 LUA_API void lua_setgchook (lua_State *L, lua_GCHook func);
 
+/* Orders for comparing strings with < and <= */
+/* LUA_COLLATE_BYTES compares the bytes of the strings (like memcmp), which is
+   the same as the order of the "C" locale. LUA_COLLATE_LOCALE uses strcoll.
+   A state starts with LUA_COLLATE_BYTES if LC_COLLATE is "C" or "POSIX" when
+   it is created; os.setlocale also updates it. A host that changes LC_COLLATE
+   itself should set the order with lua_setcollation. */
+#define LUA_COLLATE_BYTES   0
+#define LUA_COLLATE_LOCALE  1
+LUA_API void lua_setcollation (lua_State *L, int collation);
+LUA_API int lua_getcollation (lua_State *L);
+
+/* Building a string in the memory of the string object (used by luaL_Buffer) */
+/* lua_resizestringbuffer creates (if *buffer is NULL) or grows a buffer so
+   that it holds size characters and returns a pointer to them. The buffer is
+   freed by an error. lua_pushstringbuffer pushes the first len characters as
+   a string, without copying them if the string is long, and frees the buffer. */
+LUA_API char *lua_resizestringbuffer (lua_State *L, void **buffer, size_t size);
+LUA_API void lua_pushstringbuffer (lua_State *L, void *buffer, size_t len);
+
 
 LUA_API int lua_getstack (lua_State *L, int level, lua_Debug *ar);
 LUA_API int lua_getinfo (lua_State *L, const char *what, lua_Debug *ar);
@@ -14,6 +14,9 @@
 /* Key to file-handle type */
 #define LUA_FILEHANDLE		"_File"
 
+/* Key to the cache of compiled patterns in the registry */
+#define LUA_PATTERNCACHE	"_PATTERNS"
+
 /**
 * Callbacks for file I/O.
 */
@@ -48,4 +48,13 @@ project "Test"
     language "C++"
     files { "src/Test/*.h", "src/Test/*.c", "src/Test/*.cpp" }
     includedirs { "include" }
-    links { "Rocket" }
\ No newline at end of file
+    links { "Rocket" }
+
+-- Benchmarks
+project "Benchmark"
+    kind "ConsoleApp"
+    location "build"
+    language "C++"
+    files { "src/Benchmark/*.h", "src/Benchmark/*.c", "src/Benchmark/*.cpp" }
+    includedirs { "include" }
+    links { "Rocket" }
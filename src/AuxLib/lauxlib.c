@@ -162,6 +162,26 @@ LUALIB_API const char *luaL_checklstring (lua_State *L, int narg, size_t *len) {
 }
 
 
+/*
+** Same as luaL_checklstring, but also accepts a string buffer and returns
+** its contents without making a string of them.
+*/
+LUALIB_API const char *luaL_checkbytes (lua_State *L, int narg, size_t *len) {
+  if (lua_type(L, narg) == LUA_TUSERDATA && lua_getmetatable(L, narg)) {
+    luaL_StrBuffer *sb = NULL;
+    lua_getfield(L, LUA_REGISTRYINDEX, LUAL_STRBUFFER);
+    if (lua_rawequal(L, -1, -2))
+      sb = (luaL_StrBuffer *)lua_touserdata(L, narg);
+    lua_pop(L, 2);  /* remove both metatables */
+    if (sb != NULL) {
+      if (len) *len = sb->w - sb->r;
+      return sb->b + sb->r;
+    }
+  }
+  return luaL_checklstring(L, narg, len);
+}
+
+
 LUALIB_API const char *luaL_optlstring (lua_State *L, int narg,
                                         const char *def, size_t *len) {
   if (lua_isnoneornil(L, narg)) {
@@ -389,53 +409,37 @@ LUALIB_API const char *luaL_findtable (lua_State *L, int idx,
 */
 
 
-#define bufflen(B)	((B)->p - (B)->buffer)
-#define bufffree(B)	((size_t)(LUAL_BUFFERSIZE - bufflen(B)))
-
-#define LIMIT	(LUA_MINSTACK/2)
+#define bufflen(B)	((size_t)((B)->p - (B)->b))
+#define bufffree(B)	((size_t)((B)->end - (B)->p))
 
 
-static int emptybuffer (luaL_Buffer *B) {
+/* make room for at least `sz' more characters */
+static void growbuffer (luaL_Buffer *B, size_t sz) {
   size_t l = bufflen(B);
-  if (l == 0) return 0;  /* put nothing on stack */
-  else {
-    lua_pushlstring(B->L, B->buffer, l);
-    B->p = B->buffer;
-    B->lvl++;
-    return 1;
-  }
-}
-
-
-static void adjuststack (luaL_Buffer *B) {
-  if (B->lvl > 1) {
-    lua_State *L = B->L;
-    int toget = 1;  /* number of levels to concat */
-    size_t toplen = lua_strlen(L, -1);
-    do {
-      size_t l = lua_strlen(L, -(toget+1));
-      if (B->lvl - toget + 1 >= LIMIT || toplen > l) {
-        toplen += l;
-        toget++;
-      }
-      else break;
-    } while (toget < B->lvl);
-    lua_concat(L, toget);
-    B->lvl = B->lvl - toget + 1;
-  }
+  size_t size = 2 * (size_t)(B->end - B->b);
+  char *b;
+  if (size < l + sz) size = l + sz;
+  b = lua_resizestringbuffer(B->L, &B->string, size);
+  if (B->b == B->initb)  /* first time the contents don't fit? */
+    memcpy(b, B->initb, l);
+  B->b = b;
+  B->p = b + l;
+  B->end = b + size;
 }
 
 
 LUALIB_API char *luaL_prepbuffer (luaL_Buffer *B) {
-  if (emptybuffer(B))
-    adjuststack(B);
-  return B->buffer;
+  if (bufffree(B) < LUAL_BUFFERSIZE)
+    growbuffer(B, LUAL_BUFFERSIZE);
+  return B->p;
 }
 
 
 LUALIB_API void luaL_addlstring (luaL_Buffer *B, const char *s, size_t l) {
-  while (l--)
-    luaL_addchar(B, *s++);
+  if (bufffree(B) < l)
+    growbuffer(B, l);
+  memcpy(B->p, s, l);
+  B->p += l;
 }
 
 
@@ -445,9 +449,15 @@ LUALIB_API void luaL_addstring (luaL_Buffer *B, const char *s) {
 
 
 LUALIB_API void luaL_pushresult (luaL_Buffer *B) {
-  emptybuffer(B);
-  lua_concat(B->L, B->lvl);
-  B->lvl = 1;
+  if (B->string == NULL)
+    lua_pushlstring(B->L, B->b, bufflen(B));
+  else {
+    lua_pushstringbuffer(B->L, B->string, bufflen(B));
+    B->string = NULL;
+  }
+  /* the buffer can be used again */
+  B->b = B->p = B->initb;
+  B->end = B->initb + LUAL_BUFFERSIZE;
 }
 
 
@@ -455,24 +465,16 @@ LUALIB_API void luaL_addvalue (luaL_Buffer *B) {
   lua_State *L = B->L;
   size_t vl;
   const char *s = lua_tolstring(L, -1, &vl);
-  if (vl <= bufffree(B)) {  /* fit into buffer? */
-    memcpy(B->p, s, vl);  /* put it there */
-    B->p += vl;
-    lua_pop(L, 1);  /* remove from stack */
-  }
-  else {
-    if (emptybuffer(B))
-      lua_insert(L, -2);  /* put buffer before new value */
-    B->lvl++;  /* add new value into B stack */
-    adjuststack(B);
-  }
+  luaL_addlstring(B, s, vl);  /* the value is on the stack while it's copied */
+  lua_pop(L, 1);
 }
 
 
 LUALIB_API void luaL_buffinit (lua_State *L, luaL_Buffer *B) {
   B->L = L;
-  B->p = B->buffer;
-  B->lvl = 0;
+  B->b = B->p = B->initb;
+  B->end = B->initb + LUAL_BUFFERSIZE;
+  B->string = NULL;
 }
 
 /* }====================================================== */
@@ -640,7 +640,7 @@ static int g_write (lua_State *L, File* file, int arg) {
   int status = 1;
   for (; nargs--; arg++) {
       size_t l;
-      const char *s = luaL_checklstring(L, arg, &l);
+      const char *s = luaL_checkbytes(L, arg, &l);
       status = status && (writefile(L, file, s, l) == l);
   }
   return pushresult(L, status, NULL);
@@ -208,7 +208,19 @@ static int os_setlocale (lua_State *L) {
      "numeric", "time", NULL};
   const char *l = luaL_optstring(L, 1, NULL);
   int op = luaL_checkoption(L, 2, "all", catnames);
-  lua_pushstring(L, setlocale(cat[op], l));
+  const char *locale = setlocale(cat[op], l);
+  lua_pushstring(L, locale);  /* before the buffer is reused */
+  if (locale != NULL && (cat[op] == LC_ALL || cat[op] == LC_COLLATE)) {
+    /* strings can be compared by their bytes only in the "C" locale */
+    const char *collate = setlocale(LC_COLLATE, NULL);
+    int bytes = strcmp(collate, "C") == 0 || strcmp(collate, "POSIX") == 0;
+    lua_setcollation(L, bytes ? LUA_COLLATE_BYTES : LUA_COLLATE_LOCALE);
+  }
+  if (locale != NULL && (cat[op] == LC_ALL || cat[op] == LC_CTYPE)) {
+    /* compiled patterns classify characters with the old LC_CTYPE */
+    lua_pushnil(L);
+    lua_setfield(L, LUA_REGISTRYINDEX, LUA_PATTERNCACHE);
+  }
   return 1;
 }
 
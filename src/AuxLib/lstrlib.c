@@ -6,6 +6,9 @@
 
 
 #include <ctype.h>
+#include <limits.h>
+#include <locale.h>
+#include <math.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -24,6 +27,103 @@
 #define uchar(c)        ((unsigned char)(c))
 
 
+/*
+** SSE2 and AVX2 are used for searching and case conversion on x86 when the
+** processor has them. SSE2 is assumed when the compiler targets it (as on
+** x64); otherwise it's checked with cpuid when the library is first used,
+** and AVX2 always is. With GCC and Clang the functions which use them are
+** compiled for those instructions with a target attribute, so the library
+** doesn't need to be built with -msse2 or -mavx2.
+*/
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#define LSTR_SIMD
+#define LSTR_TARGET(t)
+#if _MSC_VER >= 1800
+#define LSTR_AVX2
+#endif
+#include <emmintrin.h>
+#include <intrin.h>
+#elif (defined(__i386__) || defined(__x86_64__)) && \
+      (defined(__clang__) || __GNUC__ > 4 || \
+       (__GNUC__ == 4 && __GNUC_MINOR__ >= 9))
+#define LSTR_SIMD
+#define LSTR_TARGET(t)	__attribute__((target(t)))
+#define LSTR_AVX2
+#include <emmintrin.h>
+#include <cpuid.h>
+#endif
+
+#ifdef LSTR_AVX2
+#include <immintrin.h>
+#endif
+
+#ifdef LSTR_SIMD
+
+#define CPU_SSE2	1
+#define CPU_AVX2	2
+
+static void cpuid (int leaf, unsigned int info[4]) {
+#ifdef _MSC_VER
+  __cpuidex((int *)info, leaf, 0);
+#else
+  __cpuid_count(leaf, 0, info[0], info[1], info[2], info[3]);
+#endif
+}
+
+
+#ifdef LSTR_AVX2
+/* the register state the operating system saves on a context switch */
+static unsigned int xcr0 (void) {
+#ifdef _MSC_VER
+  return (unsigned int)_xgetbv(0);
+#else
+  unsigned int eax, edx;
+  __asm__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+  return eax;
+#endif
+}
+#endif
+
+
+static int cpufeatures (void) {
+  static int features = -1;
+  if (features < 0) {
+    unsigned int info[4];
+    unsigned int maxleaf;
+    int f = 0;
+    cpuid(0, info);
+    maxleaf = info[0];
+    cpuid(1, info);
+    if ((info[3] >> 26) & 1) f |= CPU_SSE2;  /* EDX bit 26 */
+#ifdef LSTR_AVX2
+    /* AVX2 also needs AVX and the YMM registers to be saved by the OS
+       (OSXSAVE, and the SSE and AVX state in XCR0) */
+    if (maxleaf >= 7 && ((info[2] >> 27) & 1) && ((info[2] >> 28) & 1) &&
+        (xcr0() & 6) == 6) {
+      cpuid(7, info);
+      if ((info[1] >> 5) & 1) f |= CPU_AVX2;  /* EBX bit 5 */
+    }
+#else
+    (void)maxleaf;
+#endif
+    features = f;
+  }
+  return features;
+}
+
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define hassse2()	1
+#else
+#define hassse2()	(cpufeatures() & CPU_SSE2)
+#endif
+
+#define hasavx2()	(cpufeatures() & CPU_AVX2)
+
+#endif
+
+
 
 static int str_len (lua_State *L) {
   size_t l;
@@ -65,31 +165,95 @@ static int str_reverse (lua_State *L) {
 }
 
 
-static int str_lower (lua_State *L) {
-  size_t l;
+/*
+** In the "C" locale only the ASCII letters change case, so 16 or 32
+** characters can be converted at a time. `first' is 'a' for toupper and 'A'
+** for tolower.
+*/
+#ifdef LSTR_SIMD
+LSTR_TARGET("sse2")
+static size_t convertcase_sse2 (char *d, const char *s, size_t l, int first) {
+  const __m128i lo = _mm_set1_epi8((char)(first - 1));
+  const __m128i hi = _mm_set1_epi8((char)(first + 26));
+  const __m128i flip = _mm_set1_epi8(0x20);
   size_t i;
-  luaL_Buffer b;
-  const char *s = luaL_checklstring(L, 1, &l);
-  luaL_buffinit(L, &b);
-  for (i=0; i<l; i++)
-    luaL_addchar(&b, tolower(uchar(s[i])));
-  luaL_pushresult(&b);
-  return 1;
+  for (i = 0; i + 16 <= l; i += 16) {
+    __m128i c = _mm_loadu_si128((const __m128i *)(s + i));
+    /* bytes above 127 are negative, so they aren't in the range */
+    __m128i m = _mm_and_si128(_mm_cmpgt_epi8(c, lo), _mm_cmplt_epi8(c, hi));
+    _mm_storeu_si128((__m128i *)(d + i),
+                     _mm_xor_si128(c, _mm_and_si128(m, flip)));
+  }
+  return i;
 }
+#endif
 
 
-static int str_upper (lua_State *L) {
-  size_t l;
+#ifdef LSTR_AVX2
+LSTR_TARGET("avx2")
+static size_t convertcase_avx2 (char *d, const char *s, size_t l, int first) {
+  const __m256i lo = _mm256_set1_epi8((char)(first - 1));
+  const __m256i hi = _mm256_set1_epi8((char)(first + 26));
+  const __m256i flip = _mm256_set1_epi8(0x20);
   size_t i;
+  for (i = 0; i + 32 <= l; i += 32) {
+    __m256i c = _mm256_loadu_si256((const __m256i *)(s + i));
+    __m256i m = _mm256_and_si256(_mm256_cmpgt_epi8(c, lo),
+                                 _mm256_cmpgt_epi8(hi, c));
+    _mm256_storeu_si256((__m256i *)(d + i),
+                        _mm256_xor_si256(c, _mm256_and_si256(m, flip)));
+  }
+  return i;
+}
+#endif
+
+
+static int isclocale (void) {
+  const char *l = setlocale(LC_CTYPE, NULL);
+  return l != NULL && (strcmp(l, "C") == 0 || strcmp(l, "POSIX") == 0);
+}
+
+
+static int convertcase (lua_State *L, int (*convert)(int), int first) {
+  size_t l;
   luaL_Buffer b;
   const char *s = luaL_checklstring(L, 1, &l);
+#ifdef LSTR_SIMD
+  int simd = 0;  /* CPU_SSE2 and CPU_AVX2 if they can be used */
+  if (l >= 32 && isclocale())
+    simd = (hassse2() ? CPU_SSE2 : 0) | hasavx2();
+#endif
   luaL_buffinit(L, &b);
-  for (i=0; i<l; i++)
-    luaL_addchar(&b, toupper(uchar(s[i])));
+  while (l > 0) {  /* convert a buffer at a time */
+    char *d = luaL_prepbuffer(&b);
+    size_t n = (l < LUAL_BUFFERSIZE) ? l : LUAL_BUFFERSIZE;
+    size_t i = 0;
+#ifdef LSTR_AVX2
+    if (simd & CPU_AVX2) i = convertcase_avx2(d, s, n, first);
+#endif
+#ifdef LSTR_SIMD
+    if (simd & CPU_SSE2) i += convertcase_sse2(d + i, s + i, n - i, first);
+#endif
+    for (; i < n; i++)
+      d[i] = (char)convert(uchar(s[i]));
+    luaL_addsize(&b, n);
+    s += n;
+    l -= n;
+  }
   luaL_pushresult(&b);
   return 1;
 }
 
+
+static int str_lower (lua_State *L) {
+  return convertcase(L, tolower, 'A');
+}
+
+
+static int str_upper (lua_State *L) {
+  return convertcase(L, toupper, 'a');
+}
+
 static int str_rep (lua_State *L) {
   size_t l;
   luaL_Buffer b;
@@ -441,12 +605,106 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
 
 
 
+#ifdef LSTR_SIMD
+
+static int firstbit (unsigned int mask) {
+#ifdef _MSC_VER
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return (int)index;
+#else
+  return __builtin_ctz(mask);
+#endif
+}
+
+
+/*
+** Checks 16 positions at a time by comparing the first and last characters
+** of `s2' with the characters at each position, and only compares the rest
+** of `s2' where both match. Returns the position where the search should
+** continue if `s2' wasn't found (in `*rest').
+*/
+LSTR_TARGET("sse2")
+static const char *lmemfind_sse2 (const char *s1, size_t l1,
+                                  const char *s2, size_t l2,
+                                  const char **rest) {
+  const __m128i first = _mm_set1_epi8(s2[0]);
+  const __m128i last = _mm_set1_epi8(s2[l2-1]);
+  size_t n = l1 - l2 + 1;  /* number of positions `s2' can start at */
+  size_t i;
+  for (i = 0; i + 16 <= n; i += 16) {
+    __m128i bf = _mm_loadu_si128((const __m128i *)(s1 + i));
+    __m128i bl = _mm_loadu_si128((const __m128i *)(s1 + i + l2 - 1));
+    unsigned int mask = (unsigned int)_mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(bf, first), _mm_cmpeq_epi8(bl, last)));
+    while (mask != 0) {
+      const char *init = s1 + i + firstbit(mask);
+      if (memcmp(init + 1, s2 + 1, l2 - 2) == 0)
+        return init;
+      mask &= mask - 1;
+    }
+  }
+  *rest = s1 + i;
+  return NULL;
+}
+
+#endif
+
+
+#ifdef LSTR_AVX2
+
+/* same as lmemfind_sse2, 32 positions at a time */
+LSTR_TARGET("avx2")
+static const char *lmemfind_avx2 (const char *s1, size_t l1,
+                                  const char *s2, size_t l2,
+                                  const char **rest) {
+  const __m256i first = _mm256_set1_epi8(s2[0]);
+  const __m256i last = _mm256_set1_epi8(s2[l2-1]);
+  size_t n = l1 - l2 + 1;  /* number of positions `s2' can start at */
+  size_t i;
+  for (i = 0; i + 32 <= n; i += 32) {
+    __m256i bf = _mm256_loadu_si256((const __m256i *)(s1 + i));
+    __m256i bl = _mm256_loadu_si256((const __m256i *)(s1 + i + l2 - 1));
+    unsigned int mask = (unsigned int)_mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(bf, first),
+                         _mm256_cmpeq_epi8(bl, last)));
+    while (mask != 0) {
+      const char *init = s1 + i + firstbit(mask);
+      if (memcmp(init + 1, s2 + 1, l2 - 2) == 0)
+        return init;
+      mask &= mask - 1;
+    }
+  }
+  *rest = s1 + i;
+  return NULL;
+}
+
+#endif
+
+
 static const char *lmemfind (const char *s1, size_t l1,
                                const char *s2, size_t l2) {
   if (l2 == 0) return s1;  /* empty strings are everywhere */
   else if (l2 > l1) return NULL;  /* avoids a negative `l1' */
   else {
     const char *init;  /* to search for a `*s2' inside `s1' */
+#ifdef LSTR_SIMD
+    const char *rest;
+#ifdef LSTR_AVX2
+    if (l2 >= 2 && l1 >= l2 + 32 && hasavx2()) {
+      if ((init = lmemfind_avx2(s1, l1, s2, l2, &rest)) != NULL)
+        return init;
+      l1 -= rest - s1;  /* fewer than 32 positions are left */
+      s1 = rest;
+    }
+#endif
+    if (l2 >= 2 && l1 >= l2 + 16 && hassse2()) {
+      if ((init = lmemfind_sse2(s1, l1, s2, l2, &rest)) != NULL)
+        return init;
+      l1 -= rest - s1;  /* the last few positions are left */
+      s1 = rest;
+    }
+#endif
     l2--;  /* 1st char will be checked by `memchr' */
     l1 = l1-l2;  /* `s2' cannot be found after that */
     while (l1 > 0 && (init = (const char *)memchr(s1, *s2, l1)) != NULL) {
@@ -463,125 +721,643 @@ static const char *lmemfind (const char *s1, size_t l1,
 }
 
 
-static void push_onecapture (MatchState *ms, int i, const char *s,
-                                                    const char *e) {
-  if (i >= ms->level) {
-    if (i == 0)  /* ms->level == 0, too */
-      lua_pushlstring(ms->L, s, e - s);  /* add whole match */
-    else
-      luaL_error(ms->L, "invalid capture index");
-  }
-  else {
-    ptrdiff_t l = ms->capture[i].len;
-    if (l == CAP_UNFINISHED) luaL_error(ms->L, "unfinished capture");
-    if (l == CAP_POSITION)
-      lua_pushinteger(ms->L, ms->capture[i].init - ms->src_init + 1);
-    else
-      lua_pushlstring(ms->L, ms->capture[i].init, l);
+/*
+** {======================================================
+** COMPILED PATTERNS
+** =======================================================
+*/
+
+/*
+** A pattern is compiled into an array of items the first time it's used, so
+** that matching doesn't need to parse it again. Character classes and sets
+** become bitmaps. Compiled patterns are kept in a cache in the registry keyed
+** by the pattern string, which evicts the patterns that aren't being used
+** when it's full. Patterns which are malformed aren't compiled; they are
+** matched by `match' above so that they raise the same errors at the same
+** point. Bitmaps for classes depend on LC_CTYPE, so os.setlocale empties the
+** cache when it changes.
+*/
+
+#define PATTERN_CACHE_SIZE	64  /* number of patterns kept in the cache */
+
+#define SETSIZE		(UCHAR_MAX/CHAR_BIT + 1)
+
+enum {
+  PI_CHAR,  /* c1 */
+  PI_ANY,  /* `.' */
+  PI_SET,  /* character class or set */
+  PI_OPEN,  /* start of capture */
+  PI_POSITION,  /* position capture */
+  PI_CLOSE,  /* end of capture */
+  PI_BALANCE,  /* %b with c1 and c2 */
+  PI_FRONTIER,  /* %f with set */
+  PI_BACKREF,  /* %1-%9 with c1 */
+  PI_ENDANCHOR,  /* `$' at the end of the pattern */
+  PI_END
+};
+
+typedef struct PatternItem {
+  unsigned char op;
+  unsigned char rep;  /* `?', `*', `+', `-' or 0 for single character items */
+  unsigned char c1, c2;
+  const unsigned char *set;  /* bitmap of SETSIZE bytes */
+} PatternItem;
+
+typedef struct Pattern {
+  PatternItem *items;
+  size_t prefixlen;  /* length of the literal text every match starts with */
+  const char *prefix;
+} Pattern;
+
+
+#define testset(set,c)	((set)[(c) >> 3] & (1 << ((c) & 7)))
+
+
+static const char *checkclassend (const char *p) {
+  switch (*p++) {
+    case L_ESC: {
+      return (*p == '\0') ? NULL : p+1;
+    }
+    case '[': {
+      if (*p == '^') p++;
+      do {  /* look for a `]' */
+        if (*p == '\0') return NULL;
+        if (*(p++) == L_ESC && *p != '\0')
+          p++;  /* skip escapes (e.g. `%]') */
+      } while (*p != ']');
+      return p+1;
+    }
+    default: {
+      return p;
+    }
   }
 }
 
 
-static int push_captures (MatchState *ms, const char *s, const char *e) {
-  int i;
-  int nlevels = (ms->level == 0 && s) ? 1 : ms->level;
-  luaL_checkstack(ms->L, nlevels, "too many captures");
-  for (i = 0; i < nlevels; i++)
-    push_onecapture(ms, i, s, e);
-  return nlevels;  /* number of strings pushed */
+static void makeset (unsigned char *set, const char *p, const char *ep) {
+  int c;
+  memset(set, 0, SETSIZE);
+  for (c = 0; c <= UCHAR_MAX; c++) {
+    int m = (*p == '[') ? matchbracketclass(c, p, ep-1)
+                        : match_class(c, uchar(*(p+1)));
+    if (m) set[c >> 3] |= (1 << (c & 7));
+  }
 }
 
 
-static int str_find_aux (lua_State *L, int find) {
-  size_t l1, l2;
-  const char *s = luaL_checklstring(L, 1, &l1);
-  const char *p = luaL_checklstring(L, 2, &l2);
-  ptrdiff_t init = posrelat(luaL_optinteger(L, 3, 1), l1) - 1;
-  if (init < 0) init = 0;
-  else if ((size_t)(init) > l1) init = (ptrdiff_t)l1;
-  if (find && (lua_toboolean(L, 4) ||  /* explicit request? */
-      strpbrk(p, SPECIALS) == NULL)) {  /* or no special characters? */
-    /* do a plain search */
-    const char *s2 = lmemfind(s+init, l1-init, p, l2);
-    if (s2) {
-      lua_pushinteger(L, s2-s+1);
-      lua_pushinteger(L, s2-s+l2);
-      return 2;
-    }
-  }
-  else {
-    MatchState ms;
-    int anchor = (*p == '^') ? (p++, 1) : 0;
-    const char *s1=s+init;
-    ms.L = L;
-    ms.src_init = s;
-    ms.src_end = s+l1;
-    do {
-      const char *res;
-      ms.level = 0;
-      if ((res=match(&ms, s1, p)) != NULL) {
-        if (find) {
-          lua_pushinteger(L, s1-s+1);  /* start */
-          lua_pushinteger(L, res-s);   /* end */
-          return push_captures(&ms, NULL, 0) + 2;
+/*
+** Compiles the pattern into items (if items isn't NULL) and returns the
+** number of items and the number of sets in `nsets', or -1 if the pattern is
+** malformed.
+*/
+static int compilepattern (const char *p, PatternItem *items,
+                           unsigned char *sets, int *nsets) {
+  int n = 0;
+  *nsets = 0;
+  for (;;) {
+    PatternItem item;
+    item.rep = 0;
+    item.set = NULL;
+    switch (*p) {
+      case '(': {
+        item.op = (*(p+1) == ')') ? PI_POSITION : PI_OPEN;
+        p += (item.op == PI_POSITION) ? 2 : 1;
+        break;
+      }
+      case ')': {
+        item.op = PI_CLOSE;
+        p++;
+        break;
+      }
+      case '\0': {
+        item.op = PI_END;
+        break;
+      }
+      case L_ESC: {
+        if (*(p+1) == 'b') {
+          if (*(p+2) == '\0' || *(p+3) == '\0') return -1;
+          item.op = PI_BALANCE;
+          item.c1 = uchar(*(p+2));
+          item.c2 = uchar(*(p+3));
+          p += 4;
+          break;
         }
-        else
-          return push_captures(&ms, s1, res);
+        else if (*(p+1) == 'f') {
+          const char *ep;
+          p += 2;
+          if (*p != '[' || (ep = checkclassend(p)) == NULL) return -1;
+          item.op = PI_FRONTIER;
+          if (items) {
+            makeset(sets + *nsets * SETSIZE, p, ep);
+            item.set = sets + *nsets * SETSIZE;
+          }
+          (*nsets)++;
+          p = ep;
+          break;
+        }
+        else if (isdigit(uchar(*(p+1)))) {
+          item.op = PI_BACKREF;
+          item.c1 = uchar(*(p+1));
+          p += 2;
+          break;
+        }
+        goto dflt;
       }
-    } while (s1++ < ms.src_end && !anchor);
+      case '$': {
+        if (*(p+1) == '\0') {
+          item.op = PI_ENDANCHOR;
+          p++;
+          break;
+        }
+        goto dflt;
+      }
+      default: dflt: {
+        const char *ep = checkclassend(p);
+        if (ep == NULL) return -1;
+        if (*p == '.')
+          item.op = PI_ANY;
+        else if (*p == '[' ||
+                 (*p == L_ESC && strchr("acdlpsuwxz", tolower(uchar(*(p+1)))))) {
+          item.op = PI_SET;
+          if (items) {
+            makeset(sets + *nsets * SETSIZE, p, ep);
+            item.set = sets + *nsets * SETSIZE;
+          }
+          (*nsets)++;
+        }
+        else {
+          item.op = PI_CHAR;
+          item.c1 = uchar((*p == L_ESC) ? *(p+1) : *p);
+        }
+        if (*ep != '\0' && strchr("?*+-", *ep)) {
+          item.rep = uchar(*ep);
+          ep++;
+        }
+        p = ep;
+        break;
+      }
+    }
+    if (items) items[n] = item;
+    n++;
+    if (item.op == PI_END) return n;
   }
-  lua_pushnil(L);  /* not found */
-  return 1;
 }
 
 
-static int str_find (lua_State *L) {
-  return str_find_aux(L, 1);
+static int singlematchitem (int c, const PatternItem *it) {
+  switch (it->op) {
+    case PI_CHAR: return (c == it->c1);
+    case PI_ANY: return 1;
+    default: return testset(it->set, c);
+  }
 }
 
 
-static int str_match (lua_State *L) {
-  return str_find_aux(L, 0);
-}
+static const char *cmatch (MatchState *ms, const char *s,
+                           const PatternItem *it);
 
 
-static int gmatch_aux (lua_State *L) {
-  MatchState ms;
-  size_t ls;
-  const char *s = lua_tolstring(L, lua_upvalueindex(1), &ls);
-  const char *p = lua_tostring(L, lua_upvalueindex(2));
-  const char *src;
-  ms.L = L;
-  ms.src_init = s;
-  ms.src_end = s+ls;
-  for (src = s + (size_t)lua_tointeger(L, lua_upvalueindex(3));
-       src <= ms.src_end;
-       src++) {
-    const char *e;
-    ms.level = 0;
-    if ((e = match(&ms, src, p)) != NULL) {
-      lua_Integer newstart = e-s;
-      if (e == src) newstart++;  /* empty match? go at least one position */
-      lua_pushinteger(L, newstart);
-      lua_replace(L, lua_upvalueindex(3));
-      return push_captures(&ms, src, e);
-    }
+static const char *cmax_expand (MatchState *ms, const char *s,
+                                const PatternItem *it) {
+  ptrdiff_t i = 0;  /* counts maximum expand for item */
+  while ((s+i)<ms->src_end && singlematchitem(uchar(*(s+i)), it))
+    i++;
+  /* keeps trying to match with the maximum repetitions */
+  while (i>=0) {
+    const char *res = cmatch(ms, (s+i), it+1);
+    if (res) return res;
+    i--;  /* else didn't match; reduce 1 repetition to try again */
   }
-  return 0;  /* not found */
+  return NULL;
 }
 
 
-static int gmatch (lua_State *L) {
-  luaL_checkstring(L, 1);
-  luaL_checkstring(L, 2);
-  lua_settop(L, 2);
-  lua_pushinteger(L, 0);
-  lua_pushcclosure(L, gmatch_aux, 3);
-  return 1;
+static const char *cmin_expand (MatchState *ms, const char *s,
+                                const PatternItem *it) {
+  for (;;) {
+    const char *res = cmatch(ms, s, it+1);
+    if (res != NULL)
+      return res;
+    else if (s<ms->src_end && singlematchitem(uchar(*s), it))
+      s++;  /* try with one more repetition */
+    else return NULL;
+  }
 }
 
 
-static int gfind_nodef (lua_State *L) {
+static const char *cstart_capture (MatchState *ms, const char *s,
+                                   const PatternItem *it, int what) {
+  const char *res;
+  int level = ms->level;
+  if (level >= LUA_MAXCAPTURES) luaL_error(ms->L, "too many captures");
+  ms->capture[level].init = s;
+  ms->capture[level].len = what;
+  ms->level = level+1;
+  if ((res=cmatch(ms, s, it)) == NULL)  /* match failed? */
+    ms->level--;  /* undo capture */
+  return res;
+}
+
+
+static const char *cend_capture (MatchState *ms, const char *s,
+                                 const PatternItem *it) {
+  int l = capture_to_close(ms);
+  const char *res;
+  ms->capture[l].len = s - ms->capture[l].init;  /* close capture */
+  if ((res = cmatch(ms, s, it)) == NULL)  /* match failed? */
+    ms->capture[l].len = CAP_UNFINISHED;  /* undo capture */
+  return res;
+}
+
+
+/* same as `match', but for a compiled pattern */
+static const char *cmatch (MatchState *ms, const char *s,
+                           const PatternItem *it) {
+  init: /* using goto's to optimize tail recursion */
+  switch (it->op) {
+    case PI_OPEN: {
+      return cstart_capture(ms, s, it+1, CAP_UNFINISHED);
+    }
+    case PI_POSITION: {
+      return cstart_capture(ms, s, it+1, CAP_POSITION);
+    }
+    case PI_CLOSE: {
+      return cend_capture(ms, s, it+1);
+    }
+    case PI_BALANCE: {
+      char pattern[2];
+      pattern[0] = (char)it->c1;
+      pattern[1] = (char)it->c2;
+      s = matchbalance(ms, s, pattern);
+      if (s == NULL) return NULL;
+      it++; goto init;
+    }
+    case PI_FRONTIER: {
+      int previous = (s == ms->src_init) ? '\0' : uchar(*(s-1));
+      if (testset(it->set, previous) || !testset(it->set, uchar(*s)))
+        return NULL;
+      it++; goto init;
+    }
+    case PI_BACKREF: {
+      s = match_capture(ms, s, it->c1);
+      if (s == NULL) return NULL;
+      it++; goto init;
+    }
+    case PI_ENDANCHOR: {
+      return (s == ms->src_end) ? s : NULL;
+    }
+    case PI_END: {
+      return s;  /* match succeeded */
+    }
+    default: {  /* single character item */
+      int m = s<ms->src_end && singlematchitem(uchar(*s), it);
+      switch (it->rep) {
+        case '?': {  /* optional */
+          const char *res;
+          if (m && ((res=cmatch(ms, s+1, it+1)) != NULL))
+            return res;
+          it++; goto init;
+        }
+        case '*': {  /* 0 or more repetitions */
+          return cmax_expand(ms, s, it);
+        }
+        case '+': {  /* 1 or more repetitions */
+          return (m ? cmax_expand(ms, s+1, it) : NULL);
+        }
+        case '-': {  /* 0 or more repetitions (minimum) */
+          return cmin_expand(ms, s, it);
+        }
+        default: {
+          if (!m) return NULL;
+          s++; it++; goto init;
+        }
+      }
+    }
+  }
+}
+
+
+/*
+** Compiled patterns and formats are kept in caches in the registry keyed by
+** their strings. Each cache is a table in the registry at the field `key'.
+** Its slots 1 to `size' hold the cached strings, and index 0 holds
+** the next slot to reuse. When every slot is taken an entry is evicted with
+** the clock algorithm: entries which were used since the hand last passed
+** them are skipped (and their flag cleared), and the first one which
+** wasn't is replaced. The garbage collector frees the evicted entry, while
+** the patterns a script keeps using stay compiled. A string which can't be
+** compiled is cached as false, and never gets a second chance.
+*/
+typedef void *(*Compiler) (lua_State *L, const char *s, size_t l);
+
+
+/* header of a compiled pattern or format */
+typedef union CacheEntry {
+  LUAI_USER_ALIGNMENT_T dummy;  /* so the compiled form is aligned */
+  int used;  /* was it used since the clock hand passed it? */
+} CacheEntry;
+
+
+/*
+** Pushes a new userdata of `size' bytes for a compiled pattern or format
+** and returns its contents.
+*/
+static void *newcompiled (lua_State *L, size_t size) {
+  CacheEntry *e = (CacheEntry *)lua_newuserdata(L, sizeof(CacheEntry) + size);
+  e->used = 0;
+  return e + 1;
+}
+
+
+/* contents of the compiled pattern or format at index `idx', or NULL */
+static void *tocompiled (lua_State *L, int idx) {
+  CacheEntry *e = (CacheEntry *)lua_touserdata(L, idx);
+  return (e == NULL) ? NULL : e + 1;
+}
+
+
+/*
+** Finds a slot for a new entry in the cache at index `cache', evicting an
+** entry if every slot is taken, and stores the string at index `idx' in it.
+*/
+static void addcacheslot (lua_State *L, int cache, int size, int idx) {
+  int slot;
+  lua_rawgeti(L, cache, 0);
+  slot = (int)lua_tointeger(L, -1);
+  lua_pop(L, 1);
+  if (slot == 0) slot = 1;
+  for (;;) {
+    lua_rawgeti(L, cache, slot);
+    if (lua_isnil(L, -1)) {  /* slot never used? */
+      lua_pop(L, 1);
+      break;
+    }
+    lua_pushvalue(L, -1);
+    lua_rawget(L, cache);
+    if (lua_isuserdata(L, -1) &&
+        ((CacheEntry *)lua_touserdata(L, -1))->used) {
+      ((CacheEntry *)lua_touserdata(L, -1))->used = 0;  /* second chance */
+      lua_pop(L, 2);
+      slot = slot % size + 1;
+    }
+    else {
+      lua_pop(L, 1);
+      lua_pushnil(L);
+      lua_rawset(L, cache);  /* evict it; the old entry becomes garbage */
+      break;
+    }
+  }
+  lua_pushvalue(L, idx);
+  lua_rawseti(L, cache, slot);
+  lua_pushinteger(L, slot % size + 1);
+  lua_rawseti(L, cache, 0);
+}
+
+
+/*
+** Returns the compiled form of the string at index `idx' (whose contents
+** are `s' and `l'), compiling it with `compile' if it isn't in the cache.
+** The result is pushed onto the stack to keep it alive while it's used.
+** Returns NULL (and pushes nothing) if the string can't be compiled.
+*/
+static void *getcompiled (lua_State *L, const char *key, int size, int idx,
+                          const char *s, size_t l, Compiler compile) {
+  void *compiled;
+  int cache;
+  lua_getfield(L, LUA_REGISTRYINDEX, key);
+  cache = lua_gettop(L);
+  if (lua_isnil(L, cache)) {
+    lua_createtable(L, size, size + 1);
+    lua_replace(L, cache);
+    lua_pushvalue(L, cache);
+    lua_setfield(L, LUA_REGISTRYINDEX, key);
+  }
+  else {
+    lua_pushvalue(L, idx);
+    lua_rawget(L, cache);
+    if (lua_isuserdata(L, -1)) {  /* already compiled? */
+      ((CacheEntry *)lua_touserdata(L, -1))->used = 1;
+      lua_remove(L, cache);
+      return tocompiled(L, -1);
+    }
+    else if (!lua_isnil(L, -1)) {  /* known to be malformed? */
+      lua_pop(L, 2);
+      return NULL;
+    }
+    lua_pop(L, 1);
+  }
+  addcacheslot(L, cache, size, idx);
+  compiled = compile(L, s, l);
+  lua_pushvalue(L, idx);
+  if (compiled != NULL)
+    lua_pushvalue(L, -2);
+  else
+    lua_pushboolean(L, 0);
+  lua_rawset(L, cache);
+  lua_remove(L, cache);
+  return compiled;
+}
+
+
+/*
+** Compiles the pattern p, which ends at its first '\0' like in `match' (so
+** `l' isn't used).
+*/
+static void *newpattern (lua_State *L, const char *p, size_t l) {
+  int nsets;
+  int nitems = compilepattern(p, NULL, NULL, &nsets);
+  Pattern *pat;
+  PatternItem *it;
+  unsigned char *sets;
+  char *prefix;
+  int ncaptures = 0;
+  (void)l;
+  if (nitems < 0) return NULL;
+  pat = (Pattern *)newcompiled(L, sizeof(Pattern) +
+                                  nitems * sizeof(PatternItem) +
+                                  nsets * SETSIZE + nitems);
+  pat->items = (PatternItem *)(pat + 1);
+  sets = (unsigned char *)(pat->items + nitems);
+  prefix = (char *)(sets + nsets * SETSIZE);
+  compilepattern(p, pat->items, sets, &nsets);
+  /* the literal characters at the start of the pattern; captures which
+     start there don't match any characters */
+  pat->prefix = prefix;
+  pat->prefixlen = 0;
+  for (it = pat->items; ; it++) {
+    if ((it->op == PI_OPEN || it->op == PI_POSITION) &&
+        ++ncaptures <= LUA_MAXCAPTURES)
+      continue;
+    if (it->op != PI_CHAR || it->rep != 0)
+      break;
+    prefix[pat->prefixlen++] = (char)it->c1;
+  }
+  return pat;
+}
+
+
+/*
+** Returns the compiled pattern for the string at index `idx', which is
+** pushed onto the stack to keep it alive while it's used. Returns NULL (and
+** pushes nothing) if the pattern is malformed.
+*/
+static const Pattern *getpattern (lua_State *L, int idx, const char *p) {
+  return (const Pattern *)getcompiled(L, LUA_PATTERNCACHE,
+                                      PATTERN_CACHE_SIZE, idx, p, 0,
+                                      newpattern);
+}
+
+
+/*
+** Returns the first position from s where a match of the pattern could
+** start (which is s if the pattern isn't compiled), or NULL if there are
+** none.
+*/
+static const char *nextstart (const Pattern *pat, const char *s,
+                              const char *e) {
+  if (pat == NULL || pat->prefixlen == 0) return s;
+  return lmemfind(s, e - s, pat->prefix, pat->prefixlen);
+}
+
+
+/* matches the compiled pattern, or the pattern text if it isn't compiled */
+static const char *domatch (MatchState *ms, const char *s,
+                            const Pattern *pat, const char *p) {
+  return (pat != NULL) ? cmatch(ms, s, pat->items) : match(ms, s, p);
+}
+
+/* }====================================================== */
+
+
+static void push_onecapture (MatchState *ms, int i, const char *s,
+                                                    const char *e) {
+  if (i >= ms->level) {
+    if (i == 0)  /* ms->level == 0, too */
+      lua_pushlstring(ms->L, s, e - s);  /* add whole match */
+    else
+      luaL_error(ms->L, "invalid capture index");
+  }
+  else {
+    ptrdiff_t l = ms->capture[i].len;
+    if (l == CAP_UNFINISHED) luaL_error(ms->L, "unfinished capture");
+    if (l == CAP_POSITION)
+      lua_pushinteger(ms->L, ms->capture[i].init - ms->src_init + 1);
+    else
+      lua_pushlstring(ms->L, ms->capture[i].init, l);
+  }
+}
+
+
+static int push_captures (MatchState *ms, const char *s, const char *e) {
+  int i;
+  int nlevels = (ms->level == 0 && s) ? 1 : ms->level;
+  luaL_checkstack(ms->L, nlevels, "too many captures");
+  for (i = 0; i < nlevels; i++)
+    push_onecapture(ms, i, s, e);
+  return nlevels;  /* number of strings pushed */
+}
+
+
+static int str_find_aux (lua_State *L, int find) {
+  size_t l1, l2;
+  const char *s = luaL_checkbytes(L, 1, &l1);
+  const char *p = luaL_checklstring(L, 2, &l2);
+  ptrdiff_t init = posrelat(luaL_optinteger(L, 3, 1), l1) - 1;
+  if (init < 0) init = 0;
+  else if ((size_t)(init) > l1) init = (ptrdiff_t)l1;
+  if (find && (lua_toboolean(L, 4) ||  /* explicit request? */
+      strpbrk(p, SPECIALS) == NULL)) {  /* or no special characters? */
+    /* do a plain search */
+    const char *s2 = lmemfind(s+init, l1-init, p, l2);
+    if (s2) {
+      lua_pushinteger(L, s2-s+1);
+      lua_pushinteger(L, s2-s+l2);
+      return 2;
+    }
+  }
+  else {
+    MatchState ms;
+    int anchor = (*p == '^') ? (p++, 1) : 0;
+    const char *s1=s+init;
+    const Pattern *pat = getpattern(L, 2, p);
+    ms.L = L;
+    ms.src_init = s;
+    ms.src_end = s+l1;
+    do {
+      const char *res;
+      if (!anchor && (s1 = nextstart(pat, s1, ms.src_end)) == NULL)
+        break;  /* the pattern's prefix isn't in the rest of the string */
+      ms.level = 0;
+      if ((res=domatch(&ms, s1, pat, p)) != NULL) {
+        if (find) {
+          lua_pushinteger(L, s1-s+1);  /* start */
+          lua_pushinteger(L, res-s);   /* end */
+          return push_captures(&ms, NULL, 0) + 2;
+        }
+        else
+          return push_captures(&ms, s1, res);
+      }
+    } while (s1++ < ms.src_end && !anchor);
+  }
+  lua_pushnil(L);  /* not found */
+  return 1;
+}
+
+
+static int str_find (lua_State *L) {
+  return str_find_aux(L, 1);
+}
+
+
+static int str_match (lua_State *L) {
+  return str_find_aux(L, 0);
+}
+
+
+static int gmatch_aux (lua_State *L) {
+  MatchState ms;
+  size_t ls;
+  const char *s = lua_tolstring(L, lua_upvalueindex(1), &ls);
+  const char *p = lua_tostring(L, lua_upvalueindex(2));
+  const Pattern *pat = (const Pattern *)tocompiled(L, lua_upvalueindex(4));
+  const char *src;
+  ms.L = L;
+  ms.src_init = s;
+  ms.src_end = s+ls;
+  for (src = s + (size_t)lua_tointeger(L, lua_upvalueindex(3));
+       src <= ms.src_end;
+       src++) {
+    const char *e;
+    if ((src = nextstart(pat, src, ms.src_end)) == NULL)
+      break;
+    ms.level = 0;
+    if ((e = domatch(&ms, src, pat, p)) != NULL) {
+      lua_Integer newstart = e-s;
+      if (e == src) newstart++;  /* empty match? go at least one position */
+      lua_pushinteger(L, newstart);
+      lua_replace(L, lua_upvalueindex(3));
+      return push_captures(&ms, src, e);
+    }
+  }
+  return 0;  /* not found */
+}
+
+
+static int gmatch (lua_State *L) {
+  const char *p;
+  luaL_checkstring(L, 1);
+  p = luaL_checkstring(L, 2);
+  lua_settop(L, 2);
+  lua_pushinteger(L, 0);
+  /* patterns are compiled without a leading `^', which isn't an anchor here */
+  if (*p == '^' || getpattern(L, 2, p) == NULL)
+    lua_pushnil(L);
+  lua_pushcclosure(L, gmatch_aux, 4);
+  return 1;
+}
+
+
+static int gfind_nodef (lua_State *L) {
   return luaL_error(L, LUA_QL("string.gfind") " was renamed to "
                        LUA_QL("string.gmatch"));
 }
@@ -649,19 +1425,27 @@ static int str_gsub (lua_State *L) {
   int max_s = luaL_optint(L, 4, srcl+1);
   int anchor = (*p == '^') ? (p++, 1) : 0;
   int n = 0;
+  const Pattern *pat;
   MatchState ms;
   luaL_Buffer b;
   luaL_argcheck(L, tr == LUA_TNUMBER || tr == LUA_TSTRING ||
                    tr == LUA_TFUNCTION || tr == LUA_TTABLE, 3,
                       "string/function/table expected");
+  pat = getpattern(L, 2, p);
   luaL_buffinit(L, &b);
   ms.L = L;
   ms.src_init = src;
   ms.src_end = src+srcl;
   while (n < max_s) {
     const char *e;
+    if (!anchor) {  /* skip the text which can't start a match */
+      const char *next = nextstart(pat, src, ms.src_end);
+      if (next == NULL) break;
+      luaL_addlstring(&b, src, next - src);
+      src = next;
+    }
     ms.level = 0;
-    e = match(&ms, src, p);
+    e = domatch(&ms, src, pat, p);
     if (e) {
       n++;
       add_value(&ms, &b, src, e);
@@ -753,76 +1537,953 @@ static void addintlen (char *form) {
 }
 
 
-static int str_format (lua_State *L) {
-  int arg = 1;
-  size_t sfl;
-  const char *strfrmt = luaL_checklstring(L, arg, &sfl);
-  const char *strfrmt_end = strfrmt+sfl;
-  luaL_Buffer b;
-  luaL_buffinit(L, &b);
-  while (strfrmt < strfrmt_end) {
-    if (*strfrmt != L_ESC)
-      luaL_addchar(&b, *strfrmt++);
-    else if (*++strfrmt == L_ESC)
-      luaL_addchar(&b, *strfrmt++);  /* %% */
-    else { /* format item */
-      char form[MAX_FORMAT];  /* to store the format (`%...') */
-      char buff[MAX_ITEM];  /* to store the formatted item */
-      arg++;
-      strfrmt = scanformat(L, strfrmt, form);
-      switch (*strfrmt++) {
-        case 'c': {
-          sprintf(buff, form, (int)luaL_checknumber(L, arg));
-          break;
-        }
-        case 'd':  case 'i': {
-          addintlen(form);
-          sprintf(buff, form, (LUA_INTFRM_T)luaL_checknumber(L, arg));
-          break;
-        }
-        case 'o':  case 'u':  case 'x':  case 'X': {
-          addintlen(form);
-          sprintf(buff, form, (unsigned LUA_INTFRM_T)luaL_checknumber(L, arg));
-          break;
-        }
-        case 'e':  case 'E': case 'f':
-        case 'g': case 'G': {
-          sprintf(buff, form, (double)luaL_checknumber(L, arg));
-          break;
-        }
-        case 'q': {
-          addquoted(L, &b, arg);
-          continue;  /* skip the 'addsize' at the end */
-        }
-        case 's': {
-          size_t l;
-          const char *s = luaL_checklstring(L, arg, &l);
-          if (!strchr(form, '.') && l >= 100) {
-            /* no precision and string is too long to be formatted;
-               keep original string */
-            lua_pushvalue(L, arg);
-            luaL_addvalue(&b);
-            continue;  /* skip the `addsize' at the end */
-          }
-          else {
-            sprintf(buff, form, s);
-            break;
-          }
-        }
-        default: {  /* also treat cases `pnLlh' */
-          return luaL_error(L, "invalid option " LUA_QL("%%%c") " to "
-                               LUA_QL("format"), *(strfrmt - 1));
+/*
+** Adds argument `arg' formatted by sprintf with the C format `form', whose
+** conversion character is `conversion' (any conversion but `q'). Integer
+** conversions must already have LUA_INTFRMLEN in the format.
+*/
+static void addformatted (lua_State *L, luaL_Buffer *b, const char *form,
+                          int conversion, int arg) {
+  char buff[MAX_ITEM];  /* to store the formatted item */
+  switch (conversion) {
+    case 'c': {
+      sprintf(buff, form, (int)luaL_checknumber(L, arg));
+      break;
+    }
+    case 'd':  case 'i': {
+      sprintf(buff, form, (LUA_INTFRM_T)luaL_checknumber(L, arg));
+      break;
+    }
+    case 'o':  case 'u':  case 'x':  case 'X': {
+      sprintf(buff, form, (unsigned LUA_INTFRM_T)luaL_checknumber(L, arg));
+      break;
+    }
+    case 's': {
+      size_t l;
+      const char *s = luaL_checklstring(L, arg, &l);
+      if (!strchr(form, '.') && l >= 100) {
+        /* no precision and string is too long to be formatted;
+           keep original string */
+        luaL_addlstring(b, s, l);
+        return;
+      }
+      sprintf(buff, form, s);
+      break;
+    }
+    default: {  /* `e', `E', `f', `g' or `G' */
+      sprintf(buff, form, (double)luaL_checknumber(L, arg));
+      break;
+    }
+  }
+  luaL_addlstring(b, buff, strlen(buff));
+}
+
+
+/*
+** {======================================================
+** COMPILED FORMATS
+** =======================================================
+*/
+
+/*
+** A format string is compiled into an array of items the first time it's
+** used, so that formatting doesn't need to scan it again. Runs of literal
+** text (with `%%' already replaced) are added in one piece, and `%s', `%d'
+** and `%i' without flags, width or precision are formatted without sprintf.
+** The other items keep the C format that scanformat would build for them.
+** Compiled formats are cached like compiled patterns. Formats which are
+** malformed aren't compiled; they are interpreted by str_format so that they
+** raise the same errors at the same point.
+*/
+
+#define FORMAT_CACHE_SIZE	64  /* number of formats kept in the cache */
+
+enum {
+  FI_LITERAL,  /* literal text */
+  FI_STRING,  /* plain `%s' */
+  FI_INTEGER,  /* plain `%d' or `%i' */
+  FI_QUOTED,  /* `%q' */
+  FI_SPRINTF,  /* any other item; text is its C format */
+  FI_END
+};
+
+typedef struct FormatItem {
+  unsigned char op;
+  char conversion;  /* conversion character of a FI_SPRINTF item */
+  size_t l;  /* length of the literal text */
+  const char *text;
+} FormatItem;
+
+
+#define FORMATCACHE	"_FORMATS"  /* key of the cache in the registry */
+
+
+/*
+** Compiles the format into items, and the literal text and C formats which
+** the items point to into text. If items is NULL nothing is stored, which is
+** used to find the sizes of the arrays. Returns the number of items
+** (including the FI_END item) and stores the number of characters of text
+** in ntext, or returns -1 if the format is malformed.
+*/
+static int compileformat (const char *strfrmt, size_t sfl, FormatItem *items,
+                          char *text, size_t *ntext) {
+  const char *strfrmt_end = strfrmt+sfl;
+  int nitems = 0;
+  int inliteral = 0;  /* is the last item a literal we can add to? */
+  size_t n = 0;
+  while (strfrmt < strfrmt_end) {
+    if (*strfrmt != L_ESC || *(strfrmt + 1) == L_ESC) {  /* text or `%%' */
+      if (!inliteral) {
+        if (items) {
+          items[nitems].op = FI_LITERAL;
+          items[nitems].l = 0;
+          items[nitems].text = text + n;
         }
+        nitems++;
+        inliteral = 1;
+      }
+      if (items) {
+        text[n] = *strfrmt;
+        items[nitems - 1].l++;
+      }
+      n++;
+      strfrmt += (*strfrmt == L_ESC) ? 2 : 1;
+    }
+    else {  /* format item; same checks as scanformat */
+      const char *p = ++strfrmt;
+      size_t fl;
+      int op;
+      while (*p != '\0' && strchr(FLAGS, *p) != NULL) p++;  /* skip flags */
+      if ((size_t)(p - strfrmt) >= sizeof(FLAGS)) return -1;
+      if (isdigit(uchar(*p))) p++;  /* skip width */
+      if (isdigit(uchar(*p))) p++;  /* (2 digits at most) */
+      if (*p == '.') {
+        p++;
+        if (isdigit(uchar(*p))) p++;  /* skip precision */
+        if (isdigit(uchar(*p))) p++;  /* (2 digits at most) */
+      }
+      if (isdigit(uchar(*p))) return -1;
+      fl = p - strfrmt;  /* length of the flags, width and precision */
+      switch (*p) {
+        case 'd':  case 'i': op = (fl == 0) ? FI_INTEGER : FI_SPRINTF; break;
+        case 's': op = (fl == 0) ? FI_STRING : FI_SPRINTF; break;
+        case 'q': op = FI_QUOTED; break;
+        case 'c':  case 'o':  case 'u':  case 'x':  case 'X':
+        case 'e':  case 'E': case 'f':
+        case 'g': case 'G': op = FI_SPRINTF; break;
+        default: return -1;
+      }
+      if (items) {
+        items[nitems].op = (unsigned char)op;
+        items[nitems].conversion = *p;
+        items[nitems].l = 0;
+        items[nitems].text = text + n;
+      }
+      if (op == FI_SPRINTF) {
+        /* `%', the flags, width and precision, the integer length, the
+           conversion and a '\0' */
+        if (items) {
+          char *form = text + n;
+          *(form++) = '%';
+          memcpy(form, strfrmt, fl);
+          form += fl;
+          if (strchr("diouxX", *p) != NULL) {
+            memcpy(form, LUA_INTFRMLEN, sizeof(LUA_INTFRMLEN) - 1);
+            form += sizeof(LUA_INTFRMLEN) - 1;
+          }
+          *(form++) = *p;
+          *form = '\0';
+        }
+        n += fl + sizeof(LUA_INTFRMLEN) + 2;
+      }
+      nitems++;
+      inliteral = 0;
+      strfrmt = p + 1;
+    }
+  }
+  if (items) items[nitems].op = FI_END;
+  *ntext = n;
+  return nitems + 1;
+}
+
+
+static void *newformat (lua_State *L, const char *strfrmt, size_t sfl) {
+  size_t ntext;
+  int nitems = compileformat(strfrmt, sfl, NULL, NULL, &ntext);
+  FormatItem *items;
+  if (nitems < 0) return NULL;
+  items = (FormatItem *)newcompiled(L, nitems * sizeof(FormatItem) + ntext);
+  compileformat(strfrmt, sfl, items, (char *)(items + nitems), &ntext);
+  return items;
+}
+
+
+/*
+** Returns the compiled format for the string at index `idx', which is
+** pushed onto the stack to keep it alive while it's used. Returns NULL (and
+** pushes nothing) if the format is malformed.
+*/
+static const FormatItem *getformat (lua_State *L, int idx,
+                                    const char *strfrmt, size_t sfl) {
+  return (const FormatItem *)getcompiled(L, FORMATCACHE, FORMAT_CACHE_SIZE,
+                                         idx, strfrmt, sfl, newformat);
+}
+
+
+/* same as sprintf with "%d" and LUA_INTFRMLEN */
+static void addinteger (luaL_Buffer *b, LUA_INTFRM_T n) {
+  char buff[3 * sizeof(LUA_INTFRM_T) + 2];
+  char *p = buff + sizeof(buff);
+  unsigned LUA_INTFRM_T u = (unsigned LUA_INTFRM_T)n;
+  if (n < 0) u = 0 - u;
+  do {
+    *(--p) = (char)('0' + u % 10);
+    u /= 10;
+  } while (u != 0);
+  if (n < 0) *(--p) = '-';
+  luaL_addlstring(b, p, buff + sizeof(buff) - p);
+}
+
+
+/* `arg' is the index of the format; the values follow it */
+static void addcompiled (lua_State *L, luaL_Buffer *b,
+                         const FormatItem *it, int arg) {
+  for (; it->op != FI_END; it++) {
+    switch (it->op) {
+      case FI_LITERAL: {
+        luaL_addlstring(b, it->text, it->l);
+        break;
+      }
+      case FI_STRING: {
+        size_t l;
+        const char *s = luaL_checklstring(L, ++arg, &l);
+        if (l < 100) l = strlen(s);  /* sprintf stops at a '\0' */
+        luaL_addlstring(b, s, l);
+        break;
+      }
+      case FI_INTEGER: {
+        addinteger(b, (LUA_INTFRM_T)luaL_checknumber(L, ++arg));
+        break;
+      }
+      case FI_QUOTED: {
+        addquoted(L, b, ++arg);
+        break;
+      }
+      default: {
+        addformatted(L, b, it->text, it->conversion, ++arg);
+        break;
       }
-      luaL_addlstring(&b, buff, strlen(buff));
     }
   }
+}
+
+/* }====================================================== */
+
+
+/*
+** Adds the values after index `arg' formatted by the format at `arg'.
+*/
+static void addformat (lua_State *L, luaL_Buffer *b, int arg) {
+  size_t sfl;
+  const char *strfrmt = luaL_checklstring(L, arg, &sfl);
+  const char *strfrmt_end = strfrmt+sfl;
+  const FormatItem *items = getformat(L, arg, strfrmt, sfl);
+  if (items != NULL) {
+    /* the values are checked by index, so a missing one mustn't find the
+       compiled format; the cache in the registry keeps it alive while no
+       other format is compiled */
+    lua_pop(L, 1);
+    addcompiled(L, b, items, arg);
+    return;
+  }
+  while (strfrmt < strfrmt_end) {
+    if (*strfrmt != L_ESC)
+      luaL_addchar(b, *strfrmt++);
+    else if (*++strfrmt == L_ESC)
+      luaL_addchar(b, *strfrmt++);  /* %% */
+    else { /* format item */
+      char form[MAX_FORMAT];  /* to store the format (`%...') */
+      arg++;
+      strfrmt = scanformat(L, strfrmt, form);
+      switch (*strfrmt++) {
+        case 'd':  case 'i':
+        case 'o':  case 'u':  case 'x':  case 'X': {
+          addintlen(form);
+          addformatted(L, b, form, *(strfrmt - 1), arg);
+          break;
+        }
+        case 'c':  case 'e':  case 'E': case 'f':
+        case 'g': case 'G': case 's': {
+          addformatted(L, b, form, *(strfrmt - 1), arg);
+          break;
+        }
+        case 'q': {
+          addquoted(L, b, arg);
+          break;
+        }
+        default: {  /* also treat cases `pnLlh' */
+          luaL_error(L, "invalid option " LUA_QL("%%%c") " to "
+                        LUA_QL("format"), *(strfrmt - 1));
+        }
+      }
+    }
+  }
+}
+
+
+static int str_format (lua_State *L) {
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  addformat(L, &b, 1);
   luaL_pushresult(&b);
   return 1;
 }
 
 
+/*
+** {======================================================
+** PACK/UNPACK
+** =======================================================
+*/
+
+/*
+** string.pack, string.unpack and string.packsize as in Lua 5.3. Numbers
+** are lua_Numbers here, so integers are packed and unpacked through a 64
+** bit integer type (KInt), which is also the size of `j' and `J' since
+** lua_Integer may be narrower. Integer arguments must have an exact integer
+** value which fits in the field. Unsigned fields are always unpacked as
+** non-negative numbers. Unpacking reads the fields straight from the data
+** string.
+*/
+
+#if defined(_MSC_VER)
+#define PACK_INT	__int64
+#else
+#define PACK_INT	long long
+#endif
+
+typedef PACK_INT KInt;
+typedef unsigned PACK_INT KUnsigned;
+
+/* value used for padding */
+#define PACKPADBYTE	0x00
+
+/* maximum size for the binary representation of an integer */
+#define MAXINTSIZE	16
+
+/* number of bits in a character */
+#define NB	CHAR_BIT
+
+/* mask for one character (NB 1's) */
+#define MC	((1 << NB) - 1)
+
+/* size of the integers used to pack and unpack */
+#define SZINT	((int)sizeof(KInt))
+
+/* maximum size of a packed string */
+#define MAXPACKSIZE	(~(size_t)0 >> 1)
+
+/* dummy union to get native endianness */
+static const union {
+  int dummy;
+  char little;  /* true iff machine is little endian */
+} nativeendian = {1};
+
+/* dummy structure to get native alignment requirements */
+struct cD {
+  char c;
+  union { double d; void *p; KInt i; lua_Number n; } u;
+};
+
+#define MAXALIGN	(offsetof(struct cD, u))
+
+/* union for serializing floats */
+typedef union Ftypes {
+  float f;
+  double d;
+  lua_Number n;
+  char buff[5 * sizeof(lua_Number)];  /* enough for any float type */
+} Ftypes;
+
+/* information to pack/unpack stuff */
+typedef struct Header {
+  lua_State *L;
+  int islittle;
+  int maxalign;
+} Header;
+
+/* options for pack/unpack */
+typedef enum KOption {
+  Kint,  /* signed integers */
+  Kuint,  /* unsigned integers */
+  Kfloat,  /* floating-point numbers */
+  Kchar,  /* fixed-length strings */
+  Kstring,  /* strings with prefixed length */
+  Kzstr,  /* zero-terminated strings */
+  Kpadding,  /* padding */
+  Kpaddalign,  /* padding for alignment */
+  Knop  /* no-op (configuration or spaces) */
+} KOption;
+
+
+/*
+** Reads an integer numeral from `fmt' or returns `df' if there is no
+** numeral.
+*/
+static int getnum (const char **fmt, int df) {
+  if (!isdigit(uchar(**fmt)))  /* no number? */
+    return df;  /* return default value */
+  else {
+    int a = 0;
+    do {
+      a = a*10 + (*((*fmt)++) - '0');
+    } while (isdigit(uchar(**fmt)) && a <= (INT_MAX - 9)/10);
+    return a;
+  }
+}
+
+
+/*
+** Reads an integer numeral and raises an error if it is larger than the
+** maximum size for integers.
+*/
+static int getnumlimit (Header *h, const char **fmt, int df) {
+  int sz = getnum(fmt, df);
+  if (sz > MAXINTSIZE || sz <= 0)
+    luaL_error(h->L, "integral size (%d) out of limits [1,%d]",
+                     sz, MAXINTSIZE);
+  return sz;
+}
+
+
+static void initheader (lua_State *L, Header *h) {
+  h->L = L;
+  h->islittle = nativeendian.little;
+  h->maxalign = 1;
+}
+
+
+/*
+** Reads and classifies the next option. `size' is filled with the option's
+** size.
+*/
+static KOption getoption (Header *h, const char **fmt, int *size) {
+  int opt = *((*fmt)++);
+  *size = 0;  /* default */
+  switch (opt) {
+    case 'b': *size = sizeof(char); return Kint;
+    case 'B': *size = sizeof(char); return Kuint;
+    case 'h': *size = sizeof(short); return Kint;
+    case 'H': *size = sizeof(short); return Kuint;
+    case 'l': *size = sizeof(long); return Kint;
+    case 'L': *size = sizeof(long); return Kuint;
+    case 'j': *size = sizeof(KInt); return Kint;
+    case 'J': *size = sizeof(KInt); return Kuint;
+    case 'T': *size = sizeof(size_t); return Kuint;
+    case 'f': *size = sizeof(float); return Kfloat;
+    case 'd': *size = sizeof(double); return Kfloat;
+    case 'n': *size = sizeof(lua_Number); return Kfloat;
+    case 'i': *size = getnumlimit(h, fmt, sizeof(int)); return Kint;
+    case 'I': *size = getnumlimit(h, fmt, sizeof(int)); return Kuint;
+    case 's': *size = getnumlimit(h, fmt, sizeof(size_t)); return Kstring;
+    case 'c': {
+      *size = getnum(fmt, -1);
+      if (*size == -1)
+        luaL_error(h->L, "missing size for format option " LUA_QL("c"));
+      return Kchar;
+    }
+    case 'z': return Kzstr;
+    case 'x': *size = 1; return Kpadding;
+    case 'X': return Kpaddalign;
+    case ' ': break;
+    case '<': h->islittle = 1; break;
+    case '>': h->islittle = 0; break;
+    case '=': h->islittle = nativeendian.little; break;
+    case '!': h->maxalign = getnumlimit(h, fmt, MAXALIGN); break;
+    default: luaL_error(h->L, "invalid format option " LUA_QL("%c"), opt);
+  }
+  return Knop;
+}
+
+
+/*
+** Reads, classifies and fills in the other details of the next option.
+** `psize' is filled with the option's size, `ntoalign' with the padding
+** needed before it. The `X' option always gets its full alignment, other
+** options are limited by the maximum alignment (`maxalign'). The `c'
+** option needs no alignment despite its size.
+*/
+static KOption getdetails (Header *h, size_t totalsize,
+                           const char **fmt, int *psize, int *ntoalign) {
+  KOption opt = getoption(h, fmt, psize);
+  int align = *psize;  /* usually, alignment follows size */
+  if (opt == Kpaddalign) {  /* `X' gets alignment from following option */
+    if (**fmt == '\0' || getoption(h, fmt, &align) == Kchar || align == 0)
+      luaL_argerror(h->L, 1, "invalid next option for option " LUA_QL("X"));
+  }
+  if (align <= 1 || opt == Kchar)  /* need no alignment? */
+    *ntoalign = 0;
+  else {
+    if (align > h->maxalign)  /* enforce maximum alignment */
+      align = h->maxalign;
+    if ((align & (align - 1)) != 0)  /* is `align' not a power of 2? */
+      luaL_argerror(h->L, 1, "format asks for alignment not power of 2");
+    *ntoalign = (align - (int)(totalsize & (align - 1))) & (align - 1);
+  }
+  return opt;
+}
+
+
+/*
+** Returns argument `arg' as an integer to pack in `size' bytes, raising an
+** error if it isn't integral or doesn't fit. Unsigned fields at least as
+** large as KInt also accept negative numbers (which are packed in two's
+** complement).
+*/
+static KUnsigned checkpackint (lua_State *L, int arg, int size,
+                               int issigned) {
+  lua_Number n = luaL_checknumber(L, arg);
+  int bits = ((size < SZINT) ? size : SZINT) * NB;
+  luaL_argcheck(L, floor(n) == n, arg, "number has no integer representation");
+  if (issigned)
+    luaL_argcheck(L, -ldexp(1, bits - 1) <= n && n < ldexp(1, bits - 1), arg,
+                     "integer overflow");
+  else
+    luaL_argcheck(L, ((size < SZINT) ? 0 : -ldexp(1, bits - 1)) <= n &&
+                     n < ldexp(1, bits), arg, "unsigned overflow");
+  return (n < 0) ? (KUnsigned)(KInt)n : (KUnsigned)n;
+}
+
+
+/*
+** Packs the integer `n' with `size' bytes and `islittle' endianness. The
+** final `if' handles the case when `size' is larger than the size of a
+** KInt, correcting the extra sign-extension bytes if necessary (by default
+** they would be zeros).
+*/
+static void packint (luaL_Buffer *b, KUnsigned n,
+                     int islittle, int size, int neg) {
+  char buff[MAXINTSIZE];
+  int i;
+  buff[islittle ? 0 : size - 1] = (char)(n & MC);  /* first byte */
+  for (i = 1; i < size; i++) {
+    n >>= NB;
+    buff[islittle ? i : size - 1 - i] = (char)(n & MC);
+  }
+  if (neg && size > SZINT) {  /* negative number need sign extension? */
+    for (i = SZINT; i < size; i++)  /* correct extra bytes */
+      buff[islittle ? i : size - 1 - i] = (char)MC;
+  }
+  luaL_addlstring(b, buff, size);  /* add result to buffer */
+}
+
+
+/*
+** Copies `size' bytes from `src' to `dest', correcting endianness if
+** `islittle' is different from native endianness.
+*/
+static void copywithendian (volatile char *dest, volatile const char *src,
+                            int size, int islittle) {
+  if (islittle == nativeendian.little) {
+    while (size-- != 0)
+      *(dest++) = *(src++);
+  }
+  else {
+    dest += size - 1;
+    while (size-- != 0)
+      *(dest--) = *(src++);
+  }
+}
+
+
+static int str_pack (lua_State *L) {
+  luaL_Buffer b;
+  Header h;
+  const char *fmt = luaL_checkstring(L, 1);  /* format string */
+  int arg = 1;  /* current argument to pack */
+  size_t totalsize = 0;  /* accumulate total size of result */
+  initheader(L, &h);
+  luaL_buffinit(L, &b);
+  while (*fmt != '\0') {
+    int size, ntoalign;
+    KOption opt = getdetails(&h, totalsize, &fmt, &size, &ntoalign);
+    totalsize += ntoalign + size;
+    while (ntoalign-- > 0)
+      luaL_addchar(&b, PACKPADBYTE);  /* fill alignment */
+    arg++;
+    switch (opt) {
+      case Kint:
+      case Kuint: {  /* integers */
+        KUnsigned n = checkpackint(L, arg, size, (opt == Kint));
+        packint(&b, n, h.islittle, size, lua_tonumber(L, arg) < 0);
+        break;
+      }
+      case Kfloat: {  /* floating-point options */
+        volatile Ftypes u;
+        char buff[sizeof(Ftypes)];
+        lua_Number n = luaL_checknumber(L, arg);  /* get argument */
+        if (size == sizeof(u.f)) u.f = (float)n;  /* copy it into `u' */
+        else if (size == sizeof(u.d)) u.d = (double)n;
+        else u.n = n;
+        /* move `u' to final result, correcting endianness if needed */
+        copywithendian(buff, u.buff, size, h.islittle);
+        luaL_addlstring(&b, buff, size);
+        break;
+      }
+      case Kchar: {  /* fixed-size string */
+        size_t len;
+        const char *s = luaL_checklstring(L, arg, &len);
+        luaL_argcheck(L, len <= (size_t)size, arg,
+                         "string longer than given size");
+        luaL_addlstring(&b, s, len);  /* add string */
+        while (len++ < (size_t)size)  /* pad extra space */
+          luaL_addchar(&b, PACKPADBYTE);
+        break;
+      }
+      case Kstring: {  /* strings with length count */
+        size_t len;
+        const char *s = luaL_checklstring(L, arg, &len);
+        luaL_argcheck(L, size >= (int)sizeof(size_t) ||
+                         len < ((size_t)1 << (size * NB)),
+                         arg, "string length does not fit in given size");
+        packint(&b, (KUnsigned)len, h.islittle, size, 0);  /* pack length */
+        luaL_addlstring(&b, s, len);
+        totalsize += len;
+        break;
+      }
+      case Kzstr: {  /* zero-terminated string */
+        size_t len;
+        const char *s = luaL_checklstring(L, arg, &len);
+        luaL_argcheck(L, strlen(s) == len, arg, "string contains zeros");
+        luaL_addlstring(&b, s, len);
+        luaL_addchar(&b, '\0');  /* add zero at the end */
+        totalsize += len + 1;
+        break;
+      }
+      case Kpadding: luaL_addchar(&b, PACKPADBYTE);  /* go through */
+      case Kpaddalign: case Knop:
+        arg--;  /* undo increment */
+        break;
+    }
+  }
+  luaL_pushresult(&b);
+  return 1;
+}
+
+
+static int str_packsize (lua_State *L) {
+  Header h;
+  const char *fmt = luaL_checkstring(L, 1);  /* format string */
+  size_t totalsize = 0;  /* accumulate total size of result */
+  initheader(L, &h);
+  while (*fmt != '\0') {
+    int size, ntoalign;
+    KOption opt = getdetails(&h, totalsize, &fmt, &size, &ntoalign);
+    luaL_argcheck(L, opt != Kstring && opt != Kzstr, 1,
+                     "variable-size format in packsize");
+    size += ntoalign;  /* total space used by option */
+    luaL_argcheck(L, totalsize <= MAXPACKSIZE - size, 1,
+                     "format result too large");
+    totalsize += size;
+  }
+  lua_pushnumber(L, (lua_Number)totalsize);
+  return 1;
+}
+
+
+/*
+** Unpacks an integer with `size' bytes and `islittle' endianness. If size
+** is smaller than the size of a KInt and the integer is signed, it must do
+** sign extension (propagating the sign to the higher bits); if size is
+** larger than the size of a KInt, it must check the unread bytes to see
+** whether they do not cause an overflow.
+*/
+static KUnsigned unpackint (lua_State *L, const char *str,
+                            int islittle, int size, int issigned) {
+  KUnsigned res = 0;
+  int i;
+  int limit = (size <= SZINT) ? size : SZINT;
+  for (i = limit - 1; i >= 0; i--) {
+    res <<= NB;
+    res |= (KUnsigned)(unsigned char)str[islittle ? i : size - 1 - i];
+  }
+  if (size < SZINT) {  /* real size smaller than KInt? */
+    if (issigned) {  /* needs sign extension? */
+      KUnsigned mask = (KUnsigned)1 << (size*NB - 1);
+      res = ((res ^ mask) - mask);  /* do sign extension */
+    }
+  }
+  else if (size > SZINT) {  /* must check unread bytes */
+    int mask = (!issigned || (KInt)res >= 0) ? 0 : MC;
+    for (i = limit; i < size; i++) {
+      if ((unsigned char)str[islittle ? i : size - 1 - i] != mask)
+        luaL_error(L, "%d-byte integer does not fit into Lua Integer", size);
+    }
+  }
+  return res;
+}
+
+
+static int str_unpack (lua_State *L) {
+  Header h;
+  const char *fmt = luaL_checkstring(L, 1);
+  size_t ld;
+  const char *data = luaL_checkbytes(L, 2, &ld);
+  size_t pos = (size_t)posrelat(luaL_optinteger(L, 3, 1), ld) - 1;
+  int n = 0;  /* number of results */
+  luaL_argcheck(L, pos <= ld, 3, "initial position out of string");
+  initheader(L, &h);
+  while (*fmt != '\0') {
+    int size, ntoalign;
+    KOption opt = getdetails(&h, pos, &fmt, &size, &ntoalign);
+    if ((size_t)ntoalign + size > ~pos || pos + ntoalign + size > ld)
+      luaL_argerror(L, 2, "data string too short");
+    pos += ntoalign;  /* skip alignment */
+    /* stack space for item + next position */
+    luaL_checkstack(L, 2, "too many results");
+    n++;
+    switch (opt) {
+      case Kint: {
+        KUnsigned res = unpackint(L, data + pos, h.islittle, size, 1);
+        lua_pushnumber(L, (lua_Number)(KInt)res);
+        break;
+      }
+      case Kuint: {
+        KUnsigned res = unpackint(L, data + pos, h.islittle, size, 0);
+        lua_pushnumber(L, (lua_Number)res);
+        break;
+      }
+      case Kfloat: {
+        volatile Ftypes u;
+        lua_Number num;
+        copywithendian(u.buff, data + pos, size, h.islittle);
+        if (size == sizeof(u.f)) num = (lua_Number)u.f;
+        else if (size == sizeof(u.d)) num = (lua_Number)u.d;
+        else num = u.n;
+        lua_pushnumber(L, num);
+        break;
+      }
+      case Kchar: {
+        lua_pushlstring(L, data + pos, size);
+        break;
+      }
+      case Kstring: {
+        KUnsigned len = unpackint(L, data + pos, h.islittle, size, 0);
+        luaL_argcheck(L, len <= (KUnsigned)(ld - pos - size), 2,
+                         "data string too short");
+        lua_pushlstring(L, data + pos + size, (size_t)len);
+        pos += (size_t)len;  /* skip string */
+        break;
+      }
+      case Kzstr: {
+        size_t len = strlen(data + pos);
+        luaL_argcheck(L, pos + len < ld, 2,
+                         "unfinished string for format " LUA_QL("z"));
+        lua_pushlstring(L, data + pos, len);
+        pos += len + 1;  /* skip string plus final '\0' */
+        break;
+      }
+      case Kpaddalign: case Kpadding: case Knop:
+        n--;  /* undo increment */
+        break;
+    }
+    pos += size;
+  }
+  lua_pushinteger(L, pos + 1);  /* next position */
+  return n + 1;
+}
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** STRING BUFFERS
+** =======================================================
+*/
+
+/*
+** A string buffer accumulates bytes without making a string for each piece
+** (see luaL_StrBuffer). When it runs out of space, the unread bytes are
+** moved to the start, and if they still don't fit they're copied into a
+** userdata twice as large, which replaces the old one in the environment.
+** The space is kept when the buffer is emptied, so a buffer which is reused
+** stops allocating once it's large enough. Functions which read strings
+** with luaL_checkbytes (io.write, string.find, string.match and
+** string.unpack) read the contents in place.
+*/
+
+#define STRBUFFER_MINSIZE	32  /* space in a new buffer */
+
+
+static luaL_StrBuffer *checkstrbuffer (lua_State *L) {
+  return (luaL_StrBuffer *)luaL_checkudata(L, 1, LUAL_STRBUFFER);
+}
+
+
+/*
+** Makes room for `n' more bytes in the buffer at index 1.
+*/
+static void reservestrbuffer (lua_State *L, luaL_StrBuffer *sb, size_t n) {
+  size_t l = sb->w - sb->r;
+  char *b = sb->b;
+  size_t size = sb->size;
+  if (n <= size - sb->w) return;  /* enough space after the contents */
+  if (n >= (~(size_t)0 >> 1) - l)
+    luaL_error(L, "string buffer too large");
+  if (l + n > size) {  /* doesn't fit even at the start? */
+    size *= 2;
+    if (size < l + n) size = l + n;
+    b = (char *)lua_newuserdata(L, size + 1);
+    memcpy(b, sb->b + sb->r, l);
+    lua_getfenv(L, 1);
+    lua_insert(L, -2);
+    lua_rawseti(L, -2, 1);  /* replace the old bytes */
+    lua_pop(L, 1);  /* environment */
+  }
+  else
+    memmove(b, sb->b + sb->r, l);
+  b[l] = '\0';
+  sb->b = b;
+  sb->r = 0;
+  sb->w = l;
+  sb->size = size;
+}
+
+
+static void addbytes (lua_State *L, luaL_StrBuffer *sb, const char *s,
+                      size_t l) {
+  reservestrbuffer(L, sb, l);
+  memcpy(sb->b + sb->w, s, l);
+  sb->w += l;
+  sb->b[sb->w] = '\0';
+}
+
+
+static int str_buffer (lua_State *L) {
+  lua_Integer size = luaL_optinteger(L, 1, STRBUFFER_MINSIZE);
+  luaL_StrBuffer *sb;
+  luaL_argcheck(L, size >= 0, 1, "invalid size");
+  sb = (luaL_StrBuffer *)lua_newuserdata(L, sizeof(luaL_StrBuffer));
+  sb->r = sb->w = 0;
+  sb->size = (size_t)size;
+  luaL_getmetatable(L, LUAL_STRBUFFER);
+  lua_setmetatable(L, -2);
+  lua_createtable(L, 1, 0);  /* environment keeps the bytes alive */
+  sb->b = (char *)lua_newuserdata(L, sb->size + 1);
+  sb->b[0] = '\0';
+  lua_rawseti(L, -2, 1);
+  lua_setfenv(L, -2);
+  return 1;
+}
+
+
+static int sbuf_put (lua_State *L) {
+  luaL_StrBuffer *sb = checkstrbuffer(L);
+  int n = lua_gettop(L);
+  int i;
+  for (i = 2; i <= n; i++) {
+    if (lua_type(L, i) == LUA_TNUMBER) {  /* don't make a string for it */
+      char s[LUAI_MAXNUMBER2STR];
+      lua_number2str(s, lua_tonumber(L, i));
+      addbytes(L, sb, s, strlen(s));
+    }
+    else if (lua_rawequal(L, 1, i)) {  /* the buffer itself? */
+      size_t l = sb->w - sb->r;
+      reservestrbuffer(L, sb, l);  /* so the contents don't move below */
+      addbytes(L, sb, sb->b + sb->r, l);
+    }
+    else {
+      size_t l;
+      const char *s = luaL_checkbytes(L, i, &l);
+      addbytes(L, sb, s, l);
+    }
+  }
+  lua_settop(L, 1);
+  return 1;  /* return the buffer */
+}
+
+
+static int sbuf_putf (lua_State *L) {
+  luaL_StrBuffer *sb = checkstrbuffer(L);
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  addformat(L, &b, 2);
+  if (b.string == NULL)  /* result is still in initb? */
+    addbytes(L, sb, b.b, (size_t)(b.p - b.b));
+  else {
+    size_t l;
+    const char *s;
+    luaL_pushresult(&b);
+    s = lua_tolstring(L, -1, &l);
+    addbytes(L, sb, s, l);
+  }
+  lua_settop(L, 1);
+  return 1;  /* return the buffer */
+}
+
+
+/*
+** Removes up to `n' bytes (or all of them) from the start of the buffer
+** and returns them as a string.
+*/
+static int sbuf_get (lua_State *L) {
+  luaL_StrBuffer *sb = checkstrbuffer(L);
+  size_t l = sb->w - sb->r;
+  if (!lua_isnoneornil(L, 2)) {
+    lua_Integer n = luaL_checkinteger(L, 2);
+    if (n < 0) n = 0;
+    if ((size_t)n < l) l = (size_t)n;
+  }
+  lua_pushlstring(L, sb->b + sb->r, l);
+  sb->r += l;
+  if (sb->r == sb->w) {  /* empty? start again at the beginning */
+    sb->r = sb->w = 0;
+    sb->b[0] = '\0';
+  }
+  return 1;
+}
+
+
+static int sbuf_reset (lua_State *L) {
+  luaL_StrBuffer *sb = checkstrbuffer(L);
+  sb->r = sb->w = 0;
+  sb->b[0] = '\0';
+  lua_settop(L, 1);
+  return 1;  /* return the buffer */
+}
+
+
+static int sbuf_len (lua_State *L) {
+  luaL_StrBuffer *sb = checkstrbuffer(L);
+  lua_pushinteger(L, (lua_Integer)(sb->w - sb->r));
+  return 1;
+}
+
+
+static int sbuf_tostring (lua_State *L) {
+  luaL_StrBuffer *sb = checkstrbuffer(L);
+  lua_pushlstring(L, sb->b + sb->r, sb->w - sb->r);
+  return 1;
+}
+
+
+static const luaL_Reg sbuflib[] = {
+  {"get", sbuf_get},
+  {"len", sbuf_len},
+  {"put", sbuf_put},
+  {"putf", sbuf_putf},
+  {"reset", sbuf_reset},
+  {"tostring", sbuf_tostring},
+  {"__tostring", sbuf_tostring},
+  {NULL, NULL}
+};
+
+/* }====================================================== */
+
+
 static const luaL_Reg strlib[] = {
+  {"buffer", str_buffer},
   {"byte", str_byte},
   {"char", str_char},
   {"dump", str_dump},
@@ -834,9 +2495,12 @@ static const luaL_Reg strlib[] = {
   {"len", str_len},
   {"lower", str_lower},
   {"match", str_match},
+  {"pack", str_pack},
+  {"packsize", str_packsize},
   {"rep", str_rep},
   {"reverse", str_reverse},
   {"sub", str_sub},
+  {"unpack", str_unpack},
   {"upper", str_upper},
   {NULL, NULL}
 };
@@ -854,6 +2518,15 @@ static void createmetatable (lua_State *L) {
 }
 
 
+static void createbuffermetatable (lua_State *L) {
+  luaL_newmetatable(L, LUAL_STRBUFFER);  /* metatable for string buffers */
+  lua_pushvalue(L, -1);
+  lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+  luaL_register(L, NULL, sbuflib);  /* buffer methods */
+  lua_pop(L, 1);  /* pop metatable */
+}
+
+
 /*
 ** Open string library
 */
@@ -864,6 +2537,7 @@ LUALIB_API int luaopen_string (lua_State *L) {
   lua_setfield(L, -2, "gfind");
 #endif
   createmetatable(L);
+  createbuffermetatable(L);
   return 1;
 }
 
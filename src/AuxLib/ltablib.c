@@ -266,12 +266,23 @@ static int sort (lua_State *L) {
 /* }====================================================== */
 
 
+static int tnew (lua_State *L) {
+  int narr = luaL_optint(L, 1, 0);
+  int nrec = luaL_optint(L, 2, 0);
+  luaL_argcheck(L, narr >= 0, 1, "invalid array size");
+  luaL_argcheck(L, nrec >= 0, 2, "invalid hash size");
+  lua_createtable(L, narr, nrec);
+  return 1;
+}
+
+
 static const luaL_Reg tab_funcs[] = {
   {"concat", tconcat},
   {"foreach", foreach},
   {"foreachi", foreachi},
   {"getn", getn},
   {"maxn", maxn},
+  {"new", tnew},
   {"insert", tinsert},
   {"remove", tremove},
   {"setn", setn},
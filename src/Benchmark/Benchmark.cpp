@@ -0,0 +1,172 @@
+/*
+ * RocketVM
+ * Copyright (c) 2011 Max McGuire
+ *
+ * See copyright notice in COPYRIGHT
+ */
+
+#include "Benchmark.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <sys/time.h>
+#endif
+
+namespace
+{
+    Benchmark*  _currentBenchmark = NULL;
+}
+
+static bool PatternMatch(const char* string, const char* pattern)
+{
+    // Simple DOS style pattern match supporting '*' and '?'.
+    if (*pattern == 0)
+    {
+        return *string == 0;
+    }
+    if (*pattern == '*')
+    {
+        return PatternMatch(string, pattern + 1) || (*string != 0 && PatternMatch(string + 1, pattern));
+    }
+    if (*string != 0 && (*pattern == '?' || *pattern == *string))
+    {
+        return PatternMatch(string + 1, pattern + 1);
+    }
+    return false;
+}
+
+class BenchmarkList
+{
+public:
+    
+    BenchmarkList() : m_head(0), m_tail(0)
+    {
+    }
+
+    void Add(Benchmark* benchmark)
+    {
+        if (m_head == 0)
+        {
+            m_head = benchmark;
+            m_tail = benchmark;
+        }
+        else
+        {
+            m_tail->next = benchmark;
+            m_tail = benchmark;
+        }
+    }
+    
+    int RunBenchmarks(const char* pattern)
+    {
+
+        int numRun = 0;
+
+        Benchmark* benchmark = m_head;
+        while (benchmark != 0)
+        {
+            if (pattern == NULL || PatternMatch(benchmark->name, pattern))
+            {
+                _currentBenchmark = benchmark;
+                benchmark->Run();
+                ++numRun;
+            }
+            benchmark = benchmark->next;
+        }
+        
+        _currentBenchmark = NULL;
+        return numRun;
+
+    }
+
+private:
+
+    Benchmark*  m_head;
+    Benchmark*  m_tail;
+
+};
+
+static BenchmarkList& Benchmark_GetList()
+{
+    static BenchmarkList benchmarkList;
+    return benchmarkList;
+}
+
+BenchmarkFixture::BenchmarkFixture()
+{
+    L = luaL_newstate();
+    luaL_openlibs(L);
+}
+
+BenchmarkFixture::~BenchmarkFixture()
+{
+    lua_close(L);
+}
+
+void Benchmark_RegisterBenchmark(Benchmark* benchmark)
+{
+    BenchmarkList& list = Benchmark_GetList();
+    list.Add(benchmark);
+}
+
+void Benchmark_RunBenchmarks(const char* pattern)
+{
+    BenchmarkList& list = Benchmark_GetList();
+    int numRun = list.RunBenchmarks(pattern);
+    printf("%d benchmarks run\n", numRun);
+}
+
+double Benchmark_GetTime()
+{
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return static_cast<double>(counter.QuadPart) / static_cast<double>(frequency.QuadPart);
+#else
+    timeval time;
+    gettimeofday(&time, NULL);
+    return time.tv_sec + time.tv_usec * 0.000001;
+#endif
+}
+
+void Benchmark_Report(const char* label, double seconds, double count)
+{
+    const char* name = _currentBenchmark ? _currentBenchmark->name : "";
+    if (seconds < 0.0)
+    {
+        printf("%-28s %-32s failed\n", name, label);
+        return;
+    }
+    double rate = seconds > 0.0 ? count / seconds : 0.0;
+    printf("%-28s %-32s %10.2f ms %14.0f ops/s\n", name, label, seconds * 1000.0, rate);
+}
+
+void Benchmark_ReportMemory(const char* label, double bytes, double count)
+{
+    const char* name = _currentBenchmark ? _currentBenchmark->name : "";
+    double perItem = count > 0.0 ? bytes / count : 0.0;
+    printf("%-28s %-32s %10.2f MB %14.1f bytes/item\n", name, label, bytes / (1024.0 * 1024.0), perItem);
+}
+
+double Benchmark_RunLua(lua_State* L, const char* code)
+{
+    if (luaL_loadstring(L, code) != 0)
+    {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return -1.0;
+    }
+    double start = Benchmark_GetTime();
+    if (lua_pcall(L, 0, 0, 0) != 0)
+    {
+        fprintf(stderr, "%s\n", lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return -1.0;
+    }
+    return Benchmark_GetTime() - start;
+}
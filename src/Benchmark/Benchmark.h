@@ -0,0 +1,108 @@
+/*
+ * RocketVM
+ * Copyright (c) 2011 Max McGuire
+ *
+ * See copyright notice in COPYRIGHT
+ */
+
+#ifndef ROCKETVM_BENCHMARK_H
+#define ROCKETVM_BENCHMARK_H
+
+extern "C"
+{
+#include "lua.h"
+#include "lauxlib.h"
+#include "lualib.h"
+}
+
+class Benchmark
+{
+public:
+    explicit Benchmark(const char* _name) : name(_name), next(0) { }
+    virtual void Run() = 0;
+    const char* name;
+    Benchmark*  next;
+};
+
+#define _BENCHMARK_BODY(name)                           \
+    {                                                   \
+    public:                                             \
+        void Run();                                     \
+    };                                                  \
+    class _Benchmark_##name : public Benchmark {        \
+    public:                                             \
+        _Benchmark_##name() : Benchmark(#name) { }      \
+        virtual void Run() {                            \
+            _Benchmark_impl_##name benchmark;           \
+            benchmark.Run();                            \
+        }                                               \
+    } _Benchmark_instance_##name;                       \
+    static BenchmarkRegisterer _Benchmark_register_##name(&_Benchmark_instance_##name); \
+    void _Benchmark_impl_##name::Run()
+
+#define BENCHMARK(name)                                 \
+    class _Benchmark_impl_##name                        \
+    _BENCHMARK_BODY(name)
+
+#define BENCHMARK_FIXTURE(name, fixture)                \
+    class _Benchmark_impl_##name : public fixture       \
+    _BENCHMARK_BODY(name)
+
+/**
+ * A fixture that creates and destroys a lua_State with all of the standard
+ * libraries opened.
+ */
+struct BenchmarkFixture
+{
+    BenchmarkFixture();
+    ~BenchmarkFixture();
+    lua_State*  L;
+};
+
+/**
+ * Registers a benchmark. Normally this will not be explicitly called, but will
+ * automatically be called by the BENCHMARK macro.
+ */
+void Benchmark_RegisterBenchmark(Benchmark* benchmark);
+
+/**
+ * Runs all of the benchmarks. If pattern is not NULL, only benchmarks whose
+ * name match the DOS style pattern will be run.
+ */
+void Benchmark_RunBenchmarks(const char* pattern = 0);
+
+/**
+ * Returns a high resolution time stamp in seconds.
+ */
+double Benchmark_GetTime();
+
+/**
+ * Prints a line of results for the current benchmark. count is the number of
+ * operations that were performed in the specified number of seconds.
+ */
+void Benchmark_Report(const char* label, double seconds, double count);
+
+/**
+ * Prints a line of memory usage results for the current benchmark. count is
+ * the number of items that are using the specified number of bytes.
+ */
+void Benchmark_ReportMemory(const char* label, double bytes, double count);
+
+/**
+ * Runs a chunk of Lua code and returns the number of seconds it took to
+ * execute. Any error is reported and causes a negative time to be returned.
+ */
+double Benchmark_RunLua(lua_State* L, const char* code);
+
+/**
+ * Helper struct used to register a benchmark from file scope.
+ */
+struct BenchmarkRegisterer
+{
+    BenchmarkRegisterer(Benchmark* benchmark)
+    {
+        Benchmark_RegisterBenchmark(benchmark);
+    }
+};
+
+#endif
@@ -0,0 +1,68 @@
+/*
+ * RocketVM
+ * Copyright (c) 2011 Max McGuire
+ *
+ * See copyright notice in COPYRIGHT
+ */
+
+#include "Benchmark.h"
+
+#include <stdio.h>
+
+BENCHMARK_FIXTURE(GcModes, BenchmarkFixture)
+{
+
+    // A large heap of long lived records, and a function which creates a few
+    // short lived objects per call and stores one of them in a record. Each
+    // call is timed so that the longest pause caused by the garbage collector
+    // can be reported along with the total time.
+    const int numRecords = 200000;
+    const int n = 1000000;
+    char code[512];
+
+    sprintf(code,
+        "cache = {}\n"
+        "for i = 1, %d do cache[i] = { id = i, name = 'record' .. i } end\n"
+        "function work(i)\n"
+        "  local record = cache[i %% %d + 1]\n"
+        "  local t = { i, i + 1, name = record.name .. i }\n"
+        "  record.last = { t[1] }\n"
+        "end\n", numRecords, numRecords);
+    Benchmark_RunLua(L, code);
+
+    const char* labels[] = { "incremental", "generational" };
+    const int   modes[]  = { LUA_GCINC, LUA_GCGEN };
+
+    for (int j = 0; j < 2; ++j)
+    {
+
+        lua_gc(L, modes[j], 0);
+        lua_gc(L, LUA_GCCOLLECT, 0);
+
+        double maxPause = 0.0;
+        double start = Benchmark_GetTime();
+        for (int i = 0; i < n; ++i)
+        {
+            double callStart = Benchmark_GetTime();
+            lua_getglobal(L, "work");
+            lua_pushinteger(L, i);
+            lua_call(L, 1, 0);
+            double pause = Benchmark_GetTime() - callStart;
+            if (pause > maxPause)
+            {
+                maxPause = pause;
+            }
+        }
+        double seconds = Benchmark_GetTime() - start;
+
+        char label[64];
+        sprintf(label, "%s 1000000 calls", labels[j]);
+        Benchmark_Report(label, seconds, n);
+        sprintf(label, "%s max pause", labels[j]);
+        Benchmark_Report(label, maxPause, 1);
+
+    }
+
+    lua_gc(L, LUA_GCINC, 0);
+
+}
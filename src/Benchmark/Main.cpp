@@ -0,0 +1,19 @@
+/*
+ * RocketVM
+ * Copyright (c) 2011 Max McGuire
+ *
+ * See copyright notice in COPYRIGHT
+ */
+
+#include "Benchmark.h"
+
+int main(int argc, char* argv[])
+{
+    const char* pattern = 0;
+    if (argc > 1)
+    {
+        pattern = argv[1];
+    }
+    Benchmark_RunBenchmarks(pattern);
+    return 0;
+} 
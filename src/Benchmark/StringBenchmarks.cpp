@@ -0,0 +1,634 @@
+/*
+ * RocketVM
+ * Copyright (c) 2011 Max McGuire
+ *
+ * See copyright notice in COPYRIGHT
+ */
+
+#include "Benchmark.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Fills the buffer with a string of length characters that encodes key in
+ * every other character starting at offset. The rest of the characters are the
+ * same for every key.
+ */
+static void MakeKey(char* buffer, int length, int key, int offset)
+{
+    memset(buffer, 'a', length);
+    for (int i = offset; i < length; i += 2)
+    {
+        buffer[i] = static_cast<char>('a' + key % 26);
+        key /= 26;
+    }
+}
+
+/**
+ * Creates n strings through lua_pushlstring and stores them in a table so
+ * that they stay in the string pool. Returns the number of seconds it took.
+ */
+static double InternKeys(lua_State* L, int n, int length, int offset)
+{
+
+    char buffer[256];
+
+    lua_newtable(L);
+    int table = lua_gettop(L);
+
+    double start = Benchmark_GetTime();
+    for (int i = 1; i <= n; ++i)
+    {
+        MakeKey(buffer, length, i, offset);
+        lua_pushlstring(L, buffer, length);
+        lua_rawseti(L, table, i);
+    }
+    double seconds = Benchmark_GetTime() - start;
+
+    lua_pop(L, 1);
+    lua_gc(L, LUA_GCCOLLECT, 0);
+
+    return seconds;
+
+}
+
+/**
+ * The FNV-1a hash the string pool used to use, which only samples every
+ * (length / 32 + 1)th character. Kept for comparison with the current hash.
+ */
+static unsigned int SampledFnvHash(const char* data, size_t length)
+{
+    unsigned int hash = 2166136261u;
+    size_t step = (length >> 5) + 1;
+    for (size_t i = 0; i < length; i += step)
+    {
+        hash ^= data[i];
+        hash *= 16777619;
+    }
+    return hash;
+}
+
+static inline unsigned int RotateLeft(unsigned int x, int r)
+{
+    return (x << r) | (x >> (32 - r));
+}
+
+/**
+ * A copy of the MurmurHash3 (x86 32-bit) used by the string pool (see
+ * HashString), with a fixed seed.
+ */
+static unsigned int MurmurHash(const char* data, size_t length)
+{
+
+    const unsigned int c1 = 0xcc9e2d51;
+    const unsigned int c2 = 0x1b873593;
+
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    const unsigned char* end = p + (length & ~3);
+
+    unsigned int hash = 0x9747b28c;
+    unsigned int k;
+
+    for (; p < end; p += 4)
+    {
+        memcpy(&k, p, 4);
+        k *= c1;
+        k  = RotateLeft(k, 15);
+        k *= c2;
+        hash ^= k;
+        hash  = RotateLeft(hash, 13);
+        hash  = hash * 5 + 0xe6546b64;
+    }
+
+    k = 0;
+    switch (length & 3)
+    {
+    case 3: k ^= p[2] << 16;
+    case 2: k ^= p[1] << 8;
+    case 1: k ^= p[0];
+            k *= c1;
+            k  = RotateLeft(k, 15);
+            k *= c2;
+            hash ^= k;
+    }
+
+    hash ^= static_cast<unsigned int>(length);
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
+    return hash;
+
+}
+
+typedef unsigned int (*HashFunction)(const char* data, size_t length);
+
+// Receives the hashes that are only being timed so they aren't optimized away.
+static volatile unsigned int _hashResult;
+
+/**
+ * Inserts n keys made by MakeKey into a chained hash set with a power of two
+ * number of chains (like the string pool) and returns the number of seconds
+ * it took. Each key is compared with the keys already in its chain, so a hash
+ * with many collisions is slow.
+ */
+static double InternKeysWithHash(HashFunction hash, int n, int length, int offset)
+{
+
+    int numChains = 1;
+    while (numChains < n)
+    {
+        numChains *= 2;
+    }
+
+    int*  chain = static_cast<int*>(malloc(numChains * sizeof(int)));
+    int*  next  = static_cast<int*>(malloc(n * sizeof(int)));
+    char* keys  = static_cast<char*>(malloc(n * length));
+
+    for (int i = 0; i < numChains; ++i)
+    {
+        chain[i] = -1;
+    }
+    for (int i = 0; i < n; ++i)
+    {
+        MakeKey(keys + i * length, length, i + 1, offset);
+    }
+
+    double start = Benchmark_GetTime();
+    for (int i = 0; i < n; ++i)
+    {
+        const char* key = keys + i * length;
+        unsigned int index = hash(key, length) & (numChains - 1);
+        int j = chain[index];
+        while (j != -1 && memcmp(keys + j * length, key, length) != 0)
+        {
+            j = next[j];
+        }
+        if (j == -1)
+        {
+            next[i] = chain[index];
+            chain[index] = i;
+        }
+    }
+    double seconds = Benchmark_GetTime() - start;
+
+    free(keys);
+    free(next);
+    free(chain);
+
+    return seconds;
+
+}
+
+BENCHMARK(StringHashComparison)
+{
+
+    // The old sampled FNV hash and the current MurmurHash3 on the same keys.
+    // Strings that differ only in the characters the sampler skips all land
+    // in one chain, so the set degrades to a linear search (which is why the
+    // first case uses fewer keys).
+    const HashFunction hashes[] = { SampledFnvHash, MurmurHash };
+    const char* names[] = { "fnv sampled", "murmur3" };
+
+    for (int h = 0; h < 2; ++h)
+    {
+
+        char label[64];
+
+        const int numColliding = 10000;
+        sprintf(label, "%s %d differ in odd", names[h], numColliding);
+        Benchmark_Report(label, InternKeysWithHash(hashes[h], numColliding, 40, 1), numColliding);
+
+        const int n = 1000000;
+        const int lengths[] = { 8, 16, 40 };
+        for (int i = 0; i < 3; ++i)
+        {
+            sprintf(label, "%s %d x %d bytes", names[h], n, lengths[i]);
+            Benchmark_Report(label, InternKeysWithHash(hashes[h], n, lengths[i], 0), n);
+        }
+
+        // Hashing long strings (the sampler only reads 1/129th of these).
+        const int numLong = 10000;
+        const int length  = 4096;
+        char buffer[length];
+        MakeKey(buffer, length, 1, 0);
+        unsigned int sum = 0;
+        double start = Benchmark_GetTime();
+        for (int i = 0; i < numLong; ++i)
+        {
+            buffer[i % length] ^= 1;
+            sum += hashes[h](buffer, length);
+        }
+        double seconds = Benchmark_GetTime() - start;
+        _hashResult = sum;
+        sprintf(label, "%s hash %d x %d bytes", names[h], numLong, length);
+        Benchmark_Report(label, seconds, numLong);
+
+    }
+
+}
+
+BENCHMARK_FIXTURE(StringHashQuality, BenchmarkFixture)
+{
+
+    // The FNV hash used to sample only every (length / 32 + 1)th character, so
+    // 40 character strings that differ only in their odd characters all ended
+    // up in the same chain of the string pool (see StringHashComparison for
+    // the old hash on the same keys). With a hash that covers every character
+    // the two cases should take about the same time.
+    const int n = 100000;
+    Benchmark_Report("intern 100000 differ in even", InternKeys(L, n, 40, 0), n);
+    Benchmark_Report("intern 100000 differ in odd", InternKeys(L, n, 40, 1), n);
+
+}
+
+BENCHMARK_FIXTURE(StringHashThroughput, BenchmarkFixture)
+{
+
+    // Creating a short string hashes all of its characters.
+    const int n = 1000000;
+    const int lengths[] = { 8, 16, 40 };
+    for (int i = 0; i < 3; ++i)
+    {
+        char label[64];
+        sprintf(label, "intern %d x %d bytes", n, lengths[i]);
+        Benchmark_Report(label, InternKeys(L, n, lengths[i], 0), n);
+    }
+
+    // Long strings are hashed the first time they are used as a table key.
+    const int numLong = 10000;
+    const int length  = 4096;
+    char buffer[length];
+
+    lua_newtable(L);
+    int table = lua_gettop(L);
+    for (int i = 1; i <= numLong; ++i)
+    {
+        MakeKey(buffer, length, i, 0);
+        lua_pushlstring(L, buffer, length);
+        lua_rawseti(L, table, i);
+    }
+    lua_setglobal(L, "keys");
+
+    char code[256];
+    sprintf(code,
+        "local t, keys = {}, keys\n"
+        "for i = 1, %d do t[keys[i]] = i end\n"
+        "keys = nil\n", numLong);
+
+    char label[64];
+    sprintf(label, "hash %d x %d bytes", numLong, length);
+    Benchmark_Report(label, Benchmark_RunLua(L, code), numLong);
+
+}
+
+BENCHMARK_FIXTURE(StringSort, BenchmarkFixture)
+{
+
+    // table.sort compares the strings through Vm_Less, so this measures the
+    // cost of String_Compare in each collation order.
+    const int n = 1000000;
+
+    char code[256];
+    sprintf(code,
+        "local t, random, tostring = {}, math.random, tostring\n"
+        "math.randomseed(1)\n"
+        "for i = 1, %d do t[i] = 'key' .. tostring(random(1, %d)) end\n"
+        "keys = t\n", n, n);
+    Benchmark_RunLua(L, code);
+
+    const char* sort =
+        "local t = {}\n"
+        "for i, key in ipairs(keys) do t[i] = key end\n"
+        "table.sort(t)\n";
+
+    lua_setcollation(L, LUA_COLLATE_BYTES);
+    Benchmark_Report("sort 1000000 bytes", Benchmark_RunLua(L, sort), n);
+
+    lua_setcollation(L, LUA_COLLATE_LOCALE);
+    Benchmark_Report("sort 1000000 locale", Benchmark_RunLua(L, sort), n);
+
+}
+
+BENCHMARK_FIXTURE(NumberToString, BenchmarkFixture)
+{
+
+    // Integers and numbers with a fractional part take different paths when
+    // they are converted to strings.
+    const int n = 1000000;
+    const char* values[] = { "i", "i * 0.37" };
+    for (int i = 0; i < 2; ++i)
+    {
+
+        char code[256];
+        char label[64];
+
+        sprintf(code,
+            "local tostring = tostring\n"
+            "for i = 1, %d do local s = tostring(%s) end\n", n, values[i]);
+        sprintf(label, "tostring(%s) %d", values[i], n);
+        Benchmark_Report(label, Benchmark_RunLua(L, code), n);
+
+        sprintf(code,
+            "for i = 1, %d do local s = 'x=' .. %s .. ',' end\n", n, values[i]);
+        sprintf(label, "concat(%s) %d", values[i], n);
+        Benchmark_Report(label, Benchmark_RunLua(L, code), n);
+
+    }
+
+}
+
+BENCHMARK_FIXTURE(StringToNumber, BenchmarkFixture)
+{
+
+    // Strings are converted to numbers by tonumber and by arithmetic on
+    // strings (Opcode_Add).
+    const int n = 1000000;
+    const int numFields = 1000;
+
+    char code[256];
+    sprintf(code,
+        "fields = {}\n"
+        "for i = 1, %d do fields[i] = tostring(i) fields[%d + i] = tostring(i * 0.25) end\n",
+        numFields, numFields);
+    Benchmark_RunLua(L, code);
+
+    sprintf(code,
+        "local fields, tonumber = fields, tonumber\n"
+        "local s = 0\n"
+        "for i = 1, %d do s = s + tonumber(fields[i %% %d + 1]) end\n", n, numFields * 2);
+    Benchmark_Report("tonumber 1000000", Benchmark_RunLua(L, code), n);
+
+    sprintf(code,
+        "local fields = fields\n"
+        "local s = 0\n"
+        "for i = 1, %d do s = fields[i %% %d + 1] + s end\n", n, numFields * 2);
+    Benchmark_Report("coerce add 1000000", Benchmark_RunLua(L, code), n);
+
+}
+
+BENCHMARK_FIXTURE(StringPatterns, BenchmarkFixture)
+{
+
+    // A few fixed patterns applied to many lines, as in log processing.
+    const int n = 100000;
+
+    char code[512];
+    sprintf(code,
+        "lines = {}\n"
+        "for i = 1, %d do\n"
+        "  lines[i] = '2011-05-' .. (i %% 28 + 1) .. ' 12:00:' .. (i %% 60) ..\n"
+        "             ' INFO request id=' .. i .. ' status=' .. (200 + i %% 3) .. ' time=' .. (i %% 997) .. 'ms'\n"
+        "end\n", n);
+    Benchmark_RunLua(L, code);
+
+    const char* match =
+        "local match = string.match\n"
+        "for i, line in ipairs(lines) do\n"
+        "  local id, status = match(line, 'id=(%d+) status=(%d+)')\n"
+        "end\n";
+    Benchmark_Report("match 100000", Benchmark_RunLua(L, match), n);
+
+    const char* find =
+        "local find = string.find\n"
+        "for i, line in ipairs(lines) do\n"
+        "  local s = find(line, 'time=%d+ms$')\n"
+        "end\n";
+    Benchmark_Report("find 100000", Benchmark_RunLua(L, find), n);
+
+    const char* gsub =
+        "local gsub = string.gsub\n"
+        "for i, line in ipairs(lines) do\n"
+        "  local s = gsub(line, '%d', '#')\n"
+        "end\n";
+    Benchmark_Report("gsub 100000", Benchmark_RunLua(L, gsub), n);
+
+    const char* gmatch =
+        "local gmatch = string.gmatch\n"
+        "for i, line in ipairs(lines) do\n"
+        "  for k, v in gmatch(line, '(%w+)=(%w+)') do end\n"
+        "end\n";
+    Benchmark_Report("gmatch 100000", Benchmark_RunLua(L, gmatch), n);
+
+    // A few hot patterns mixed with a distinct pattern for every line, so
+    // many more patterns are used than fit in the cache.
+    const char* mixed =
+        "local match, find = string.match, string.find\n"
+        "for i, line in ipairs(lines) do\n"
+        "  local id = match(line, 'id=(%d+)')\n"
+        "  local status = match(line, 'status=(%d+)')\n"
+        "  local s = find(line, 'time=%d+ms$')\n"
+        "  local t = find(line, 'id=' .. i .. ' ')\n"
+        "end\n";
+    Benchmark_Report("hot + cold 100000", Benchmark_RunLua(L, mixed), n);
+
+}
+
+BENCHMARK_FIXTURE(StringSearch, BenchmarkFixture)
+{
+
+    // Plain searches and case conversion over haystacks of different sizes.
+    // The needle is at the end, so the whole haystack is scanned.
+    const int sizes[] = { 1024, 64 * 1024, 16 * 1024 * 1024 };
+    const char* names[] = { "1 KB", "64 KB", "16 MB" };
+
+    for (int i = 0; i < 3; ++i)
+    {
+
+        int size = sizes[i];
+        int count = (16 * 1024 * 1024) / size;
+
+        char code[512];
+        sprintf(code,
+            "haystack = string.rep('abcdefgh', %d / 8 - 2) .. 'abcdneedle12345'\n",
+            size);
+        Benchmark_RunLua(L, code);
+
+        char label[64];
+
+        sprintf(code,
+            "local find, haystack = string.find, haystack\n"
+            "for i = 1, %d do find(haystack, 'needle', 1, true) end\n", count);
+        sprintf(label, "find plain %s", names[i]);
+        Benchmark_Report(label, Benchmark_RunLua(L, code), count);
+
+        sprintf(code,
+            "local gsub, haystack = string.gsub, haystack\n"
+            "for i = 1, %d do gsub(haystack, 'needle', 'pin') end\n", count);
+        sprintf(label, "gsub literal %s", names[i]);
+        Benchmark_Report(label, Benchmark_RunLua(L, code), count);
+
+        sprintf(code,
+            "local upper, haystack = string.upper, haystack\n"
+            "for i = 1, %d do upper(haystack) end\n", count);
+        sprintf(label, "upper %s", names[i]);
+        Benchmark_Report(label, Benchmark_RunLua(L, code), count);
+
+    }
+
+}
+
+/**
+ * Formats a string the way lua_pushfstring used to: each literal fragment and
+ * each argument is pushed as a separate string and the results are
+ * concatenated. Only the %d and %s conversions are supported.
+ */
+static void PushFStringByConcat(lua_State* L, const char* fmt, ...)
+{
+
+    va_list argp;
+    va_start(argp, fmt);
+
+    int n = 1;
+    lua_pushstring(L, "");
+    while (1)
+    {
+        const char* e = strchr(fmt, '%');
+        if (e == NULL)
+        {
+            break;
+        }
+        lua_pushlstring(L, fmt, e - fmt);
+        if (*(e+1) == 'd')
+        {
+            lua_pushnumber(L, static_cast<lua_Number>(va_arg(argp, int)));
+        }
+        else
+        {
+            lua_pushstring(L, va_arg(argp, char*));
+        }
+        n += 2;
+        fmt = e+2;
+    }
+    lua_pushstring(L, fmt);
+    lua_concat(L, n + 1);
+
+    va_end(argp);
+
+}
+
+BENCHMARK_FIXTURE(PushFString, BenchmarkFixture)
+{
+
+    // A typical error message from luaL_argerror/luaL_typerror, formatted by
+    // lua_pushfstring and by the concatenation it used to do.
+    const int n = 1000000;
+
+    double start = Benchmark_GetTime();
+    for (int i = 0; i < n; ++i)
+    {
+        lua_pushfstring(L, "bad argument #%d to " LUA_QS " (%s expected, got %s)", i % 8, "insert", "table", "nil");
+        lua_pop(L, 1);
+    }
+    Benchmark_Report("pushfstring 1000000", Benchmark_GetTime() - start, n);
+
+    start = Benchmark_GetTime();
+    for (int i = 0; i < n; ++i)
+    {
+        PushFStringByConcat(L, "bad argument #%d to " LUA_QS " (%s expected, got %s)", i % 8, "insert", "table", "nil");
+        lua_pop(L, 1);
+    }
+    Benchmark_Report("push + concat 1000000", Benchmark_GetTime() - start, n);
+
+}
+
+BENCHMARK_FIXTURE(StringFormat, BenchmarkFixture)
+{
+
+    // A typical log line, and one with conversions that still use sprintf.
+    const int n = 1000000;
+
+    char code[256];
+    sprintf(code,
+        "local format = string.format\n"
+        "for i = 1, %d do local s = format('%%s %%d %%.3f', 'request', i, i * 0.25) end\n", n);
+    Benchmark_Report("format '%s %d %.3f' 1000000", Benchmark_RunLua(L, code), n);
+
+    sprintf(code,
+        "local format = string.format\n"
+        "for i = 1, %d do local s = format('id=%%s status=%%d', 'abc', i) end\n", n);
+    Benchmark_Report("format 'id=%s status=%d' 1000000", Benchmark_RunLua(L, code), n);
+
+}
+
+BENCHMARK_FIXTURE(StringUnpack, BenchmarkFixture)
+{
+
+    // Decodes a file of 1000000 fixed size records, once with string.unpack
+    // and once with string.byte and arithmetic.
+    const int n = 1000000;
+
+    char code[1024];
+    sprintf(code,
+        "local pack, t = string.pack, {}\n"
+        "for i = 1, %d do t[i] = pack('<I4 i2 I2 B', i, i %% 1000 - 500, i %% 65536, i %% 256) end\n"
+        "local name = os.tmpname()\n"
+        "local file = io.open(name, 'wb') file:write(table.concat(t)) file:close()\n"
+        "file = io.open(name, 'rb') data = file:read('*a') file:close()\n"
+        "os.remove(name)\n", n);
+    Benchmark_RunLua(L, code);
+
+    sprintf(code,
+        "local unpack, data = string.unpack, data\n"
+        "local pos, sum = 1, 0\n"
+        "for i = 1, %d do\n"
+        "  local id, delta, port, flags\n"
+        "  id, delta, port, flags, pos = unpack('<I4 i2 I2 B', data, pos)\n"
+        "  sum = sum + id + delta + port + flags\n"
+        "end\n", n);
+    Benchmark_Report("unpack 1000000 records", Benchmark_RunLua(L, code), n);
+
+    sprintf(code,
+        "local byte, data = string.byte, data\n"
+        "local pos, sum = 1, 0\n"
+        "for i = 1, %d do\n"
+        "  local b1, b2, b3, b4, b5, b6, b7, b8, b9 = byte(data, pos, pos + 8)\n"
+        "  local id = b1 + b2 * 256 + b3 * 65536 + b4 * 16777216\n"
+        "  local delta = b5 + b6 * 256\n"
+        "  if delta >= 32768 then delta = delta - 65536 end\n"
+        "  local port = b7 + b8 * 256\n"
+        "  sum = sum + id + delta + port + b9\n"
+        "  pos = pos + 9\n"
+        "end\n", n);
+    Benchmark_Report("byte 1000000 records", Benchmark_RunLua(L, code), n);
+
+}
+
+BENCHMARK_FIXTURE(StringBuild, BenchmarkFixture)
+{
+
+    // Serializes a record of 10 fields by concatenation, with table.concat
+    // and with a string buffer that is reused for every record.
+    const int n = 100000;
+
+    char code[512];
+    sprintf(code,
+        "for i = 1, %d do\n"
+        "  local s = ''\n"
+        "  for j = 1, 10 do s = s .. 'field' .. j .. '=' .. i .. ';' end\n"
+        "end\n", n);
+    Benchmark_Report("concat 100000 records", Benchmark_RunLua(L, code), n);
+
+    sprintf(code,
+        "local concat, t = table.concat, {}\n"
+        "for i = 1, %d do\n"
+        "  for j = 1, 10 do t[j] = 'field' .. j .. '=' .. i .. ';' end\n"
+        "  local s = concat(t)\n"
+        "end\n", n);
+    Benchmark_Report("table.concat 100000 records", Benchmark_RunLua(L, code), n);
+
+    sprintf(code,
+        "local b = string.buffer()\n"
+        "for i = 1, %d do\n"
+        "  b:reset()\n"
+        "  for j = 1, 10 do b:put('field', j, '=', i, ';') end\n"
+        "  local s = b:tostring()\n"
+        "end\n", n);
+    Benchmark_Report("string.buffer 100000 records", Benchmark_RunLua(L, code), n);
+
+}
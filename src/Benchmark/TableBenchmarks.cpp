@@ -0,0 +1,251 @@
+/*
+ * RocketVM
+ * Copyright (c) 2011 Max McGuire
+ *
+ * See copyright notice in COPYRIGHT
+ */
+
+#include "Benchmark.h"
+
+#include <stdio.h>
+
+BENCHMARK_FIXTURE(TableSequentialFill, BenchmarkFixture)
+{
+
+    // Fill and read sequence style arrays from Lua; these go through
+    // Opcode_SetTable and Opcode_GetTable.
+    const int sizes[] = { 100000, 1000000 };
+    for (int i = 0; i < 2; ++i)
+    {
+
+        char code[256];
+        char label[64];
+        int  n = sizes[i];
+
+        sprintf(code,
+            "t = {}\n"
+            "for i = 1, %d do t[i] = i end\n", n);
+        sprintf(label, "fill %d", n);
+        Benchmark_Report(label, Benchmark_RunLua(L, code), n);
+
+        sprintf(code,
+            "local t, s = t, 0\n"
+            "for i = 1, %d do s = s + t[i] end\n", n);
+        sprintf(label, "read %d", n);
+        Benchmark_Report(label, Benchmark_RunLua(L, code), n);
+
+        sprintf(code,
+            "local t = t\n"
+            "for i = 1, %d do t[i] = -i end\n", n);
+        sprintf(label, "update %d", n);
+        Benchmark_Report(label, Benchmark_RunLua(L, code), n);
+
+    }
+
+}
+
+BENCHMARK_FIXTURE(TableRawSequentialFill, BenchmarkFixture)
+{
+
+    // Fill and read through the C API (lua_rawseti/lua_rawgeti).
+    const int n = 1000000;
+
+    lua_newtable(L);
+    int table = lua_gettop(L);
+
+    double start = Benchmark_GetTime();
+    for (int i = 1; i <= n; ++i)
+    {
+        lua_pushinteger(L, i);
+        lua_rawseti(L, table, i);
+    }
+    Benchmark_Report("rawseti 1000000", Benchmark_GetTime() - start, n);
+
+    lua_Number sum = 0;
+    start = Benchmark_GetTime();
+    for (int i = 1; i <= n; ++i)
+    {
+        lua_rawgeti(L, table, i);
+        sum += lua_tonumber(L, -1);
+        lua_pop(L, 1);
+    }
+    double seconds = Benchmark_GetTime() - start;
+
+    // The results are checked so that the reads can't be optimized away; a
+    // wrong result is reported as a failure.
+    lua_Number expected = static_cast<lua_Number>(n) * (n + 1) / 2;
+    Benchmark_Report("rawgeti 1000000", sum == expected ? seconds : -1.0, n);
+
+    start = Benchmark_GetTime();
+    size_t length = lua_objlen(L, table);
+    seconds = Benchmark_GetTime() - start;
+    Benchmark_Report("objlen", length == static_cast<size_t>(n) ? seconds : -1.0, 1);
+
+    lua_pop(L, 1);
+
+}
+
+BENCHMARK_FIXTURE(TableConstructor, BenchmarkFixture)
+{
+    // Table constructors go through Opcode_SetList.
+    const int n = 100000;
+    char code[256];
+    sprintf(code,
+        "for i = 1, %d do\n"
+        "  local t = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 }\n"
+        "end\n", n);
+    Benchmark_Report("constructor 16 elements", Benchmark_RunLua(L, code), n);
+}
+
+BENCHMARK_FIXTURE(TableInsertKeys, BenchmarkFixture)
+{
+
+    const int n = 1000000;
+    char code[256];
+
+    // Negative integers are stored in the hash part and their hashes share
+    // many main positions, so most inserts need a free node.
+    sprintf(code,
+        "local t = {}\n"
+        "for i = 1, %d do t[-i] = i end\n", n);
+    Benchmark_Report("colliding keys 1000000", Benchmark_RunLua(L, code), n);
+
+    // String keys are well distributed. The keys are created ahead of time so
+    // that only the inserts are measured.
+    sprintf(code,
+        "keys = {}\n"
+        "for i = 1, %d do keys[i] = 'key' .. i end\n", n);
+    Benchmark_RunLua(L, code);
+
+    sprintf(code,
+        "local t, keys = {}, keys\n"
+        "for i = 1, %d do t[keys[i]] = i end\n", n);
+    Benchmark_Report("non-colliding keys 1000000", Benchmark_RunLua(L, code), n);
+
+}
+
+BENCHMARK_FIXTURE(TableAppend, BenchmarkFixture)
+{
+
+    const int n = 1000000;
+    char code[256];
+
+    sprintf(code,
+        "local t = {}\n"
+        "for i = 1, %d do t[#t + 1] = i end\n", n);
+    Benchmark_Report("t[#t + 1] = x 1000000", Benchmark_RunLua(L, code), n);
+
+    sprintf(code,
+        "local t, insert = {}, table.insert\n"
+        "for i = 1, %d do insert(t, i) end\n", n);
+    Benchmark_Report("table.insert 1000000", Benchmark_RunLua(L, code), n);
+
+    sprintf(code,
+        "local t = {}\n"
+        "for i = 1, %d do t[i] = i end\n"
+        "for i = 1, %d do t[#t] = nil end\n", n, n);
+    Benchmark_Report("fill + t[#t] = nil 1000000", Benchmark_RunLua(L, code), n);
+
+}
+
+BENCHMARK_FIXTURE(TableHashKeys, BenchmarkFixture)
+{
+
+    // Lookup, insert and delete in the hash part with each kind of key, for a
+    // table that fits in the cache and one that doesn't. Compare the results
+    // with and without TABLE_OPEN_ADDRESSING.
+    const int n = 1000000;
+    char code[256];
+
+    sprintf(code,
+        "strings, numbers, objects = {}, {}, {}\n"
+        "for i = 1, %d do\n"
+        "  strings[i] = 'key' .. i\n"
+        "  numbers[i] = i + 0.5\n"
+        "  objects[i] = {}\n"
+        "end\n", n);
+    Benchmark_RunLua(L, code);
+
+    const char* types[] = { "strings", "numbers", "objects" };
+    const int   sizes[] = { 1000, n };
+
+    for (int j = 0; j < 2; ++j)
+    {
+
+        int size   = sizes[j];
+        int rounds = n / size;
+
+        for (int i = 0; i < 3; ++i)
+        {
+
+            char label[64];
+
+            sprintf(code,
+                "local t, keys = {}, %s\n"
+                "for r = 1, %d do\n"
+                "  t = {}\n"
+                "  for i = 1, %d do t[keys[i]] = i end\n"
+                "end\n"
+                "hash = t\n", types[i], rounds, size);
+            sprintf(label, "insert %d %s", size, types[i]);
+            Benchmark_Report(label, Benchmark_RunLua(L, code), n);
+
+            sprintf(code,
+                "local t, keys, s = hash, %s, 0\n"
+                "for r = 1, %d do\n"
+                "  for i = 1, %d do s = s + t[keys[i]] end\n"
+                "end\n", types[i], 4 * rounds, size);
+            sprintf(label, "lookup %d %s", size, types[i]);
+            Benchmark_Report(label, Benchmark_RunLua(L, code), 4 * n);
+
+            sprintf(code,
+                "local t, keys = hash, %s\n"
+                "for i = 1, %d do t[keys[i]] = nil end\n"
+                "hash = nil\n", types[i], size);
+            sprintf(label, "delete %d %s", size, types[i]);
+            Benchmark_Report(label, Benchmark_RunLua(L, code), size);
+
+        }
+
+    }
+
+    Benchmark_RunLua(L, "strings, numbers, objects = nil, nil, nil");
+
+}
+
+/**
+ * Returns the number of bytes in use by the Lua state.
+ */
+static double GetMemoryUsed(lua_State* L)
+{
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    return lua_gc(L, LUA_GCCOUNT, 0) * 1024.0 + lua_gc(L, LUA_GCCOUNTB, 0);
+}
+
+BENCHMARK_FIXTURE(TableMemory, BenchmarkFixture)
+{
+
+    // Memory used by the hash part of a table with 1M entries. The keys are
+    // created before measuring so only the table itself is counted.
+    const int n = 1000000;
+    char code[256];
+
+    sprintf(code,
+        "keys = {}\n"
+        "for i = 1, %d do keys[i] = i + 0.5 end\n", n);
+    Benchmark_RunLua(L, code);
+
+    double before = GetMemoryUsed(L);
+
+    sprintf(code,
+        "t = {}\n"
+        "local t, keys = t, keys\n"
+        "for i = 1, %d do t[keys[i]] = i end\n", n);
+    Benchmark_RunLua(L, code);
+
+    double after = GetMemoryUsed(L);
+    Benchmark_ReportMemory("hash part 1000000", after - before, n);
+
+    Benchmark_RunLua(L, "t, keys = nil, nil");
+
+}
@@ -8,6 +8,8 @@
 #include "Buffer.h"
 #include "State.h"
 
+#include <string.h>
+
 void Buffer_Initialize(lua_State* L, Buffer* buffer)
 {
     buffer->data = NULL;
@@ -36,4 +38,34 @@ void Buffer_Append(lua_State* L, Buffer* buffer, char c)
     }
     buffer->data[buffer->length] = c;
     ++buffer->length;
-}
\ No newline at end of file
+}
+
+void Buffer_Append(lua_State* L, Buffer* buffer, const char* data, size_t length)
+{
+    Buffer_Reserve(L, buffer, buffer->length + length);
+    memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+void Buffer_Reserve(lua_State* L, Buffer* buffer, size_t maxLength)
+{
+    if (maxLength > buffer->maxLength)
+    {
+        if (maxLength < buffer->maxLength * 2)
+        {
+            maxLength = buffer->maxLength * 2;
+        }
+        buffer->data = (char*)Reallocate(L, buffer->data, buffer->maxLength, maxLength);
+        buffer->maxLength = maxLength;
+    }
+}
+
+void Buffer_Trim(lua_State* L, Buffer* buffer, size_t maxLength)
+{
+    if (buffer->length == 0 && buffer->maxLength > maxLength)
+    {
+        Free(L, buffer->data, buffer->maxLength);
+        buffer->data = NULL;
+        buffer->maxLength = 0;
+    }
+}
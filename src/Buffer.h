@@ -32,4 +32,22 @@ void Buffer_Clear(lua_State* L, Buffer* buffer);
  */
 void Buffer_Append(lua_State* L, Buffer* buffer, char c);
 
+/**
+ * Appends length characters to the end of the buffer, growing it if necessary.
+ */
+void Buffer_Append(lua_State* L, Buffer* buffer, const char* data, size_t length);
+
+/**
+ * Grows the buffer so that it can hold at least maxLength characters. The
+ * contents of the buffer are preserved.
+ */
+void Buffer_Reserve(lua_State* L, Buffer* buffer, size_t maxLength);
+
+/**
+ * Releases the memory for the buffer if it's empty and can hold more than
+ * maxLength characters. This is used by the garbage collector so that one
+ * large use of a buffer doesn't hold on to the memory indefinitely.
+ */
+void Buffer_Trim(lua_State* L, Buffer* buffer, size_t maxLength);
+
 #endif
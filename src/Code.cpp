@@ -465,7 +465,8 @@ static bool Parser_TryTable(Parser* parser, Expression* dst, int regHint)
     }
     while (hasSep || !Parser_Accept(parser, '}'));
 
-    Instruction inst = Opcode_EncodeABC(Opcode_NewTable, dst->index, listSize, hashSize);
+    Instruction inst = Opcode_EncodeABC(Opcode_NewTable, dst->index,
+        Opcode_EncodeSize(listSize), Opcode_EncodeSize(hashSize));
     Parser_UpdateInstruction( parser, start, inst );
 
     if (numFields > 0 || varArg)
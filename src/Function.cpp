@@ -222,6 +222,7 @@ static Prototype* Prototype_Create(lua_State* L, Prototype* parent, const char*
     {
         prototype->source = String_Create(L, name, nameLength);
     }
+    Gc_WriteBarrier(L, prototype, prototype->source);
 
     memcpy(prototype->code, code, codeSize * sizeof(Instruction));
 
@@ -261,6 +262,7 @@ static Prototype* Prototype_Create(lua_State* L, Prototype* parent, const char*
     {
         size_t length = 0;
         prototype->prototype[i] = Prototype_Create(L, prototype, prototypes, length);
+        Gc_WriteBarrier(L, prototype, prototype->prototype[i]);
         prototypes += length;
     }
 
@@ -293,6 +295,7 @@ static Prototype* Prototype_Create(lua_State* L, Prototype* parent, const char*
         size_t length = *reinterpret_cast<const size_t*>(data);
         data += sizeof(size_t);
         prototype->upValue[i] = String_Create(L, data, length - 1);
+        Gc_WriteBarrier(L, prototype, prototype->upValue[i]);
         data += length;
     }
 
@@ -17,6 +17,19 @@
 
 #define GCSTEPSIZE	1024u
 
+// In generational mode a minor collection is run when the heap grows by this
+// percentage of its size after the last major collection (but at least
+// GCMINORMINSIZE), and a major collection is run when the heap grows by
+// GCMAJORPERCENT.
+#define GCMINORPERCENT  20u
+#define GCMINORMINSIZE  (64u * 1024u)
+#define GCMAJORPERCENT  100u
+
+// The scratch buffer is freed by a collection if it has grown larger than this.
+#define GCMAXSCRATCHSIZE    (LUAL_BUFFERSIZE * 4)
+
+static void Gc_CollectGenerational(lua_State* L, Gc* gc);
+
 /**
  * Checks if the garbage collector needs to be run.
  */
@@ -24,6 +37,11 @@ static void Gc_Check(lua_State* L, Gc* gc)
 {
     if (L->totalBytes > gc->threshold)
     {
+        if (gc->mode == Gc_Mode_Generational)
+        {
+            Gc_CollectGenerational(L, gc);
+            return;
+        }
         if (gc->state == Gc_State_Paused)
         {
             gc->state = Gc_State_Start;
@@ -57,6 +75,9 @@ static void Gc_FreeObject(lua_State* L, Gc_Object* object)
     case LUA_TUSERDATA:
         UserData_Destroy(L, static_cast<UserData*>(object));
         break;
+    case LUA_TSTRING:
+        String_Destroy(L, static_cast<String*>(object));
+        break;
     default:
         ASSERT(0);
     }
@@ -64,10 +85,16 @@ static void Gc_FreeObject(lua_State* L, Gc_Object* object)
 
 void Gc_Initialize(Gc* gc)
 {
-    gc->first       = NULL;
-    gc->firstGrey   = NULL;
-    gc->state       = Gc_State_Paused;
-    gc->threshold   = GCSTEPSIZE;
+    gc->first               = NULL;
+    gc->firstGrey           = NULL;
+    gc->state               = Gc_State_Paused;
+    gc->mode                = Gc_Mode_Incremental;
+    gc->threshold           = GCSTEPSIZE;
+    gc->firstOld            = NULL;
+    gc->firstRemembered     = NULL;
+    gc->firstYoungString    = NULL;
+    gc->minorSize           = 0;
+    gc->majorThreshold      = 0;
 }
 
 void Gc_Shutdown(lua_State* L, Gc* gc)
@@ -84,30 +111,15 @@ void Gc_Shutdown(lua_State* L, Gc* gc)
 
     gc->first = NULL;
     gc->firstGrey = NULL;
+    gc->firstOld = NULL;
+    gc->firstRemembered = NULL;
+    gc->firstYoungString = NULL;
 
 }
 
-void* Gc_AllocateObject(lua_State* L, int type, size_t size, bool link)
+static void Gc_InitializeObject(lua_State* L, Gc_Object* object, int type, bool link)
 {
 
-    Gc_Check(L, &L->gc);
-
-    Gc_Object* object = static_cast<Gc_Object*>(Allocate(L, size));
-    if (object == NULL)
-    {
-
-        // Emergency run of the garbage collector to free up memory.
-        Gc_Collect(L, &L->gc);
-
-        object = static_cast<Gc_Object*>(Allocate(L, size));
-        if (object == NULL)
-        {
-            // Out of memory!
-            State_Error(L);
-        }
-
-    }
-
     object->nextGrey    = NULL;
     object->type        = type;
 
@@ -130,15 +142,53 @@ void* Gc_AllocateObject(lua_State* L, int type, size_t size, bool link)
         object->next = L->gc.first;
         L->gc.first = object;
     }
+    else if (L->gc.mode == Gc_Mode_Generational)
+    {
+        // Objects which aren't in the global list (short strings) are kept in
+        // a separate list while they're young so a minor collection can free
+        // them without sweeping the entire string pool.
+        object->next = L->gc.firstYoungString;
+        L->gc.firstYoungString = object;
+    }
     else
     {
         object->next = NULL;
     }
 
+}
+
+void* Gc_AllocateObject(lua_State* L, int type, size_t size, bool link)
+{
+
+    Gc_Check(L, &L->gc);
+
+    Gc_Object* object = static_cast<Gc_Object*>(Allocate(L, size));
+    if (object == NULL)
+    {
+
+        // Emergency run of the garbage collector to free up memory.
+        Gc_Collect(L, &L->gc);
+
+        object = static_cast<Gc_Object*>(Allocate(L, size));
+        if (object == NULL)
+        {
+            // Out of memory!
+            State_Error(L);
+        }
+
+    }
+
+    Gc_InitializeObject(L, object, type, link);
     return object;
 
 }
 
+void Gc_LinkObject(lua_State* L, Gc_Object* object, int type)
+{
+    Gc_Check(L, &L->gc);
+    Gc_InitializeObject(L, object, type, true);
+}
+
 void Gc_MarkObject(Gc* gc, Gc_Object* object)
 {
     if (object->color == Color_White)
@@ -218,17 +268,35 @@ static bool Gc_Propagate(Gc* gc)
 
         Table* table = static_cast<Table*>(object);
 
+        // Mark the values in the array part.
+        Value* value = table->array;
+        Value* last  = value + table->arraySize;
+        while (value < last)
+        {
+            Gc_MarkValue(gc, value);
+            ++value;
+        }
+
         // Mark the key and values in the table.
-        TableNode* node = table->nodes;
-        TableNode* end  = node + table->numNodes;
-        while (node < end)
+        for (int i = 0; i < table->numNodes; ++i)
+        {
+            if (Table_GetNodeIsLive(table->nodes, table->numNodes, i))
+            {
+                TableNode* node = &table->nodes[i];
+                Gc_MarkValue(gc, &node->key);
+                Gc_MarkValue(gc, &node->value);
+            }
+        }
+
+        // Mark the keys and values that haven't been migrated yet.
+        for (int i = 0; i < table->numOldNodes; ++i)
         {
-            if (!node->dead)
+            if (Table_GetNodeIsLive(table->oldNodes, table->numOldNodes, i))
             {
+                TableNode* node = &table->oldNodes[i];
                 Gc_MarkValue(gc, &node->key);
                 Gc_MarkValue(gc, &node->value);
             }
-            ++node;
         }
 
         if (table->metatable != NULL)
@@ -367,7 +435,11 @@ static bool Gc_Propagate(Gc* gc)
 
 }
 
-static void Gc_Sweep(lua_State* L, Gc* gc)
+/**
+ * Frees the white objects in the global list before the object end (or in
+ * the entire list if end is NULL), and gives the remaining objects color.
+ */
+static void Gc_Sweep(lua_State* L, Gc* gc, Gc_Object* end, Color color)
 {
 
     ASSERT(gc->firstGrey == NULL);
@@ -375,17 +447,17 @@ static void Gc_Sweep(lua_State* L, Gc* gc)
     Gc_Object* object = gc->first;
     Gc_Object* prevObject = NULL;
 
-    while (object != NULL)
+    while (object != end)
     {
             
         // White objects are garbage object.
         if (object->color == Color_White)
         {
 
-            // Strings should never be collected from the global list; they
-            // are referenced from the string pool and are collected when we
-            // sweep the strings.
-            ASSERT(object->type != LUA_TSTRING);
+            // Short strings should never be collected from the global list;
+            // they are referenced from the string pool and are collected when
+            // we sweep the strings.
+            ASSERT(object->type != LUA_TSTRING || String_GetIsLong(static_cast<String*>(object)));
 
             // Remove from the global object list.
             if (prevObject != NULL)
@@ -405,7 +477,7 @@ static void Gc_Sweep(lua_State* L, Gc* gc)
         else
         {
             // Reset the color for the next gc cycle.
-            object->color = Color_White;
+            object->color = color;
     
             // Advance to the next object in the list.
             prevObject = object;
@@ -416,7 +488,23 @@ static void Gc_Sweep(lua_State* L, Gc* gc)
 
 }
 
-static void Gc_Finish(lua_State* L, Gc* gc)
+/**
+ * Releases memory the state is holding on to outside of the objects. This is
+ * done after each collection (like checkSizes in Lua 5.1), so that one long
+ * string built in the scratch buffer doesn't keep its memory for the life of
+ * the state, which would also raise the threshold for every later collection.
+ */
+static void Gc_CheckSizes(lua_State* L)
+{
+    // The buffer isn't empty if a collection happens while it's being used.
+    Buffer_Trim(L, &L->scratchBuffer, GCMAXSCRATCHSIZE);
+}
+
+/**
+ * Marks all of the objects which are reachable from the roots, including
+ * the ones reachable from objects already in the grey list.
+ */
+static void Gc_MarkAll(lua_State* L, Gc* gc)
 {
 
     // Mark the string constants since we never want to garbage collect them.
@@ -444,16 +532,137 @@ static void Gc_Finish(lua_State* L, Gc* gc)
     {
     }
 
-    Gc_Sweep(L, gc);
+}
+
+static void Gc_Finish(lua_State* L, Gc* gc)
+{
+
+    Gc_MarkAll(L, gc);
+    Gc_Sweep(L, gc, NULL, Color_White);
 
     // Sweep the string pool. We don't mark the strings since the string pool
     // acts a weak reference.
-    StringPool_SweepStrings(L, &L->stringPool);
+    StringPool_SweepStrings(L, &L->stringPool, Color_White);
+
+    Gc_CheckSizes(L);
+
+}
+
+/**
+ * Makes all of the objects white and empties the grey lists, so that they
+ * can be marked from scratch.
+ */
+static void Gc_ResetColors(lua_State* L, Gc* gc)
+{
+
+    // Forget which strings are young before any are freed.
+    Gc_Object* object = gc->firstYoungString;
+    while (object != NULL)
+    {
+        Gc_Object* nextObject = object->next;
+        object->next = NULL;
+        object = nextObject;
+    }
+    gc->firstYoungString = NULL;
+
+    for (object = gc->first; object != NULL; object = object->next)
+    {
+        object->color = Color_White;
+    }
+    StringPool_SetColor(&L->stringPool, Color_White);
+
+    gc->firstGrey       = NULL;
+    gc->firstRemembered = NULL;
+    gc->firstOld        = NULL;
+
+}
+
+/**
+ * Collects all of the objects in generational mode. Since the objects which
+ * survive stay black, they are all old afterwards.
+ */
+static void Gc_CollectMajor(lua_State* L, Gc* gc)
+{
+
+    Gc_ResetColors(L, gc);
+    Gc_MarkAll(L, gc);
+    Gc_Sweep(L, gc, NULL, Color_Black);
+    StringPool_SweepStrings(L, &L->stringPool, Color_Black);
+    Gc_CheckSizes(L);
+
+    gc->firstOld = gc->first;
+
+    size_t size = L->totalBytes;
+    gc->minorSize = size / 100 * GCMINORPERCENT;
+    if (gc->minorSize < GCMINORMINSIZE)
+    {
+        gc->minorSize = GCMINORMINSIZE;
+    }
+    gc->majorThreshold  = size + size / 100 * GCMAJORPERCENT;
+    gc->threshold       = size + gc->minorSize;
 
 }
 
+/**
+ * Collects the young objects in generational mode. Old objects are black, so
+ * marking stops when it reaches them and only the references from the roots
+ * and the remembered tables need to be followed.
+ */
+static void Gc_CollectMinor(lua_State* L, Gc* gc)
+{
+
+    // Mark the old tables which were given young values again.
+    while (gc->firstRemembered != NULL)
+    {
+        Gc_Object* object = gc->firstRemembered;
+        gc->firstRemembered = object->nextGrey;
+        object->nextGrey = gc->firstGrey;
+        gc->firstGrey = object;
+    }
+
+    Gc_MarkAll(L, gc);
+    Gc_Sweep(L, gc, gc->firstOld, Color_Black);
+
+    // Free the young strings which weren't marked; the ones which were are
+    // now old, and stay in the string pool.
+    Gc_Object* object = gc->firstYoungString;
+    while (object != NULL)
+    {
+        Gc_Object* nextObject = object->next;
+        object->next = NULL;
+        if (object->color == Color_White)
+        {
+            StringPool_RemoveString(L, &L->stringPool, static_cast<String*>(object));
+        }
+        object = nextObject;
+    }
+    gc->firstYoungString = NULL;
+    Gc_CheckSizes(L);
+
+    gc->firstOld  = gc->first;
+    gc->threshold = L->totalBytes + gc->minorSize;
+
+}
+
+static void Gc_CollectGenerational(lua_State* L, Gc* gc)
+{
+    if (L->totalBytes > gc->majorThreshold)
+    {
+        Gc_CollectMajor(L, gc);
+    }
+    else
+    {
+        Gc_CollectMinor(L, gc);
+    }
+}
+
 bool Gc_Step(lua_State* L, Gc* gc)
 {
+    if (gc->mode == Gc_Mode_Generational)
+    {
+        Gc_CollectGenerational(L, gc);
+        return true;
+    }
     switch (gc->state)
     {
     case Gc_State_Start:
@@ -482,6 +691,12 @@ bool Gc_Step(lua_State* L, Gc* gc)
 
 void Gc_Collect(lua_State* L, Gc* gc)
 {
+    if (gc->mode == Gc_Mode_Generational)
+    {
+        Gc_CollectMajor(L, gc);
+        return;
+    }
+
     // Finish up any propagation stage.
     while (gc->state != Gc_State_Paused)
     {
@@ -496,13 +711,44 @@ void Gc_Collect(lua_State* L, Gc* gc)
     }
 }
 
+void Gc_SetMode(lua_State* L, Gc* gc, Gc_Mode mode)
+{
+    if (mode == Gc_Mode_Generational)
+    {
+        // Abandon any incremental cycle; the major collection marks from scratch.
+        gc->mode  = Gc_Mode_Generational;
+        gc->state = Gc_State_Paused;
+        Gc_CollectMajor(L, gc);
+    }
+    else if (gc->mode != Gc_Mode_Incremental)
+    {
+        // Old objects are black, so whiten them to start a fresh cycle.
+        Gc_ResetColors(L, gc);
+        gc->mode      = Gc_Mode_Incremental;
+        gc->state     = Gc_State_Paused;
+        gc->threshold = L->totalBytes + GCSTEPSIZE;
+    }
+}
+
 void Gc_WriteBarrier(lua_State* L, Gc_Object* parent, Gc_Object* child)
 {
     if (parent->color == Color_Black)
     {
         if (child->color == Color_White)
         {
-            Gc_MarkObject(&L->gc, child);
+            Gc* gc = &L->gc;
+            if (gc->mode == Gc_Mode_Generational && parent->type == LUA_TTABLE)
+            {
+                // Remember the table so its values are marked by the next
+                // minor collection; it becomes black again when it's marked.
+                parent->color = Color_Grey;
+                parent->nextGrey = gc->firstRemembered;
+                gc->firstRemembered = parent;
+            }
+            else
+            {
+                Gc_MarkObject(gc, child);
+            }
         }
     }
 }
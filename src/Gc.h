@@ -21,6 +21,12 @@ enum Gc_State
     Gc_State_Paused,
 };
 
+enum Gc_Mode
+{
+    Gc_Mode_Incremental,
+    Gc_Mode_Generational,
+};
+
 /** "Colors" for marking nodes during garbage collection */
 enum Color
 {
@@ -39,13 +45,28 @@ struct Gc_Object
     Gc_Object*  nextGrey;   // If grey, this points to the next grey object.
 };
 
-/** Stores the current state of the garbage collector */
+/**
+ * Stores the current state of the garbage collector. In generational mode the
+ * objects which survive a collection are old and stay black, so that a minor
+ * collection only has to mark and sweep the young objects (the ones created
+ * since the last collection). New objects are added to the front of the
+ * global list, so the young objects are the ones before firstOld. Old objects
+ * which are given references to young objects are kept in the remembered list
+ * by the write barrier so the references can be found, and a major collection
+ * of all of the objects is run when the heap has grown enough.
+ */
 struct Gc
 {
     Gc_State    state;
+    Gc_Mode     mode;
     Gc_Object*  first;      // First object in the global list.
     Gc_Object*  firstGrey;  // First grey object during gc.
     size_t      threshold;
+    Gc_Object*  firstOld;           // First old object in the global list.
+    Gc_Object*  firstRemembered;    // Old tables to mark again, linked by nextGrey.
+    Gc_Object*  firstYoungString;   // Young short strings, linked by next.
+    size_t      minorSize;          // Growth of the heap between minor collections.
+    size_t      majorThreshold;     // Size of the heap for the next major collection.
 };
 
 void Gc_Initialize(Gc* gc);
@@ -62,10 +83,17 @@ void Gc_Collect(lua_State* L, Gc* gc);
 
 /**
  * Runs a single step of the incremental garbage collector. Returns true
- * if the garbage collector finished a cycle.
+ * if the garbage collector finished a cycle. In generational mode this runs
+ * a minor collection (or a major one if the heap has grown enough).
  */
 bool Gc_Step(lua_State* L, Gc* gc);
 
+/**
+ * Switches between incremental and generational collection. Switching to
+ * generational mode runs a full collection to make the surviving objects old.
+ */
+void Gc_SetMode(lua_State* L, Gc* gc, Gc_Mode mode);
+
 /**
  * If link is false, the object will not be included in the global garbage
  * collection list. This should only be used in rare instance where a pointer
@@ -73,8 +101,19 @@ bool Gc_Step(lua_State* L, Gc* gc);
  */
 void* Gc_AllocateObject(lua_State* L, int type, size_t size, bool link = true);
 
+/**
+ * Adds an object that was allocated with Allocate to the global garbage
+ * collection list, as if it had just been created with Gc_AllocateObject. This
+ * is used for objects which are built before they can be referenced (see
+ * String_FinishBuffer).
+ */
+void Gc_LinkObject(lua_State* L, Gc_Object* object, int type);
+
 /** 
- * Should be called when parent becomes an owner of child.
+ * Should be called when parent becomes an owner of child. In generational
+ * mode an old table which is given a young child is added to the remembered
+ * list, rather than marking the child, since tables tend to be written many
+ * times and the child may not be referenced by the next collection.
  */
 void Gc_WriteBarrier(lua_State* L, Gc_Object* parent, Gc_Object* child);
 void Gc_WriteBarrier(lua_State* L, Gc_Object* parent, const Value* child);
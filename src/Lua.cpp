@@ -335,6 +335,7 @@ static void Parse(lua_State* L, void* userData)
     for (int i = 0; i < closure->lclosure.numUpValues; ++i)
     {
         closure->lclosure.upValue[i] = UpValue_Create(L);
+        Gc_WriteBarrier(L, closure, closure->lclosure.upValue[i]);
     }
 
     // Remove the prototype from the stack.
@@ -415,6 +416,19 @@ void lua_pushlstring(lua_State *L, const char* data, size_t length)
     PushString(L, string);
 }
 
+char* lua_resizestringbuffer(lua_State *L, void** buffer, size_t size)
+{
+    String* string = String_ResizeBuffer(L, static_cast<String*>(*buffer), size);
+    *buffer = string;
+    return reinterpret_cast<char*>(string + 1);
+}
+
+void lua_pushstringbuffer(lua_State *L, void* buffer, size_t length)
+{
+    String* string = String_FinishBuffer(L, static_cast<String*>(buffer), length);
+    PushString(L, string);
+}
+
 void lua_pushstring(lua_State* L, const char* data)
 {
     if (data == NULL)
@@ -593,6 +607,10 @@ const void* lua_topointer(lua_State* L, int index)
         return value->lightUserdata;
     case Tag_Userdata:
         return UserData_GetData(value->userData);
+    case Tag_DeadKey:
+        // Dead keys are only stored in table nodes, never on the stack.
+        ASSERT(0);
+        break;
     }
     return NULL;
 }
@@ -779,6 +797,7 @@ void lua_replace(lua_State *L, int index)
         const Value* src = L->stackTop - 1;
         luai_apicheck(L, Value_GetIsTable(src));
         frame->function->closure->env = src->table;
+        Gc_WriteBarrier(L, frame->function->closure, src->table);
         --L->stackTop;
     }
     else
@@ -786,6 +805,11 @@ void lua_replace(lua_State *L, int index)
         Value* dst = GetValueForIndex(L, index);
         --L->stackTop;
         *dst = *L->stackTop;
+        if (index < LUA_GLOBALSINDEX)
+        {
+            // The value is an up value of the C function.
+            Gc_WriteBarrier(L, State_GetCallFrame(L)->function->closure, dst);
+        }
     }
 }
 
@@ -799,7 +823,7 @@ int lua_checkstack(lua_State *L, int size)
 void lua_createtable(lua_State *L, int narr, int nrec)
 {
     Value value;
-    SetValue( &value, Table_Create(L) );
+    SetValue( &value, Table_Create(L, narr, nrec) );
     PushValue( L, &value );
 }
 
@@ -963,7 +987,7 @@ int lua_next(lua_State* L, int index)
     
     Value* key = GetValueForIndex(L, -1);
 
-    const Value* value = Table_Next(table->table, key);
+    const Value* value = Table_Next(L, table->table, key);
     if (value == NULL)
     {
         Pop(L, 1);
@@ -1070,6 +1094,12 @@ int lua_gc(lua_State* L, int what, int data)
         return 0;
     }
     */
+    else if (what == LUA_GCGEN || what == LUA_GCINC)
+    {
+        int previous = (L->gc.mode == Gc_Mode_Generational) ? LUA_GCGEN : LUA_GCINC;
+        Gc_SetMode(L, &L->gc, (what == LUA_GCGEN) ? Gc_Mode_Generational : Gc_Mode_Incremental);
+        return previous;
+    }
     else if (what == LUA_GCCOUNT)
     {
         return static_cast<int>(L->totalBytes / 1024);
@@ -1086,6 +1116,17 @@ void lua_setgchook(lua_State *L, lua_GCHook func)
     L->gchook = func;
 }
 
+void lua_setcollation(lua_State *L, int collation)
+{
+    luai_apicheck(L, collation == LUA_COLLATE_BYTES || collation == LUA_COLLATE_LOCALE);
+    L->collation = collation;
+}
+
+int lua_getcollation(lua_State *L)
+{
+    return L->collation;
+}
+
 int lua_sethook(lua_State *L, lua_Hook hook, int mask, int count)
 {
     if (hook == NULL || mask == 0)
@@ -1240,6 +1281,15 @@ const char* lua_setupvalue(lua_State* L, int funcindex, int n)
     {
         ASSERT(upValue != NULL);
         Value_Copy( upValue, L->stackTop - 1 );
+        Closure* c = closure->closure;
+        if (c->c)
+        {
+            Gc_WriteBarrier(L, c, upValue);
+        }
+        else
+        {
+            Gc_WriteBarrier(L, c->lclosure.upValue[n - 1], upValue);
+        }
         Pop(L, 1);
     }
 
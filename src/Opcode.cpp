@@ -62,4 +62,30 @@ Instruction Opcode_EncodeAsBx(Opcode opcode, int a, int sbx)
 Instruction Opcode_EncodeABC(Opcode opcode, int a, int b, int c)
 {
     return opcode | (a << 6) | (b << 23) | (c << 14);
-}
\ No newline at end of file
+}
+
+int Opcode_EncodeSize(int size)
+{
+    int e = 0;
+    unsigned int x = static_cast<unsigned int>(size);
+    while (x >= 16)
+    {
+        x = (x + 1) >> 1;
+        ++e;
+    }
+    if (x < 8)
+    {
+        return x;
+    }
+    return ((e + 1) << 3) | (static_cast<int>(x) - 8);
+}
+
+int Opcode_DecodeSize(int x)
+{
+    int e = (x >> 3) & 31;
+    if (e == 0)
+    {
+        return x;
+    }
+    return ((x & 7) + 8) << (e - 1);
+}
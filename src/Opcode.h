@@ -77,4 +77,12 @@ Instruction Opcode_EncodeAsBx(Opcode opcode, int a, int sbx);
  */
 Instruction Opcode_EncodeABC(Opcode opcode, int a, int b, int c);
 
+/**
+ * Encodes a size as a "floating point byte" (eeeeexxx) so that it will fit in
+ * a B or C argument. The decoded value is always at least as large as the
+ * original size. This is used for the size hints in Opcode_NewTable.
+ */
+int Opcode_EncodeSize(int size);
+int Opcode_DecodeSize(int x);
+
 #endif
\ No newline at end of file
@@ -143,7 +143,7 @@ static int Parser_FindName(String* names[], int numNames, String* name)
 {
     for (int i = numNames - 1; i >= 0; --i)
     {
-        if (names[i] == name)
+        if (String_Equal(names[i], name))
         {
             return i;
         }
@@ -226,6 +226,7 @@ static int Parser_AddUpValue(Parser* parser, Function* function, String* name)
 
             int n =  function->numUpValues;
             function->upValue[n] = name;
+            Gc_WriteBarrier(parser->L, function, name);
 
             ++function->numUpValues;
             return n;
@@ -1055,6 +1056,7 @@ int Parser_AddFunction(Parser* parser, Function* f)
     int index = function->numFunctions;
 
     function->function[index] = f;
+    Gc_WriteBarrier(parser->L, function, f);
     ++function->numFunctions;
 
     return index;
@@ -1098,7 +1100,7 @@ Prototype* Function_CreatePrototype(lua_State* L, Function* function, String* so
     Table* constants = function->constants;
     const Value* value;
 
-    while (value = Table_Next(constants, &key))
+    while (value = Table_Next(L, constants, &key))
     {
         ASSERT(Value_GetIsNumber(value));
         int i = static_cast<int>(value->number);
@@ -95,6 +95,7 @@ lua_State* State_Create(lua_Alloc alloc, void* userdata)
     L->hookMask     = 0;
     L->hookCount    = 0;
     L->gchook       = NULL;
+    L->collation    = String_GetDefaultCollation();
     L->userdata     = userdata;
     L->stack        = reinterpret_cast<Value*>(L + 1);
     L->stackBase    = L->stack;
@@ -113,6 +114,8 @@ lua_State* State_Create(lua_Alloc alloc, void* userdata)
     memset(L->metatable, 0, sizeof(L->metatable));
 
     StringPool_Initialize(L, &L->stringPool);
+    Buffer_Initialize(L, &L->scratchBuffer);
+    L->openStringBuffer = NULL;
 
     // Always include one call frame which will represent calling into the Lua
     // API from C.
@@ -179,6 +182,8 @@ lua_State* State_Create(lua_Alloc alloc, void* userdata)
 
 void State_Destroy(lua_State* L)
 {
+    Buffer_Destroy(L, &L->scratchBuffer);
+    String_FreeBuffers(L, NULL);
     StringPool_Shutdown(L, &L->stringPool);
     Gc_Shutdown(L, &L->gc);
     L->alloc( L->userdata, L, 0, 0 );
@@ -194,8 +199,12 @@ void PushFString(lua_State* L, const char* fmt, ...)
 
 void PushVFString(lua_State* L, const char* fmt, va_list argp)
 {
-    int n = 1;
-    PushString(L, "" );
+
+    // The string is formatted into the scratch buffer and only the result is
+    // added to the string pool.
+    Buffer* buffer = &L->scratchBuffer;
+    Buffer_Clear(L, buffer);
+
     while (1)
     {
         const char* e = strchr(fmt, '%');
@@ -203,55 +212,70 @@ void PushVFString(lua_State* L, const char* fmt, va_list argp)
         {
             break;
         }
-        PushString( L, String_Create(L, fmt, e - fmt) );
+        Buffer_Append(L, buffer, fmt, e - fmt);
         switch (*(e+1))
         {
         case 's':
             {
                 const char* s = va_arg(argp, char*);
-                PushString(L, s ? s : "(null)");
+                if (s == NULL)
+                {
+                    s = "(null)";
+                }
+                Buffer_Append(L, buffer, s, strlen(s));
             }
             break;
         case 'c':
             {
-                char buff[2];
-                buff[0] = static_cast<char>(va_arg(argp, int));
-                buff[1] = '\0';
-                PushString(L, buff);
+                char c = static_cast<char>(va_arg(argp, int));
+                if (c != '\0')
+                {
+                    Buffer_Append(L, buffer, c);
+                }
             }
             break;
         case 'd':
-            PushNumber( L, static_cast<lua_Number>(va_arg(argp, int)) );
+            {
+                char temp[LUAI_MAXNUMBER2STR];
+                int length = NumberToString( static_cast<lua_Number>(va_arg(argp, int)), temp );
+                Buffer_Append(L, buffer, temp, length);
+            }
             break;
         case 'f':
-            PushNumber( L, static_cast<lua_Number>( va_arg(argp, double)) );
+            {
+                char temp[LUAI_MAXNUMBER2STR];
+                int length = NumberToString( static_cast<lua_Number>(va_arg(argp, double)), temp );
+                Buffer_Append(L, buffer, temp, length);
+            }
             break;
         case 'p':
             {
                 char buff[4*sizeof(void *) + 8]; // Should be enough space for a `%p'
-                sprintf(buff, "%p", va_arg(argp, void *));
-                PushString(L, buff);
+                int length = sprintf(buff, "%p", va_arg(argp, void *));
+                Buffer_Append(L, buffer, buff, length);
             }
             break;
         case '%':
-            PushString(L, "%");
+            Buffer_Append(L, buffer, '%');
             break;
         default:
+            Buffer_Append(L, buffer, '%');
+            if (*(e+1) == '\0')
             {
-                char buff[3];
-                buff[0] = '%';
-                buff[1] = *(e+1);
-                buff[2] = '\0';
-                PushString(L, buff);
+                // The format ends with a '%'.
+                fmt = e+1;
+                continue;
             }
+            Buffer_Append(L, buffer, *(e+1));
             break;
         }
-        n += 2;
         fmt = e+2;
     }
-    PushString(L, fmt);
-    Concat( L, L->stackTop - n - 1, L->stackTop - n - 1, L->stackTop - 1 ); 
-    Pop(L, n);
+    Buffer_Append(L, buffer, fmt, strlen(fmt));
+
+    PushString( L, String_Create(L, buffer->data, buffer->length) );
+    Buffer_Clear(L, buffer);
+
 }
 
 void Concat(lua_State* L, int n)
@@ -274,17 +298,53 @@ void Concat(lua_State* L, int n)
 void Concat(lua_State* L, Value* dst, Value* start, Value* end)
 {
 
-    Value_Copy(dst, start);
-
-    Value* arg1 = dst;
-    Value* arg2 = start + 1;
+    // Concatenation is right associative, so the values are combined from the
+    // end of the range. Each run of strings and numbers is copied into a
+    // single buffer and becomes one string, and only the values which aren't
+    // strings or numbers are passed to the __concat tag method.
 
-    while (arg2 <= end)
+    while (end > start)
     {
-        Vm_Concat(L, dst, arg1, arg2);
-        ++arg2;
+
+        Value* first = end + 1;
+        while (first > start && (Value_GetIsString(first - 1) || Value_GetIsNumber(first - 1)))
+        {
+            --first;
+        }
+
+        if (first < end)
+        {
+            size_t length = 0;
+            for (Value* value = first; value <= end; ++value)
+            {
+                ToString(L, value);
+                length += value->string->length;
+            }
+            Buffer* buffer = &L->scratchBuffer;
+            Buffer_Reserve(L, buffer, length);
+            char* data = buffer->data;
+            for (Value* value = first; value <= end; ++value)
+            {
+                memcpy(data, String_GetData(value->string), value->string->length);
+                data += value->string->length;
+            }
+            // The length marks the buffer as in use, since creating the string
+            // can run the garbage collector (see Gc_CheckSizes).
+            buffer->length = length;
+            SetValue( first, String_Create(L, buffer->data, length) );
+            Buffer_Clear(L, buffer);
+            end = first;
+        }
+        else
+        {
+            Vm_Concat(L, end - 1, end - 1, end);
+            --end;
+        }
+
     }
 
+    Value_Copy(dst, start);
+
 }
 
 bool ToString(lua_State* L, Value* value)
@@ -296,9 +356,9 @@ bool ToString(lua_State* L, Value* value)
     if (Value_GetIsNumber(value))
     {
         // Convert numbers to strings.
-        char temp[32];
-        sprintf(temp, "%.14g", value->number);
-        SetValue( value, String_Create(L, temp) );
+        char temp[LUAI_MAXNUMBER2STR];
+        int length = NumberToString(value->number, temp);
+        SetValue( value, String_Create(L, temp, length) );
         return true;
     }
     else
@@ -16,6 +16,7 @@ extern "C"
 #include "String.h"
 #include "Value.h"
 #include "Opcode.h"
+#include "Buffer.h"
 
 #include <setjmp.h>
 
@@ -56,6 +57,7 @@ struct lua_State
     int             hookMask;
     int             hookCount;
     lua_GCHook      gchook;
+    int             collation;      // LUA_COLLATE_BYTES or LUA_COLLATE_LOCALE.
     void*           userdata;
     ErrorHandler*   errorHandler;
     Value           globals;
@@ -68,6 +70,8 @@ struct lua_State
     String*         tagMethodName[TagMethod_NumMethods];
     CallFrame       callStackBase[LUAI_MAXCCALLS];
     StringPool      stringPool;
+    Buffer          scratchBuffer;  // Used by Concat and PushVFString (non-empty while in use).
+    String*         openStringBuffer;   // Unfinished string buffers (see String_ResizeBuffer).
 };
 
 void* Allocate(lua_State* L, size_t size);
@@ -198,7 +202,8 @@ inline void State_Remove(lua_State* L, Value* value)
 // Replaces the n values on the top of the stack with their concatenation.
 void Concat(lua_State* L, int n);
 
-// Concatenates a range of values between start and end.
+// Concatenates a range of values between start and end. The values in the
+// range are used as temporary storage.
 void Concat(lua_State* L, Value* dst, Value* start, Value* end);
 
 // Converts the value to a string; if the conversion was successful the function
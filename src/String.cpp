@@ -8,25 +8,93 @@
 #include "String.h"
 #include "State.h"
 
+#include <locale.h>
 #include <memory.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
-static unsigned int HashString(const char* data, size_t length)
+// Number of chains in the string pool. This is always a power of 2, so that
+// the hash can be masked to find the chain.
+#define STRINGPOOL_MIN_NODES        256
+
+// The pool grows when there are more than STRINGPOOL_MAX_LOAD strings per
+// chain, and shrinks when there are less than 1 / STRINGPOOL_MIN_LOAD.
+#define STRINGPOOL_MAX_LOAD         1
+#define STRINGPOOL_MIN_LOAD         4
+
+// Number of chains moved to the new node array by each insert while the pool
+// is growing.
+#define STRINGPOOL_MIGRATE_STEP     4
+
+static inline unsigned int RotateLeft(unsigned int x, int r)
 {
-    // TODO: If a string is very long, don't hash all of the characters.
-	// FNV-1a hash: http://isthe.com/chongo/tech/comp/fnv/
-    unsigned long hash = 2166136261;
+    return (x << r) | (x >> (32 - r));
+}
 
-    // For long strings, don't hash all of the characters.
-    size_t step = (length >> 5) + 1;
-    for (size_t i = 0; i < length; i += step)
-	{
-    	hash ^= data[i];
-    	hash *= 16777619;
+static unsigned int HashString(const char* data, size_t length, unsigned int seed)
+{
+
+    // MurmurHash3 (x86 32-bit): https://github.com/aappleby/smhasher
+    // Every byte of the string is hashed, four at a time, so that strings which
+    // differ in only a few characters don't collide.
+
+    const unsigned int c1 = 0xcc9e2d51;
+    const unsigned int c2 = 0x1b873593;
+
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(data);
+    const unsigned char* end = p + (length & ~3);
+
+    unsigned int hash = seed;
+    unsigned int k;
+
+    for (; p < end; p += 4)
+    {
+        memcpy(&k, p, 4);
+        k *= c1;
+        k  = RotateLeft(k, 15);
+        k *= c2;
+        hash ^= k;
+        hash  = RotateLeft(hash, 13);
+        hash  = hash * 5 + 0xe6546b64;
     }
 
+    k = 0;
+    switch (length & 3)
+    {
+    case 3: k ^= p[2] << 16;
+    case 2: k ^= p[1] << 8;
+    case 1: k ^= p[0];
+            k *= c1;
+            k  = RotateLeft(k, 15);
+            k *= c2;
+            hash ^= k;
+    }
+
+    hash ^= static_cast<unsigned int>(length);
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+
     return hash;
+
+}
+
+/**
+ * Returns a random seed for the string hashes, so that the hashes of strings
+ * (and the collisions between them) can't be predicted from outside.
+ */
+static unsigned int MakeSeed(lua_State* L)
+{
+    // The addresses vary with address space layout randomization.
+    size_t data[4];
+    data[0] = reinterpret_cast<size_t>(L);
+    data[1] = reinterpret_cast<size_t>(&data);
+    data[2] = static_cast<size_t>( time(NULL) );
+    data[3] = static_cast<size_t>( clock() );
+    return HashString(reinterpret_cast<const char*>(data), sizeof(data), 0);
 }
 
 static String** CreateNodeArray(lua_State* L, int numNodes)
@@ -47,18 +115,20 @@ void StringPool_Initialize(lua_State* L, StringPool* stringPool)
     // This was chosen for the intial string pool size because it's
     // the size required to hold all of the strings after opening all
     // of the standard packages.
-    const int initializeSize = 256;
-    stringPool->numNodes    = initializeSize;    
+    stringPool->numNodes    = STRINGPOOL_MIN_NODES;
     stringPool->node        = CreateNodeArray(L, stringPool->numNodes);
     stringPool->numStrings  = 0;
+    stringPool->numOldNodes = 0;
+    stringPool->oldNode     = NULL;
+    stringPool->migrateIndex = 0;
+    stringPool->seed        = MakeSeed(L);
 }
 
-void StringPool_Shutdown(lua_State* L, StringPool* stringPool)
+static void StringPool_DestroyChains(lua_State* L, String** node, int numNodes)
 {
-
-    for (int i = 0; i < stringPool->numNodes; ++i)
+    for (int i = 0; i < numNodes; ++i)
     {
-        String* string = stringPool->node[i];
+        String* string = node[i];
         while (string != NULL)
         {
             String* next = string->nextString;
@@ -66,30 +136,116 @@ void StringPool_Shutdown(lua_State* L, StringPool* stringPool)
             string = next;
         }
     }
+    FreeNodeArray(L, node, numNodes);
+}
 
-    FreeNodeArray(L, stringPool->node, stringPool->numNodes);
+void StringPool_Shutdown(lua_State* L, StringPool* stringPool)
+{
+    StringPool_DestroyChains(L, stringPool->oldNode, stringPool->numOldNodes);
+    StringPool_DestroyChains(L, stringPool->node, stringPool->numNodes);
 }
 
-static void StringPool_Grow(lua_State* L, StringPool* stringPool, int numNodes)
+/**
+ * Moves all of the strings in the chain into the node array.
+ */
+static void StringPool_InsertChain(String** node, int numNodes, String* string)
 {
+    while (string != NULL)
+    {
+        String* next = string->nextString;
+        int index = string->hash & (numNodes - 1);
+        string->nextString = node[index];
+        node[index] = string;
+        string = next;
+    }
+}
 
-    String** node = CreateNodeArray(L, numNodes);
+/**
+ * Moves the strings in up to numBuckets chains of the old node array into the
+ * node array. Once all of the chains have been moved the old node array is
+ * freed.
+ */
+static void StringPool_Migrate(lua_State* L, StringPool* stringPool, int numBuckets)
+{
 
-    // Reinsert all of the strings into the new array.
-    for (int i = 0; i < stringPool->numNodes; ++i)
+    int end = stringPool->migrateIndex + numBuckets;
+    if (end > stringPool->numOldNodes)
     {
-        String* string = stringPool->node[i];
-        while (string != NULL)
-        {
-            String* next = string->nextString;
+        end = stringPool->numOldNodes;
+    }
+
+    for (int i = stringPool->migrateIndex; i < end; ++i)
+    {
+        StringPool_InsertChain(stringPool->node, stringPool->numNodes, stringPool->oldNode[i]);
+        stringPool->oldNode[i] = NULL;
+    }
+    stringPool->migrateIndex = end;
+
+    if (end == stringPool->numOldNodes)
+    {
+        FreeNodeArray(L, stringPool->oldNode, stringPool->numOldNodes);
+        stringPool->numOldNodes  = 0;
+        stringPool->oldNode      = NULL;
+        stringPool->migrateIndex = 0;
+    }
 
-            int index = string->hash % numNodes;
-            string->nextString = node[index];
-            node[index] = string;
+}
 
-            string = next;
+/**
+ * Returns the chain that holds the strings with the hash. While the pool is
+ * being migrated, the chains in the old node array that haven't been moved yet
+ * are used for their strings (including the new ones).
+ */
+static String** StringPool_GetChain(StringPool* stringPool, unsigned int hash)
+{
+    if (stringPool->oldNode != NULL)
+    {
+        int index = hash & (stringPool->numOldNodes - 1);
+        if (index >= stringPool->migrateIndex)
+        {
+            return &stringPool->oldNode[index];
         }
     }
+    return &stringPool->node[hash & (stringPool->numNodes - 1)];
+}
+
+/**
+ * Doubles the number of nodes in the pool. The strings are moved into the new
+ * node array a few chains at a time by the following inserts, so that growing
+ * a large pool doesn't cause a pause.
+ */
+static void StringPool_Grow(lua_State* L, StringPool* stringPool)
+{
+
+    if (stringPool->oldNode != NULL)
+    {
+        StringPool_Migrate(L, stringPool, stringPool->numOldNodes);
+    }
+
+    stringPool->numOldNodes  = stringPool->numNodes;
+    stringPool->oldNode      = stringPool->node;
+    stringPool->migrateIndex = 0;
+
+    stringPool->numNodes     = stringPool->numNodes * 2;
+    stringPool->node         = CreateNodeArray(L, stringPool->numNodes);
+
+}
+
+/**
+ * Rehashes all of the strings into a node array with numNodes nodes at once.
+ * The pool must not be being migrated.
+ */
+static void StringPool_Resize(lua_State* L, StringPool* stringPool, int numNodes)
+{
+
+    ASSERT( stringPool->oldNode == NULL );
+
+    String** node = CreateNodeArray(L, numNodes);
+
+    for (int i = 0; i < stringPool->numNodes; ++i)
+    {
+        StringPool_InsertChain(node, numNodes, stringPool->node[i]);
+    }
 
     FreeNodeArray(L, stringPool->node, stringPool->numNodes);
 
@@ -101,13 +257,15 @@ static void StringPool_Grow(lua_State* L, StringPool* stringPool, int numNodes)
 String* StringPool_Insert(lua_State* L, StringPool* stringPool, const char* data, size_t length)
 {
 
-	unsigned int hash = HashString(data, length);
-	
-	int index = hash % stringPool->numNodes;
-	String* firstString = stringPool->node[index];	
+    if (stringPool->oldNode != NULL)
+    {
+        StringPool_Migrate(L, stringPool, STRINGPOOL_MIGRATE_STEP);
+    }
+
+	unsigned int hash = HashString(data, length, stringPool->seed);
 	
 	// Search for the exact string in the string pool.
-	String* string = firstString;
+	String* string = *StringPool_GetChain(stringPool, hash);
 	while (string != NULL)
 	{
 		if (string->length == length && memcmp(String_GetData(string), data, length) == 0)
@@ -124,9 +282,13 @@ String* StringPool_Insert(lua_State* L, StringPool* stringPool, const char* data
 		// we store the data for the string immediately after the String structure.
 		string = static_cast<String*>( Gc_AllocateObject(L, LUA_TSTRING, sizeof(String) + length + 1, false) );
 
+        // Allocating can run the garbage collector, which can resize the pool,
+        // so the chain is found again.
+        String** chain = StringPool_GetChain(stringPool, hash);
+
 		string->hash 		= hash;
 		string->length		= length;
-		string->nextString  = stringPool->node[index];
+		string->nextString  = *chain;
 
         char* stringData = reinterpret_cast<char*>(string + 1);
 
@@ -138,12 +300,12 @@ String* StringPool_Insert(lua_State* L, StringPool* stringPool, const char* data
 #endif
 
         // Add to the pool.
-		stringPool->node[index] = string;
+		*chain = string;
         ++stringPool->numStrings;
 
-        if (stringPool->numStrings >= stringPool->numNodes)
+        if (stringPool->numStrings > stringPool->numNodes * STRINGPOOL_MAX_LOAD)
         {
-            StringPool_Grow(L, stringPool, stringPool->numNodes * 2);
+            StringPool_Grow(L, stringPool);
         }
 
 	}
@@ -156,8 +318,15 @@ String* StringPool_Insert(lua_State* L, StringPool* stringPool, const char* data
 
 }
 
-void StringPool_SweepStrings(lua_State* L, StringPool* stringPool)
+void StringPool_SweepStrings(lua_State* L, StringPool* stringPool, Color color)
 {
+
+    // Sweeping visits every string, so finishing the migration first doesn't
+    // add much to the cost.
+    if (stringPool->oldNode != NULL)
+    {
+        StringPool_Migrate(L, stringPool, stringPool->numOldNodes);
+    }
     
     String** node = stringPool->node;
 
@@ -165,7 +334,6 @@ void StringPool_SweepStrings(lua_State* L, StringPool* stringPool)
     {
         String* string = node[i];
         String* prev   = NULL;
-        int j = 0;
         while (string != NULL)
         {
             String* next = string->nextString;
@@ -184,33 +352,258 @@ void StringPool_SweepStrings(lua_State* L, StringPool* stringPool)
             }
             else
             {
-                string->color = Color_White;
+                string->color = color;
                 prev = string;
             }
             string = next;
-            ++j;
         }
     }
+
+    // If most of the strings were freed, shrink the pool.
+    int numNodes = stringPool->numNodes;
+    while (numNodes > STRINGPOOL_MIN_NODES && stringPool->numStrings < numNodes / STRINGPOOL_MIN_LOAD)
+    {
+        numNodes /= 2;
+    }
+    if (numNodes != stringPool->numNodes)
+    {
+        StringPool_Resize(L, stringPool, numNodes);
+    }
                     
 }
 
+void StringPool_RemoveString(lua_State* L, StringPool* stringPool, String* string)
+{
+
+    String** link = StringPool_GetChain(stringPool, string->hash);
+    while (*link != string)
+    {
+        ASSERT(*link != NULL);
+        link = &(*link)->nextString;
+    }
+    *link = string->nextString;
+
+    String_Destroy(L, string);
+    --stringPool->numStrings;
+
+}
+
+static void StringPool_SetChainColors(String** node, int numNodes, Color color)
+{
+    for (int i = 0; i < numNodes; ++i)
+    {
+        for (String* string = node[i]; string != NULL; string = string->nextString)
+        {
+            string->color = color;
+        }
+    }
+}
+
+void StringPool_SetColor(StringPool* stringPool, Color color)
+{
+    if (stringPool->oldNode != NULL)
+    {
+        StringPool_SetChainColors(stringPool->oldNode, stringPool->numOldNodes, color);
+    }
+    StringPool_SetChainColors(stringPool->node, stringPool->numNodes, color);
+}
+
 String* String_Create(lua_State* L, const char* data)
 {
     return String_Create(L, data, strlen(data));
 }
 
+/**
+ * Allocates a long string. Long strings are regular garbage collected objects
+ * rather than being stored in the string pool, so creating one doesn't require
+ * hashing the data or comparing it against the other strings.
+ */
+static String* String_CreateLong(lua_State* L, const char* data, size_t length)
+{
+
+    String* string = static_cast<String*>( Gc_AllocateObject(L, LUA_TSTRING, sizeof(String) + length + 1) );
+
+    string->hash        = 0;
+    string->length      = length;
+    string->seed        = L->stringPool.seed;
+
+    char* stringData = reinterpret_cast<char*>(string + 1);
+
+    memcpy( stringData, data, length );
+    stringData[length] = 0;
+
+#ifdef DEBUG
+    string->_data = stringData;
+#endif
+
+    return string;
+
+}
+
 String* String_Create(lua_State* L, const char* data, size_t length)
 {
+    if (length > STRING_MAX_SHORT_LENGTH)
+    {
+        return String_CreateLong(L, data, length);
+    }
     return StringPool_Insert(L, &L->stringPool, data, length);
 }
 
+static void String_SetDebugData(String* string)
+{
+#ifdef DEBUG
+    string->_data = reinterpret_cast<char*>(string + 1);
+#else
+    (void)string;
+#endif
+}
+
+/**
+ * Returns the link in the list of unfinished buffers that points to the
+ * buffer. This is almost always the most recently created buffer.
+ */
+static String** String_FindBufferLink(lua_State* L, String* buffer)
+{
+    String** link = &L->openStringBuffer;
+    while (*link != buffer)
+    {
+        ASSERT( *link != NULL );
+        link = &(*link)->nextString;
+    }
+    return link;
+}
+
+String* String_ResizeBuffer(lua_State* L, String* buffer, size_t capacity)
+{
+
+    String** link   = &L->openStringBuffer;
+    String*  next   = L->openStringBuffer;
+    size_t oldSize  = 0;
+
+    if (buffer != NULL)
+    {
+        link    = String_FindBufferLink(L, buffer);
+        next    = buffer->nextString;
+        oldSize = sizeof(String) + buffer->length + 1;
+    }
+
+    // If the allocation fails the buffer is unchanged, so it's still in the
+    // list to be freed by the error.
+    size_t newSize = sizeof(String) + capacity + 1;
+    String* result = static_cast<String*>( Reallocate(L, buffer, oldSize, newSize) );
+    if (result == NULL)
+    {
+        // Emergency run of the garbage collector to free up memory.
+        Gc_Collect(L, &L->gc);
+        result = static_cast<String*>( Reallocate(L, buffer, oldSize, newSize) );
+        if (result == NULL)
+        {
+            State_Error(L);
+        }
+    }
+
+    result->hash        = 0;
+    result->length      = capacity;
+    result->nextString  = next;
+    String_SetDebugData(result);
+    *link = result;
+
+    return result;
+
+}
+
+String* String_FinishBuffer(lua_State* L, String* buffer, size_t length)
+{
+
+    ASSERT( length <= buffer->length );
+
+    if (length <= STRING_MAX_SHORT_LENGTH)
+    {
+        String* string = StringPool_Insert(L, &L->stringPool, String_GetData(buffer), length);
+        *String_FindBufferLink(L, buffer) = buffer->nextString;
+        String_Destroy(L, buffer);
+        return string;
+    }
+
+    String** link = String_FindBufferLink(L, buffer);
+
+    if (length != buffer->length)
+    {
+        // Give back the unused space. This should be done in place by the
+        // allocator, but if it fails the buffer is copied instead.
+        size_t oldSize = sizeof(String) + buffer->length + 1;
+        String* string = static_cast<String*>( Reallocate(L, buffer, oldSize, sizeof(String) + length + 1) );
+        if (string == NULL)
+        {
+            string = String_CreateLong(L, String_GetData(buffer), length);
+            *String_FindBufferLink(L, buffer) = buffer->nextString;
+            String_Destroy(L, buffer);
+            return string;
+        }
+        buffer = string;
+    }
+
+    *link = buffer->nextString;
+
+    buffer->hash    = 0;
+    buffer->length  = length;
+    buffer->seed    = L->stringPool.seed;
+    reinterpret_cast<char*>(buffer + 1)[length] = 0;
+    String_SetDebugData(buffer);
+
+    Gc_LinkObject(L, buffer, LUA_TSTRING);
+    return buffer;
+
+}
+
+void String_FreeBuffers(lua_State* L, String* stop)
+{
+    while (L->openStringBuffer != stop)
+    {
+        ASSERT( L->openStringBuffer != NULL );
+        String* buffer = L->openStringBuffer;
+        L->openStringBuffer = buffer->nextString;
+        String_Destroy(L, buffer);
+    }
+}
+
+unsigned int String_ComputeHash(String* string)
+{
+    ASSERT( String_GetIsLong(string) );
+    unsigned int hash = HashString(String_GetData(string), string->length, string->seed);
+    // 0 is used to indicate the hash hasn't been computed.
+    if (hash == 0)
+    {
+        hash = 1;
+    }
+    string->hash = hash;
+    return hash;
+}
+
 void String_Destroy(lua_State* L, String* string)
 {
     size_t size = sizeof(String) + string->length + 1;
     Free(L, string, size);
 }
 
-int String_Compare(String* string1, String* string2)
+static int String_CompareBytes(String* string1, String* string2)
+{
+    size_t length1 = string1->length;
+    size_t length2 = string2->length;
+    int result = memcmp( String_GetData(string1), String_GetData(string2), length1 < length2 ? length1 : length2 );
+    if (result != 0)
+    {
+        return result;
+    }
+    // Equal up to the end of the shorter string, so the shorter string is less.
+    return (length1 > length2) - (length1 < length2);
+}
+
+/**
+ * Compares the strings with strcoll, which stops at the first '\0', so the
+ * parts of the strings between embedded zeros are compared one at a time.
+ */
+static int String_CompareLocale(String* string1, String* string2)
 {
     const char *l = String_GetData(string1);
     size_t ll = string1->length;
@@ -246,4 +639,27 @@ int String_Compare(String* string1, String* string2)
             lr -= len;
         }
     }
-}
\ No newline at end of file
+}
+
+int String_Compare(lua_State* L, String* string1, String* string2)
+{
+    if (string1 == string2)
+    {
+        return 0;
+    }
+    if (L->collation == LUA_COLLATE_BYTES)
+    {
+        return String_CompareBytes(string1, string2);
+    }
+    return String_CompareLocale(string1, string2);
+}
+
+int String_GetDefaultCollation()
+{
+    const char* locale = setlocale(LC_COLLATE, NULL);
+    if (locale != NULL && (strcmp(locale, "C") == 0 || strcmp(locale, "POSIX") == 0))
+    {
+        return LUA_COLLATE_BYTES;
+    }
+    return LUA_COLLATE_LOCALE;
+}
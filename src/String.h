@@ -9,14 +9,24 @@
 
 #include "Gc.h"
 
+#include <string.h>
+
 struct Table;
 union  Value;
 
+// Strings longer than this are not stored in the string pool (see
+// String_Create).
+#define STRING_MAX_SHORT_LENGTH     40
+
 struct String : public Gc_Object
 {
-	unsigned int    hash;
+	unsigned int    hash;       // 0 for a long string until String_GetHash.
 	size_t 			length;
-	String*			nextString;	// For chaining in the string pool.
+    union
+    {
+        String*     nextString; // For chaining in the string pool.
+        unsigned    seed;       // For hashing a long string (see String_GetHash).
+    };
 #ifdef DEBUG
     // Useful for viewing in the watch window, but not necessary since the
     // string data is immediately after the structure in memory.
@@ -24,23 +34,98 @@ struct String : public Gc_Object
 #endif
 };
 
+/**
+ * The string pool is a chained hash table of all of the short strings. When
+ * the pool grows, the strings in the previous node array (oldNode) are moved
+ * to the new one a few chains at a time (see StringPool_Insert).
+ */
 struct StringPool
 {
     String**        node;
     int             numStrings;
     int             numNodes;
+    String**        oldNode;
+    int             numOldNodes;
+    int             migrateIndex;   // Next chain in oldNode to move.
+    unsigned int    seed;           // Random seed for the string hashes.
 };
 
 inline const char* String_GetData(const String* string)
     { return reinterpret_cast<const char*>(string + 1); }
 
+/**
+ * Returns true if the string is not stored in the string pool, in which case
+ * there may be other strings with identical data.
+ */
+inline bool String_GetIsLong(const String* string)
+    { return string->length > STRING_MAX_SHORT_LENGTH; }
+
+/**
+ * Computes the hash for a long string the first time it's needed.
+ */
+unsigned int String_ComputeHash(String* string);
+
+inline unsigned int String_GetHash(String* string)
+{
+    if (string->hash == 0)
+    {
+        return String_ComputeHash(string);
+    }
+    return string->hash;
+}
+
+/**
+ * Returns true if the two strings have the same data. Short strings are only
+ * equal if they are the same object, since they are stored in the string pool.
+ */
+inline bool String_Equal(const String* string1, const String* string2)
+{
+    if (string1 == string2)
+    {
+        return true;
+    }
+    return String_GetIsLong(string1) && string1->length == string2->length &&
+           memcmp(String_GetData(string1), String_GetData(string2), string1->length) == 0;
+}
+
 /**
  * Allocates a new string. If a string with identical data already exists,
- * that string will be returned instead of allocating a new one.
+ * that string will be returned instead of allocating a new one. Long strings
+ * are the exception; they are allocated without looking for an identical
+ * string and their hash isn't computed until they are used as a table key.
  */
 String* String_Create(lua_State* L, const char* data);
 String* String_Create(lua_State* L, const char* data, size_t length);
 
+/**
+ * String buffers are used to build a string in the memory that will become
+ * the string object, so that a long result doesn't need to be copied when it's
+ * finished. A buffer is a String whose length is its capacity, which isn't
+ * visible to the garbage collector until it's finished. Unfinished buffers are
+ * kept in a list on the state so that they can be freed if an error occurs
+ * (see String_FreeBuffers).
+ */
+
+/**
+ * Resizes a string buffer so that it can hold capacity characters, keeping
+ * its contents. If buffer is NULL, a new buffer is created. Returns the
+ * buffer, which may have moved.
+ */
+String* String_ResizeBuffer(lua_State* L, String* buffer, size_t capacity);
+
+/**
+ * Turns the first length characters of a string buffer into a string. Short
+ * strings are copied into the string pool, long strings use the buffer's
+ * memory. The buffer can't be used afterwards.
+ */
+String* String_FinishBuffer(lua_State* L, String* buffer, size_t length);
+
+/**
+ * Frees the unfinished string buffers which were created after the buffer
+ * stop (or all of the buffers if stop is NULL).
+ */
+void String_FreeBuffers(lua_State* L, String* stop);
+
 /**
  * Releases the memory for a string. This should only be called when you know
  * there are no remaining references to the string (i.e. it should only be
@@ -48,8 +133,17 @@ String* String_Create(lua_State* L, const char* data, size_t length);
  */
 void String_Destroy(lua_State* L, String* string); 
 
-// Return value is the same as strcmp.
-int String_Compare(String* string1, String* string2);
+/**
+ * Compares two strings using the collation order of the state (see
+ * lua_setcollation). Return value is the same as strcmp.
+ */
+int String_Compare(lua_State* L, String* string1, String* string2);
+
+/**
+ * Returns LUA_COLLATE_BYTES if the current LC_COLLATE locale orders strings by
+ * their bytes, or LUA_COLLATE_LOCALE otherwise.
+ */
+int String_GetDefaultCollation();
 
 void StringPool_Initialize(lua_State* L, StringPool* stringPool);
 void StringPool_Shutdown(lua_State* L, StringPool* stringPool);
@@ -58,8 +152,20 @@ void StringPool_Shutdown(lua_State* L, StringPool* stringPool);
  * Removes strings for the string pool that are marked as white. Strings are
  * handled differently than other types of garbage collected objects, since the
  * string pool has weak references to the strings -- when a string no longer has
- * any references outside the pool we need to remove it from the pool.
+ * any references outside the pool we need to remove it from the pool. The
+ * strings which remain are given color.
+ */
+void StringPool_SweepStrings(lua_State* L, StringPool* stringPool, Color color);
+
+/**
+ * Removes a single string from the string pool and frees it. This is used by
+ * minor collections, which only sweep the young strings.
+ */
+void StringPool_RemoveString(lua_State* L, StringPool* stringPool, String* string);
+
+/**
+ * Sets the color of all of the strings in the string pool.
  */
-void StringPool_SweepStrings(lua_State* L, StringPool* stringPool);
+void StringPool_SetColor(StringPool* stringPool, Color color);
 
 #endif
\ No newline at end of file
@@ -9,33 +9,84 @@
 #include "String.h"
 
 #include <stdio.h>
+#include <string.h>
+
+#ifdef TABLE_OPEN_ADDRESSING
+    #if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+        #define TABLE_SSE2
+        #include <emmintrin.h>
+    #endif
+    #ifdef _MSC_VER
+        #include <intrin.h>
+    #endif
+#endif
 
 // This define will check that the table is in a correct state after each
 // modification. It's helpful for debugging, but it's very slow.
 //#define TABLE_CHECK_CONSISTENCY
 
-static bool Table_WriteDot(const Table* table, const char* fileName);
+// Maximum number of bits in the size of the array part of a table. The array
+// can hold at most 2^TABLE_MAX_ARRAY_BITS elements.
+#define TABLE_MAX_ARRAY_BITS    26
+#define TABLE_MAX_ARRAY_SIZE    (1 << TABLE_MAX_ARRAY_BITS)
 
-template <class T>
-static inline void Swap(T& a, T& b)
-{
-    T temp = a;
-    a = b;
-    b = temp;
-}
+// Value stored in the next and prev indices of a node at the end of a chain.
+#define TABLE_NO_NODE           -1
+
+// Hash parts with at least this many nodes are migrated incrementally when
+// they are resized rather than rehashed all at once.
+#define TABLE_MIGRATE_MIN_NODES (1 << 16)
+
+// Number of nodes moved from the old hash part by each insert or lookup while
+// the table is being migrated.
+#define TABLE_MIGRATE_STEP      64
+
+#ifndef TABLE_OPEN_ADDRESSING
+static bool Table_WriteDot(const Table* table, const char* fileName);
+#endif
+static bool Table_Resize(lua_State* L, Table* table, int arraySize, int numNodes);
+static bool Table_InsertNode(lua_State* L, Table* table, Value* key, Value* value);
+static void Table_SetNodes(Table* table, TableNode* nodes, int numNodes);
+static void Table_FreeNodes(lua_State* L, TableNode* nodes, int numNodes);
 
 Table* Table_Create(lua_State* L)
 {
     Table* table = static_cast<Table*>( Gc_AllocateObject(L, LUA_TTABLE, sizeof(Table)) );
-    table->numNodes     = 0;
-    table->nodes        = NULL;
+    Table_SetNodes(table, NULL, 0);
+    table->numOldNodes  = 0;
+    table->oldNodes     = NULL;
+    table->migrateIndex = 0;
+    table->arraySize    = 0;
+    table->array        = NULL;
+    table->border       = 0;
+    table->nextNode     = 0;
+    table->tagMethodFlags = 0;
     table->metatable    = NULL;
     return table;
 }
 
+Table* Table_Create(lua_State* L, int arraySize, int numNodes)
+{
+    Table* table = Table_Create(L);
+    if (arraySize > TABLE_MAX_ARRAY_SIZE)
+    {
+        arraySize = TABLE_MAX_ARRAY_SIZE;
+    }
+    if (arraySize > 0 || numNodes > 0)
+    {
+        if (!Table_Resize(L, table, arraySize > 0 ? arraySize : 0, numNodes > 0 ? numNodes : 0))
+        {
+            State_Error(L);
+        }
+    }
+    return table;
+}
+
 void Table_Destroy(lua_State* L, Table* table)
 {
-    Free(L, table->nodes, table->numNodes * sizeof(TableNode));
+    Table_FreeNodes(L, table->nodes, table->numNodes);
+    Table_FreeNodes(L, table->oldNodes, table->numOldNodes);
+    Free(L, table->array, table->arraySize * sizeof(Value));
     Free(L, table, sizeof(Table));
 }
 
@@ -78,7 +129,7 @@ FORCE_INLINE static unsigned int Hash(const Value* key)
     }
     else if (Value_GetIsString(key))
     {
-        return key->string->hash;
+        return String_GetHash(key->string);
     }
     else if (Value_GetIsBoolean(key))
     {
@@ -93,165 +144,362 @@ FORCE_INLINE static bool KeysEqual(const Value* key1, const Value* key2)
     {
         return false;
     }
-    return key1->object == key2->object;
+    if (key1->object == key2->object)
+    {
+        return true;
+    }
+    return Value_GetIsString(key1) && String_Equal(key1->string, key2->string);
 }
 
-FORCE_INLINE static size_t Table_GetMainIndex(const Table* table, const Value* key)
+/**
+ * Compares keys by identity. This is used for the keys in dead nodes, which
+ * may refer to objects that have already been collected.
+ */
+FORCE_INLINE static bool KeysIdentical(const Value* key1, const Value* key2)
 {
-    return Hash(key) & (table->numNodes - 1);
+    return key1->tag == key2->tag && key1->object == key2->object;
 }
 
-FORCE_INLINE static bool Table_NodeIsEmpty(const TableNode* node)
+/**
+ * Returns the index into the array part of the table for the key, or -1 if
+ * the key is not stored in the array part.
+ */
+FORCE_INLINE static int Table_GetArrayIndex(const Table* table, const Value* key)
+{
+    if (Value_GetIsNumber(key))
+    {
+        lua_Number n = key->number;
+        int k;
+        lua_number2int(k, n);
+        if (static_cast<lua_Number>(k) == n && static_cast<unsigned int>(k - 1) < static_cast<unsigned int>(table->arraySize))
+        {
+            return k - 1;
+        }
+    }
+    return -1;
+}
+
+/**
+ * Returns ceil(log2(x)).
+ */
+static int CeilLog2(unsigned int x)
 {
-    return node->dead;
+    int log = 0;
+    --x;
+    while (x > 0)
+    {
+        x >>= 1;
+        ++log;
+    }
+    return log;
 }
 
+#ifdef TABLE_OPEN_ADDRESSING
+
 /**
- * Returns true if the node pointer is valid for the table. This is used
- * for debugging.
+ * Returns the number of control bytes for a hash part with numNodes nodes.
+ * There is always at least one full group of control bytes so that a group can
+ * be loaded as a whole; the bytes past the end of a small table are set to
+ * TABLE_CONTROL_SENTINEL.
  */
-static bool Table_GetIsValidNode(const Table* table, const TableNode* node)
+static inline int Table_GetNumControlBytes(int numNodes)
 {
-    return (node >= table->nodes) && (node < table->nodes + table->numNodes);
+    return numNodes < TABLE_GROUP_SIZE ? TABLE_GROUP_SIZE : numNodes;
 }
 
 /**
- * Checks various aspects of the table to make sure they are correct. Returns
- * true if everything in the table structure appears valid. This function is 
- * not fast and should only be used for debugging.
+ * Returns the number of keys that can be stored in a hash part with numNodes
+ * nodes before it must be rehashed. Leaving some nodes empty keeps the probe
+ * sequences short.
  */
-static bool Table_CheckConsistency(const Table* table)
+static inline int Table_GetCapacity(int numNodes)
 {
+    return numNodes - numNodes / 8;
+}
 
-    for (int i = 0; i < table->numNodes; ++i)
+/**
+ * Returns the number of nodes needed to store numKeys keys in the hash part.
+ */
+static int Table_ComputeNumNodes(int numKeys)
+{
+    int numNodes = 1 << CeilLog2(numKeys);
+    if (Table_GetCapacity(numNodes) < numKeys)
     {
-        const TableNode* node = &table->nodes[i]; 
+        numNodes *= 2;
+    }
+    return numNodes;
+}
+
+/**
+ * Returns the hash for a key used to select the group to probe (the high bits)
+ * and the control byte (the low 7 bits). The hashes for numbers and pointers
+ * don't have much variation in their low bits, so they are mixed first.
+ */
+FORCE_INLINE static unsigned int Table_HashKey(const Value* key)
+{
+    unsigned int hash = Hash(key);
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    return hash;
+}
 
-        if (Value_GetIsNil(&node->key))
+/**
+ * Returns a mask with bit i set if control byte i in the group is equal to c.
+ */
+FORCE_INLINE static unsigned int Table_MatchGroup(const unsigned char* group, unsigned char c)
+{
+#ifdef TABLE_SSE2
+    __m128i control = _mm_loadu_si128( reinterpret_cast<const __m128i*>(group) );
+    __m128i match   = _mm_cmpeq_epi8( control, _mm_set1_epi8(static_cast<char>(c)) );
+    return static_cast<unsigned int>( _mm_movemask_epi8(match) );
+#else
+    unsigned int mask = 0;
+    for (int i = 0; i < TABLE_GROUP_SIZE; ++i)
+    {
+        if (group[i] == c)
         {
-            // If a node has a nil key it must be dead.
-            if (!node->dead)
-            {
-                ASSERT(0);
-                return false;
-            }
+            mask |= 1 << i;
         }
-        else
-        {
+    }
+    return mask;
+#endif
+}
 
-            // Check that all of the "next" pointers point to a valid element
-            if (node->next != NULL && !Table_GetIsValidNode(table, node->next))
-            {
-                ASSERT(0);
-                return false;
-            }
+/**
+ * Returns the index of the lowest set bit in a non-zero mask.
+ */
+FORCE_INLINE static int Table_GetFirstBit(unsigned int mask)
+{
+#ifdef __GNUC__
+    return __builtin_ctz(mask);
+#else
+    unsigned long index;
+    _BitScanForward(&index, mask);
+    return static_cast<int>(index);
+#endif
+}
+
+static TableNode* Table_AllocateNodes(lua_State* L, int numNodes)
+{
+    int numControlBytes = Table_GetNumControlBytes(numNodes);
+    size_t size = numNodes * sizeof(TableNode) + numControlBytes;
+    TableNode* nodes = static_cast<TableNode*>( Allocate(L, size) );
+    if (nodes == NULL)
+    {
+        return NULL;
+    }
+    unsigned char* control = Table_GetControl(nodes, numNodes);
+    memset(control, TABLE_CONTROL_EMPTY, numNodes);
+    memset(control + numNodes, TABLE_CONTROL_SENTINEL, numControlBytes - numNodes);
+    return nodes;
+}
+
+static void Table_FreeNodes(lua_State* L, TableNode* nodes, int numNodes)
+{
+    if (numNodes > 0)
+    {
+        Free(L, nodes, numNodes * sizeof(TableNode) + Table_GetNumControlBytes(numNodes));
+    }
+}
+
+/**
+ * Makes the empty nodes the hash part of the table.
+ */
+static void Table_SetNodes(Table* table, TableNode* nodes, int numNodes)
+{
+    table->numNodes     = numNodes;
+    table->numLiveNodes = 0;
+    table->numDeadNodes = 0;
+    table->numFreeNodes = Table_GetCapacity(numNodes);
+    table->nodes        = nodes;
+}
+
+/**
+ * Returns the node in the table that has the specified key, or NULL if the key
+ * does not appear in the table. If includeDead is true, deleted nodes which
+ * still hold the key are also returned (this is used by Table_Next).
+ */
+FORCE_INLINE static TableNode* Table_FindNode(TableNode* nodes, int numNodes, const Value* key, bool includeDead)
+{
+
+    if (numNodes == 0)
+    {
+        return NULL;
+    }
+
+    const unsigned char* control = Table_GetControl(nodes, numNodes);
+
+    unsigned int hash       = Table_HashKey(key);
+    unsigned char h2        = static_cast<unsigned char>(hash & 0x7F);
+    unsigned int groupMask  = Table_GetNumControlBytes(numNodes) / TABLE_GROUP_SIZE - 1;
+    unsigned int group      = (hash >> 7) & groupMask;
+
+    // Groups are probed quadratically, which visits every group once.
+    for (unsigned int probe = 1; probe <= groupMask + 1; ++probe)
+    {
+
+        const unsigned char* groupControl = control + group * TABLE_GROUP_SIZE;
 
-            // Check that the "next" pointer is correct.
-            if (node->next != NULL && node->next->dead)
+        unsigned int match = Table_MatchGroup(groupControl, h2);
+        while (match != 0)
+        {
+            TableNode* node = &nodes[group * TABLE_GROUP_SIZE + Table_GetFirstBit(match)];
+            if (KeysEqual(&node->key, key))
             {
-                if (!Table_GetIsValidNode(table, node->next->prev))
-                {
-                    ASSERT(0);
-                    return false;
-                }
-                if (node->next->prev != node)
-                {
-                    ASSERT(0);
-                    return false;
-                }
+                return node;
             }
+            match &= match - 1;
+        }
 
-            // Check that the "prev" pointer is correct for a dead node.
-            if (node->dead && node->prev != NULL)
+        if (includeDead)
+        {
+            match = Table_MatchGroup(groupControl, TABLE_CONTROL_DELETED);
+            while (match != 0)
             {
-                if (!Table_GetIsValidNode(table, node->prev))
-                {
-                    ASSERT(0);
-                    return false;
-                }
-                if (node->prev->next != node)
+                TableNode* node = &nodes[group * TABLE_GROUP_SIZE + Table_GetFirstBit(match)];
+                if (KeysIdentical(&node->key, key))
                 {
-                    ASSERT(0);
-                    return false;
+                    return node;
                 }
+                match &= match - 1;
             }
+        }
 
-            // Check the invariant that either this node is in its main index,
-            // or the element in its main index is in its *own* main index.
+        // An insert would have used the empty node, so the key isn't in any of
+        // the following groups.
+        if (Table_MatchGroup(groupControl, TABLE_CONTROL_EMPTY) != 0)
+        {
+            return NULL;
+        }
 
-            size_t mainIndex = Table_GetMainIndex(table, &node->key);
-            const TableNode* collidingNode = &table->nodes[i];
+        group = (group + probe) & groupMask;
 
-            if (collidingNode != node)
-            {
-                if (Table_GetMainIndex(table, &collidingNode->key) != mainIndex)
-                {
-                    ASSERT(0);
-                    return false;
-                }
+    }
 
-                // Check that our node is somewhere in the chain from the
-                // colliding node.
-                const TableNode* n = collidingNode->next;
-                while (n != NULL && n != node)
-                {
-                    n = n->next;
-                }
-                if (n != node)
-                {
-                    ASSERT(0);
-                    return false;
-                }
+    return NULL;
 
-            }
+}
 
-        }
+static TableNode* Table_GetNodeIncludeDead(Table* table, const Value* key)
+{
+    return Table_FindNode(table->nodes, table->numNodes, key, true);
+}
 
+/**
+ * Returns true if the node at index holds the key, including a deleted node
+ * which still holds the key.
+ */
+FORCE_INLINE static bool Table_GetNodeHasKey(const Table* table, int index, const Value* key)
+{
+    unsigned char c = Table_GetControl(table->nodes, table->numNodes)[index];
+    if (c == TABLE_CONTROL_DELETED)
+    {
+        return KeysIdentical(&table->nodes[index].key, key);
     }
+    return c != TABLE_CONTROL_EMPTY && KeysEqual(&table->nodes[index].key, key);
+}
 
-    return true;
+/**
+ * Returns the node in the nodes that has the specified key, or NULL if the key
+ * does not appear in the nodes.
+ */
+static TableNode* Table_GetNode(TableNode* nodes, int numNodes, const Value* key)
+{
+    return Table_FindNode(nodes, numNodes, key, false);
+}
+
+/**
+ * Returns the node in the table that has the specified key, or NULL if the key
+ * does not appear in the table.
+ */
+static TableNode* Table_GetNode(Table* table, const Value* key)
+{
+    return Table_FindNode(table->nodes, table->numNodes, key, false);
+}
 
+/**
+ * Marks a live node in the old hash part of a table as deleted. The key is
+ * left in the node like with Table_Remove.
+ */
+static void Table_KillOldNode(TableNode* nodes, int numNodes, TableNode* node)
+{
+    Table_GetControl(nodes, numNodes)[node - nodes] = TABLE_CONTROL_DELETED;
 }
 
-static bool Table_Resize(lua_State* L, Table* table, int numNodes)
+/**
+ * Checks various aspects of the table to make sure they are correct. Returns
+ * true if everything in the table structure appears valid. This function is 
+ * not fast and should only be used for debugging.
+ */
+static bool Table_CheckConsistency(const Table* table)
 {
 
-    if (table->numNodes == numNodes)
+    const unsigned char* control = Table_GetControl(table->nodes, table->numNodes);
+
+    int numLiveNodes  = 0;
+    int numUsedNodes  = 0;
+
+    for (int i = 0; i < table->numNodes; ++i)
     {
-        return true;
+        if (control[i] == TABLE_CONTROL_SENTINEL)
+        {
+            ASSERT(0);
+            return false;
+        }
+        if (control[i] != TABLE_CONTROL_EMPTY)
+        {
+            ++numUsedNodes;
+        }
+        if (Table_GetNodeIsLive(table->nodes, table->numNodes, i))
+        {
+            // Check that the key can be found from its hash.
+            TableNode* node = &table->nodes[i];
+            if (Table_GetNode(const_cast<Table*>(table), &node->key) != node)
+            {
+                ASSERT(0);
+                return false;
+            }
+            ++numLiveNodes;
+        }
     }
-    
-    size_t size = numNodes * sizeof(TableNode);
-    TableNode* nodes = static_cast<TableNode*>( Allocate(L, size) );
 
-    if (nodes == NULL)
+    // Check that the count of live nodes is correct.
+    if (numLiveNodes != table->numLiveNodes)
     {
+        ASSERT(0);
         return false;
     }
 
-    for (int i = 0; i < numNodes; ++i)
+    // Deleted nodes are not returned to the free count until the next rehash.
+    if (numUsedNodes + table->numFreeNodes != Table_GetCapacity(table->numNodes))
     {
-        SetNil(&nodes[i].key);
-        nodes[i].dead = true;
-        nodes[i].next = NULL;
-        nodes[i].prev = NULL;
+        ASSERT(0);
+        return false;
     }
-        
-    // Rehash all of the nodes.
 
-    Swap(table->numNodes, numNodes);
-    Swap(table->nodes, nodes);
+    return true;
 
-    for (int i = 0; i < numNodes; ++i)
+}
+
+static bool Table_Remove(Table* table, const Value* key)
+{
+
+    TableNode* node = Table_GetNode(table, key);
+
+    if (node == NULL)
     {
-        if ( !Table_NodeIsEmpty(&nodes[i]) )
-        {
-            Table_Insert(L, table, &nodes[i].key, &nodes[i].value);
-        }
+        return false;
     }
 
-    Free(L, nodes, numNodes * sizeof(TableNode));
-    
+    // The key is left in the node so that Table_Next can continue from it, and
+    // the node is marked as deleted rather than empty so that it doesn't end
+    // the probe sequence for other keys.
+    unsigned char* control = Table_GetControl(table->nodes, table->numNodes);
+    control[node - table->nodes] = TABLE_CONTROL_DELETED;
+    --table->numLiveNodes;
+    ++table->numDeadNodes;
+
 #ifdef TABLE_CHECK_CONSISTENCY
     ASSERT( Table_CheckConsistency(table) );
 #endif
@@ -260,114 +508,1000 @@ static bool Table_Resize(lua_State* L, Table* table, int numNodes)
 
 }
 
-static TableNode* Table_GetNodeIncludeDead(Table* table, const Value* key)
+/**
+ * Inserts a new key, value pair into the hash part of the table. Returns false
+ * if there are no free nodes in the hash part.
+ */
+static bool Table_InsertNode(lua_State* L, Table* table, Value* key, Value* value)
 {
 
     if (table->numNodes == 0)
     {
-        return NULL;
+        return false;
     }
-  
-    size_t index = Table_GetMainIndex(table, key);
-    TableNode* node = &table->nodes[index];
-  
-    while ( node != NULL && !KeysEqual(&node->key, key) )
+
+    unsigned char* control = Table_GetControl(table->nodes, table->numNodes);
+
+    unsigned int hash       = Table_HashKey(key);
+    unsigned int groupMask  = Table_GetNumControlBytes(table->numNodes) / TABLE_GROUP_SIZE - 1;
+    unsigned int group      = (hash >> 7) & groupMask;
+
+    for (unsigned int probe = 1; probe <= groupMask + 1; ++probe)
     {
-        node = node->next;
+
+        // Use the first empty or deleted node in the probe sequence.
+        const unsigned char* groupControl = control + group * TABLE_GROUP_SIZE;
+        unsigned int match = Table_MatchGroup(groupControl, TABLE_CONTROL_EMPTY) |
+                             Table_MatchGroup(groupControl, TABLE_CONTROL_DELETED);
+
+        if (match != 0)
+        {
+
+            int index = group * TABLE_GROUP_SIZE + Table_GetFirstBit(match);
+            if (control[index] == TABLE_CONTROL_EMPTY)
+            {
+                if (table->numFreeNodes == 0)
+                {
+                    return false;
+                }
+                --table->numFreeNodes;
+            }
+
+            Gc_WriteBarrier(L, table, key);
+            Gc_WriteBarrier(L, table, value);
+
+            TableNode* node = &table->nodes[index];
+            node->key   = *key;
+            node->value = *value;
+            control[index] = static_cast<unsigned char>(hash & 0x7F);
+            ++table->numLiveNodes;
+
+#ifdef TABLE_CHECK_CONSISTENCY
+            ASSERT( Table_CheckConsistency(table) );
+#endif
+
+            return true;
+
+        }
+
+        group = (group + probe) & groupMask;
+
+    }
+
+    return false;
+
+}
+
+#else
+
+FORCE_INLINE static size_t Table_GetMainIndex(const Table* table, const Value* key)
+{
+    return Hash(key) & (table->numNodes - 1);
+}
+
+FORCE_INLINE static bool Table_NodeIsDead(const TableNode* node)
+{
+    return node->key.tag == Tag_DeadKey;
+}
+
+FORCE_INLINE static bool Table_NodeIsEmpty(const TableNode* node)
+{
+    return Table_NodeIsDead(node);
+}
+
+/**
+ * Marks a live node as dead. The tag of the key is saved so that the key can
+ * still be recovered for iterating (see Table_GetNodeKey).
+ */
+FORCE_INLINE static void Table_KillNode(TableNode* node, int prev)
+{
+    node->deadTag  = node->key.tag;
+    node->key.tag  = Tag_DeadKey;
+    node->prev     = prev;
+}
+
+/**
+ * Returns the key stored in the node, which may be dead.
+ */
+FORCE_INLINE static Value Table_GetNodeKey(const TableNode* node)
+{
+    Value key = node->key;
+    if (Table_NodeIsDead(node))
+    {
+        key.tag = node->deadTag;
+    }
+    return key;
+}
+
+/**
+ * Converts between the indices stored in the next and prev fields of the nodes
+ * and pointers. TABLE_NO_NODE corresponds to NULL.
+ */
+FORCE_INLINE static TableNode* Table_GetNodeAt(const Table* table, int index)
+{
+    return index == TABLE_NO_NODE ? NULL : &table->nodes[index];
+}
+FORCE_INLINE static int Table_GetNodeIndex(const Table* table, const TableNode* node)
+{
+    return node == NULL ? TABLE_NO_NODE : static_cast<int>(node - table->nodes);
+}
+
+/**
+ * Returns the number of nodes needed to store numKeys keys in the hash part.
+ */
+static int Table_ComputeNumNodes(int numKeys)
+{
+    return 1 << CeilLog2(numKeys);
+}
+
+static TableNode* Table_AllocateNodes(lua_State* L, int numNodes)
+{
+    TableNode* nodes = static_cast<TableNode*>( Allocate(L, numNodes * sizeof(TableNode)) );
+    if (nodes == NULL)
+    {
+        return NULL;
+    }
+    for (int i = 0; i < numNodes; ++i)
+    {
+        SetNil(&nodes[i].key);
+        Table_KillNode(&nodes[i], TABLE_NO_NODE);
+        nodes[i].next = TABLE_NO_NODE;
+    }
+    return nodes;
+}
+
+static void Table_FreeNodes(lua_State* L, TableNode* nodes, int numNodes)
+{
+    Free(L, nodes, numNodes * sizeof(TableNode));
+}
+
+/**
+ * Makes the empty nodes the hash part of the table.
+ */
+static void Table_SetNodes(Table* table, TableNode* nodes, int numNodes)
+{
+    table->numNodes     = numNodes;
+    table->numLiveNodes = 0;
+    table->numDeadNodes = 0;
+    table->nodes        = nodes;
+    table->lastFree     = nodes + numNodes;
+}
+
+/**
+ * Returns true if the node index is valid for the table. This is used for
+ * debugging.
+ */
+static bool Table_GetIsValidNode(const Table* table, int index)
+{
+    return index >= 0 && index < table->numNodes;
+}
+
+/**
+ * Checks various aspects of the table to make sure they are correct. Returns
+ * true if everything in the table structure appears valid. This function is 
+ * not fast and should only be used for debugging.
+ */
+static bool Table_CheckConsistency(const Table* table)
+{
+
+    int numLiveNodes = 0;
+
+    for (int i = 0; i < table->numNodes; ++i)
+    {
+        const TableNode* node = &table->nodes[i]; 
+        const Value key = Table_GetNodeKey(node);
+
+        if (!Table_NodeIsDead(node))
+        {
+            ++numLiveNodes;
+        }
+
+        if (Value_GetIsNil(&key))
+        {
+            // If a node has a nil key it must be dead.
+            if (!Table_NodeIsDead(node))
+            {
+                ASSERT(0);
+                return false;
+            }
+        }
+        else
+        {
+
+            // Check that all of the "next" indices point to a valid element
+            if (node->next != TABLE_NO_NODE && !Table_GetIsValidNode(table, node->next))
+            {
+                ASSERT(0);
+                return false;
+            }
+
+            // Check that the "next" index is correct.
+            const TableNode* next = Table_GetNodeAt(table, node->next);
+            if (next != NULL && Table_NodeIsDead(next))
+            {
+                if (!Table_GetIsValidNode(table, next->prev))
+                {
+                    ASSERT(0);
+                    return false;
+                }
+                if (next->prev != i)
+                {
+                    ASSERT(0);
+                    return false;
+                }
+            }
+
+            // Check that the "prev" index is correct for a dead node.
+            if (Table_NodeIsDead(node) && node->prev != TABLE_NO_NODE)
+            {
+                if (!Table_GetIsValidNode(table, node->prev))
+                {
+                    ASSERT(0);
+                    return false;
+                }
+                if (table->nodes[node->prev].next != i)
+                {
+                    ASSERT(0);
+                    return false;
+                }
+            }
+
+            // Check the invariant that either this node is in its main index,
+            // or the element in its main index is in its *own* main index.
+
+            size_t mainIndex = Table_GetMainIndex(table, &key);
+            const TableNode* collidingNode = &table->nodes[i];
+
+            if (collidingNode != node)
+            {
+                const Value collidingKey = Table_GetNodeKey(collidingNode);
+                if (Table_GetMainIndex(table, &collidingKey) != mainIndex)
+                {
+                    ASSERT(0);
+                    return false;
+                }
+
+                // Check that our node is somewhere in the chain from the
+                // colliding node.
+                const TableNode* n = Table_GetNodeAt(table, collidingNode->next);
+                while (n != NULL && n != node)
+                {
+                    n = Table_GetNodeAt(table, n->next);
+                }
+                if (n != node)
+                {
+                    ASSERT(0);
+                    return false;
+                }
+
+            }
+
+        }
+
+    }
+
+    // Check that the count of live nodes is correct.
+    if (numLiveNodes != table->numLiveNodes)
+    {
+        ASSERT(0);
+        return false;
+    }
+
+    return true;
+
+}
+
+static TableNode* Table_GetNodeIncludeDead(Table* table, const Value* key)
+{
+
+    if (table->numNodes == 0)
+    {
+        return NULL;
+    }
+  
+    int index = static_cast<int>( Table_GetMainIndex(table, key) );
+
+    do
+    {
+        TableNode* node = &table->nodes[index];
+        if (KeysEqual(&node->key, key))
+        {
+            return node;
+        }
+        if (Table_NodeIsDead(node) && node->deadTag == key->tag && node->key.object == key->object)
+        {
+            return node;
+        }
+        index = node->next;
+    }
+    while (index != TABLE_NO_NODE);
+
+    return NULL;
+
+}
+
+/**
+ * Returns true if the node at index holds the key, including a dead node which
+ * still holds the key.
+ */
+FORCE_INLINE static bool Table_GetNodeHasKey(const Table* table, int index, const Value* key)
+{
+    const TableNode* node = &table->nodes[index];
+    if (Table_NodeIsDead(node))
+    {
+        return node->deadTag == key->tag && node->key.object == key->object;
+    }
+    return KeysEqual(&node->key, key);
+}
+
+/**
+ * Returns the node in the nodes that has the specified key, or NULL if the key
+ * does not appear in the nodes.
+ */
+static TableNode* Table_GetNode(TableNode* nodes, int numNodes, const Value* key)
+{
+
+    if (numNodes == 0)
+    {
+        return NULL;
+    }
+  
+    // Dead nodes don't need to be checked for separately since their tag will
+    // never match the tag of the key.
+    int index = static_cast<int>( Hash(key) & (numNodes - 1) );
+
+    do
+    {
+        TableNode* node = &nodes[index];
+        if (KeysEqual(&node->key, key))
+        {
+            return node;
+        }
+        index = node->next;
+    }
+    while (index != TABLE_NO_NODE);
+
+    return NULL;
+
+}
+
+/**
+ * Returns the node in the table that has the specified key, or NULL if the key
+ * does not appear in the table.
+ */
+static TableNode* Table_GetNode(Table* table, const Value* key)
+{
+    return Table_GetNode(table->nodes, table->numNodes, key);
+}
+
+/**
+ * Returns the node in the table that has the specified key, or NULL if the key
+ * does not appear in the table. The node before that node in the linked chain
+ * is stored in prevNode.
+ */
+static TableNode* Table_GetNode(Table* table, const Value* key, TableNode*& prevNode)
+{
+
+    if (table->numNodes == 0)
+    {
+        return NULL;
+    }
+  
+    size_t index = Table_GetMainIndex(table, key);
+    TableNode* node = &table->nodes[index];
+    TableNode* prev = NULL;
+
+    while ( node != NULL && !KeysEqual(&node->key, key) )
+    {
+        prev = node;
+        node = Table_GetNodeAt(table, node->next);
+    }
+
+    prevNode = prev;
+    return node;
+
+}
+
+static bool Table_Remove(Table* table, const Value* key)
+{
+
+    TableNode* prev = NULL;
+    TableNode* node = Table_GetNode(table, key, prev);
+
+    if (node == NULL)
+    {
+        return false;
+    }
+
+    Table_KillNode(node, Table_GetNodeIndex(table, prev));
+    --table->numLiveNodes;
+    ++table->numDeadNodes;
+
+#ifdef TABLE_CHECK_CONSISTENCY
+    ASSERT( Table_CheckConsistency(table) );
+#endif
+
+    return true;
+
+}
+
+/**
+ * Marks a live node in the old hash part of a table as dead. Nothing is
+ * inserted into the old hash part, so the prev link isn't needed. The node
+ * array is only needed by the open addressing engine (for its control bytes).
+ */
+static void Table_KillOldNode(TableNode* nodes, int numNodes, TableNode* node)
+{
+    (void)nodes;
+    (void)numNodes;
+    Table_KillNode(node, TABLE_NO_NODE);
+}
+
+/**
+ * Returns a dead node that can be used to store a new key, or NULL if there
+ * are no more free nodes. The search moves downward from the end of the node
+ * array and never revisits a node, so filling a table is O(n) overall. Nodes
+ * that die above the cursor are not reused until the next rehash compacts the
+ * table.
+ */
+static TableNode* Table_GetFreeNode(Table* table)
+{
+    while (table->lastFree > table->nodes)
+    {
+        --table->lastFree;
+        if ( Table_NodeIsEmpty(table->lastFree) )
+        {
+            return table->lastFree;
+        }
+    }
+    return NULL;
+}
+
+static TableNode* Table_UnlinkDeadNode(Table* table, TableNode* node)
+{
+    ASSERT( Table_NodeIsDead(node) );
+
+    if (node->prev != TABLE_NO_NODE)
+    {
+        // This node is in the middle of a list, so just unhook it from the
+        // previous and next nodes.
+        table->nodes[node->prev].next = node->next;
+        TableNode* next = Table_GetNodeAt(table, node->next);
+        if (next != NULL && Table_NodeIsDead(next))
+        {
+            next->prev = node->prev;
+        }
+    }
+    else
+    {
+        // This is the head of the list. We can't unlink it from the chain since
+        // nothing will point to the rest of the list, so move another node the
+        // head of the list.
+        TableNode* next = Table_GetNodeAt(table, node->next);
+        if (next != NULL)
+        {
+            *node = *next;
+            if (Table_NodeIsDead(node))
+            {
+                node->prev = TABLE_NO_NODE;
+            }
+            TableNode* nextNext = Table_GetNodeAt(table, node->next);
+            if (nextNext != NULL && Table_NodeIsDead(nextNext))
+            {
+                nextNext->prev = Table_GetNodeIndex(table, node);
+            }
+            node = next;
+        }
+    }
+
+    return node;
+}
+
+/**
+ * Inserts a new key, value pair into the hash part of the table. Returns false
+ * if there are no free nodes in the hash part.
+ */
+static bool Table_InsertNode(lua_State* L, Table* table, Value* key, Value* value)
+{
+
+    if (table->numNodes == 0)
+    {
+        return false;
+    }
+
+    Gc_WriteBarrier(L, table, key);
+    Gc_WriteBarrier(L, table, value);
+
+    size_t index = Table_GetMainIndex(table, key);
+    TableNode* node = &table->nodes[index];
+
+    if ( Table_NodeIsDead(node) )
+    {
+        // If this node is in another list, we need to remove it from that list
+        // since our new node shouldn't be part of that list.
+        if (node->prev != TABLE_NO_NODE)
+        {
+            table->nodes[node->prev].next = node->next;
+            TableNode* next = Table_GetNodeAt(table, node->next);
+            if (next != NULL && Table_NodeIsDead(next))
+            {
+                next->prev = node->prev;
+            }
+            node->next = TABLE_NO_NODE;
+        }
+        node->key   = *key;
+        node->value = *value;
+    }
+    else
+    {
+
+        // Need to insert a new node into the table.
+        TableNode* freeNode = Table_GetFreeNode(table);
+        if (freeNode == NULL)
+        {
+            return false;
+        }
+        freeNode = Table_UnlinkDeadNode(table, freeNode);
+
+        if (freeNode == node)
+        {
+            // The thing we were colliding with was moved in the unlinking
+            // process, so we can just insert our data into the free node.
+            freeNode->key   = *key;
+            freeNode->value = *value;
+            freeNode->next  = TABLE_NO_NODE;
+        }
+        else
+        {
+
+            int freeIndex = Table_GetNodeIndex(table, freeNode);
+
+            // Something else is in our primary slot, check if it's in its
+            // primary slot.
+            size_t collisionIndex = Table_GetMainIndex(table, &node->key);
+            if (index != collisionIndex)
+            {
+
+                // Update the previous node in the chain.
+                TableNode* prevNode = &table->nodes[collisionIndex];
+                while (prevNode->next != static_cast<int>(index))
+                {
+                    prevNode = &table->nodes[prevNode->next];
+                }
+                prevNode->next = freeIndex;
+
+                // The object in its current spot is not it's primary index,
+                // so we can freely move it somewhere else.
+                *freeNode = *node;
+                node->key   = *key;
+                node->value = *value;
+                node->next  = TABLE_NO_NODE;
+
+            }
+            else
+            {
+                // The current slot is the primary index, so add our new key into a
+                // the free slot and chain it to the other node.
+                freeNode->key   = *key;
+                freeNode->value = *value;
+                freeNode->next  = node->next;
+                node->next      = freeIndex;
+            }
+
+            TableNode* next = Table_GetNodeAt(table, freeNode->next);
+            if (next != NULL && Table_NodeIsDead(next))
+            {
+                next->prev = freeIndex;
+            }
+
+        }
+
+    }
+
+    ++table->numLiveNodes;
+
+#ifdef TABLE_CHECK_CONSISTENCY
+    ASSERT( Table_CheckConsistency(table) );
+#endif
+
+    return true;
+
+}
+
+#endif
+
+/**
+ * Changes the size of the array part of the table without rehashing any of
+ * the keys. When the array shrinks, the caller is responsible for moving the
+ * values in the discarded slots.
+ */
+static bool Table_ReallocateArray(lua_State* L, Table* table, int arraySize)
+{
+
+    size_t oldSize = table->arraySize * sizeof(Value);
+    size_t newSize = arraySize * sizeof(Value);
+
+    Value* array = static_cast<Value*>( Reallocate(L, table->array, oldSize, newSize) );
+    if (array == NULL && arraySize > 0)
+    {
+        return false;
+    }
+
+    for (int i = table->arraySize; i < arraySize; ++i)
+    {
+        SetNil(&array[i]);
+    }
+
+    table->array     = array;
+    table->arraySize = arraySize;
+    return true;
+
+}
+
+/**
+ * Moves the live keys in the nodes into the array or hash part of the table
+ * and frees the nodes.
+ */
+static void Table_ReinsertNodes(lua_State* L, Table* table, TableNode* nodes, int numNodes)
+{
+    for (int i = 0; i < numNodes; ++i)
+    {
+        if ( Table_GetNodeIsLive(nodes, numNodes, i) )
+        {
+            TableNode* node = &nodes[i];
+            int arrayIndex = Table_GetArrayIndex(table, &node->key);
+            if (arrayIndex != -1)
+            {
+                table->array[arrayIndex] = node->value;
+            }
+            else
+            {
+                Table_InsertNode(L, table, &node->key, &node->value);
+            }
+        }
+    }
+    Table_FreeNodes(L, nodes, numNodes);
+}
+
+/**
+ * Returns the number of live nodes in the nodes.
+ */
+static int Table_CountLiveNodes(TableNode* nodes, int numNodes)
+{
+    int count = 0;
+    for (int i = 0; i < numNodes; ++i)
+    {
+        if (Table_GetNodeIsLive(nodes, numNodes, i))
+        {
+            ++count;
+        }
+    }
+    return count;
+}
+
+/**
+ * Moves up to numSteps nodes from the old hash part of the table into the hash
+ * part. Once all of the nodes have been moved the old hash part is freed.
+ * Returns false if the hash part ran out of free nodes, in which case the
+ * remaining nodes are left in the old hash part.
+ */
+static bool Table_Migrate(lua_State* L, Table* table, int numSteps)
+{
+
+    TableNode* oldNodes    = table->oldNodes;
+    int        numOldNodes = table->numOldNodes;
+
+    int end = table->migrateIndex + numSteps;
+    if (end > numOldNodes)
+    {
+        end = numOldNodes;
+    }
+
+    for (; table->migrateIndex < end; ++table->migrateIndex)
+    {
+        int i = table->migrateIndex;
+        if (Table_GetNodeIsLive(oldNodes, numOldNodes, i))
+        {
+            // The array part doesn't change during the migration, so none of
+            // the keys can belong in the array part.
+            TableNode* node = &oldNodes[i];
+            if (!Table_InsertNode(L, table, &node->key, &node->value))
+            {
+                return false;
+            }
+            Table_KillOldNode(oldNodes, numOldNodes, node);
+        }
+    }
+
+    if (table->migrateIndex == numOldNodes)
+    {
+        Table_FreeNodes(L, oldNodes, numOldNodes);
+        table->numOldNodes  = 0;
+        table->oldNodes     = NULL;
+        table->migrateIndex = 0;
+    }
+
+    return true;
+
+}
+
+/**
+ * Returns the node in the table that has the specified key, including the keys
+ * in the old hash part that haven't been migrated yet.
+ */
+FORCE_INLINE static TableNode* Table_FindKey(Table* table, const Value* key)
+{
+    TableNode* node = Table_GetNode(table, key);
+    if (node == NULL && table->oldNodes != NULL)
+    {
+        node = Table_GetNode(table->oldNodes, table->numOldNodes, key);
+    }
+    return node;
+}
+
+/**
+ * Removes a key that hasn't been migrated yet from the old hash part. Returns
+ * false if the key isn't in the old hash part.
+ */
+static bool Table_RemoveOld(Table* table, const Value* key)
+{
+    if (table->oldNodes == NULL)
+    {
+        return false;
+    }
+    TableNode* node = Table_GetNode(table->oldNodes, table->numOldNodes, key);
+    if (node == NULL)
+    {
+        return false;
+    }
+    Table_KillOldNode(table->oldNodes, table->numOldNodes, node);
+    return true;
+}
+
+/**
+ * Resizes the array and the hash parts of the table and rehashes all of the
+ * live keys into their new locations. numNodes is rounded up to a power of 2
+ * (with enough room for the empty nodes the hash part needs). If the table is
+ * being migrated, the keys in the old hash part are rehashed as well.
+ */
+static bool Table_Resize(lua_State* L, Table* table, int arraySize, int numNodes)
+{
+
+    if (numNodes > 0)
+    {
+        numNodes = Table_ComputeNumNodes(numNodes);
+    }
+
+    int oldArraySize = table->arraySize;
+    if (arraySize > oldArraySize && !Table_ReallocateArray(L, table, arraySize))
+    {
+        return false;
+    }
+
+    TableNode* nodes = NULL;
+    if (numNodes > 0)
+    {
+        nodes = Table_AllocateNodes(L, numNodes);
+        if (nodes == NULL)
+        {
+            return false;
+        }
+    }
+
+    int        oldNumNodes = table->numNodes;
+    TableNode* oldNodes    = table->nodes;
+    Table_SetNodes(table, nodes, numNodes);
+
+    // Rehashing a large hash part all at once causes a long pause, so instead
+    // the old nodes are kept and the following inserts each move a few of
+    // them. This is only done when the array part isn't changing, since
+    // otherwise keys would have to move between the parts immediately.
+    if (arraySize == oldArraySize && table->oldNodes == NULL &&
+        numNodes > 0 && oldNumNodes >= TABLE_MIGRATE_MIN_NODES)
+    {
+        table->numOldNodes  = oldNumNodes;
+        table->oldNodes     = oldNodes;
+        table->migrateIndex = 0;
+        return true;
+    }
+
+    if (arraySize < oldArraySize)
+    {
+        // Move the elements that no longer fit in the array into the hash.
+        for (int i = arraySize; i < oldArraySize; ++i)
+        {
+            if (!Value_GetIsNil(&table->array[i]))
+            {
+                Value key;
+                SetValue(&key, i + 1);
+                Table_InsertNode(L, table, &key, &table->array[i]);
+            }
+        }
+        Table_ReallocateArray(L, table, arraySize);
+    }
+
+    Table_ReinsertNodes(L, table, oldNodes, oldNumNodes);
+
+    if (table->oldNodes != NULL)
+    {
+        Table_ReinsertNodes(L, table, table->oldNodes, table->numOldNodes);
+        table->numOldNodes  = 0;
+        table->oldNodes     = NULL;
+        table->migrateIndex = 0;
+    }
+    
+#ifdef TABLE_CHECK_CONSISTENCY
+    ASSERT( Table_CheckConsistency(table) );
+#endif
+
+    return true;
+
+}
+
+/**
+ * If the key is a positive integer that could be stored in the array part,
+ * the count for the slice of the array it would be stored in is incremented.
+ * Slice i holds the keys in the range (2^(i-1), 2^i]. Returns 1 if the count
+ * was updated.
+ */
+static int Table_CountArrayKey(const Value* key, int* nums)
+{
+    if (Value_GetIsNumber(key))
+    {
+        lua_Number n = key->number;
+        int k;
+        lua_number2int(k, n);
+        if (static_cast<lua_Number>(k) == n && k > 0 && k <= TABLE_MAX_ARRAY_SIZE)
+        {
+            ++nums[ CeilLog2(k) ];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Counts the non-nil values in the array part of the table, accumulating the
+ * counts for each slice into nums.
+ */
+static int Table_CountArray(const Table* table, int* nums)
+{
+    int total = 0;
+    int i = 1;      // Traverses all of the keys from 1 to arraySize.
+    for (int bit = 0, limit = 1; bit <= TABLE_MAX_ARRAY_BITS; ++bit, limit *= 2)
+    {
+        int count = 0;
+        if (limit > table->arraySize)
+        {
+            limit = table->arraySize;
+            if (i > limit)
+            {
+                break;
+            }
+        }
+        for (; i <= limit; ++i)
+        {
+            if (!Value_GetIsNil(&table->array[i - 1]))
+            {
+                ++count;
+            }
+        }
+        nums[bit] += count;
+        total += count;
     }
-
-    return node;
-
+    return total;
 }
 
 /**
- * Returns the node in the table that has the specified key, or NULL if the key
- * does not appear in the table.
+ * Computes the optimal size for the array part: the largest n such that more
+ * than half of the slots 1..n would be in use. On input numArray is the total
+ * number of integer keys, on output it's the number of keys that will go into
+ * the array. Returns the size of the array part.
  */
-static TableNode* Table_GetNode(Table* table, const Value* key)
+static int Table_ComputeArraySize(const int* nums, int& numArray)
 {
-
-    if (table->numNodes == 0)
-    {
-        return NULL;
-    }
-  
-    size_t index = Table_GetMainIndex(table, key);
-    TableNode* node = &table->nodes[index];
-
-    while ( node != NULL && (node->dead || !KeysEqual(&node->key, key)) )
+    int a  = 0;     // Number of elements smaller than 2^bit.
+    int na = 0;     // Number of elements to go to the array part.
+    int n  = 0;     // Optimal size for the array part.
+    for (int bit = 0, twoToBit = 1; twoToBit / 2 < numArray; ++bit, twoToBit *= 2)
     {
-        node = node->next;
+        if (nums[bit] > 0)
+        {
+            a += nums[bit];
+            if (a > twoToBit / 2)
+            {
+                n  = twoToBit;
+                na = a;
+            }
+        }
+        if (a == numArray)
+        {
+            break;
+        }
     }
-
-    return node;
-
+    numArray = na;
+    return n;
 }
 
 /**
- * Returns the node in the table that has the specified key, or NULL if the key
- * does not appear in the table. The node before that node in the linked chain
- * is stored in prevNode.
+ * Recomputes the sizes of the array and hash parts of the table so that there
+ * is room for one more key (which is passed in as key) and redistributes the
+ * existing keys.
  */
-static TableNode* Table_GetNode(Table* table, const Value* key, TableNode*& prevNode)
+static bool Table_Rehash(lua_State* L, Table* table, const Value* key)
 {
 
-    if (table->numNodes == 0)
+    int nums[TABLE_MAX_ARRAY_BITS + 1] = { 0 };
+
+    int numArray = Table_CountArray(table, nums);
+    int total    = numArray;
+
+    for (int i = 0; i < table->numNodes; ++i)
     {
-        return NULL;
+        if (Table_GetNodeIsLive(table->nodes, table->numNodes, i))
+        {
+            numArray += Table_CountArrayKey(&table->nodes[i].key, nums);
+            ++total;
+        }
     }
-  
-    size_t index = Table_GetMainIndex(table, key);
-    TableNode* node = &table->nodes[index];
-    TableNode* prev = NULL;
 
-    while ( node != NULL && (node->dead || !KeysEqual(&node->key, key)) )
+    for (int i = 0; i < table->numOldNodes; ++i)
     {
-        prev = node;
-        node = node->next;
+        if (Table_GetNodeIsLive(table->oldNodes, table->numOldNodes, i))
+        {
+            numArray += Table_CountArrayKey(&table->oldNodes[i].key, nums);
+            ++total;
+        }
     }
 
-    prevNode = prev;
-    return node;
+    // Include the key we're about to insert.
+    numArray += Table_CountArrayKey(key, nums);
+    ++total;
+
+    int arraySize = Table_ComputeArraySize(nums, numArray);
+    return Table_Resize(L, table, arraySize, total - numArray);
 
 }
 
-static bool Table_Remove(Table* table, const Value* key)
+void Table_ResizeArray(lua_State* L, Table* table, int arraySize)
 {
-
-    TableNode* prev = NULL;
-    TableNode* node = Table_GetNode(table, key, prev);
-
-    if (node == NULL)
+    if (arraySize > table->arraySize)
     {
-        return false;
+        // Keys that haven't been migrated yet are moved into the new hash part
+        // as well.
+        int numNodes = table->numNodes + Table_CountLiveNodes(table->oldNodes, table->numOldNodes);
+        if (!Table_Resize(L, table, arraySize, numNodes))
+        {
+            State_Error(L);
+        }
     }
-
-    node->dead = true;
-    node->prev = prev;
-
-#ifdef TABLE_CHECK_CONSISTENCY
-    ASSERT( Table_CheckConsistency(table) );
-#endif
-
-    return true;
-
 }
 
-static TableNode* Table_GetFreeNode(Table* table)
+/**
+ * Moves all of the remaining nodes from the old hash part of the table into
+ * the hash part.
+ */
+static void Table_FinishMigration(lua_State* L, Table* table)
 {
-    for (int i = 0; i < table->numNodes; ++i)
+    if (!Table_Migrate(L, table, table->numOldNodes))
     {
-        if ( Table_NodeIsEmpty(&table->nodes[i]) )
+        // The hash part filled up, so rehash both parts into a larger one.
+        int numNodes = table->numLiveNodes + Table_CountLiveNodes(table->oldNodes, table->numOldNodes);
+        if (!Table_Resize(L, table, table->arraySize, numNodes))
         {
-            return &table->nodes[i];
+            State_Error(L);
         }
     }
-    return NULL;
 }
 
 void Table_SetTable(lua_State* L, Table* table, int key, Value* value)
 {
+    if (static_cast<unsigned int>(key - 1) < static_cast<unsigned int>(table->arraySize))
+    {
+        table->array[key - 1] = *value;
+        Gc_WriteBarrier(L, table, value);
+        return;
+    }
     Value k;
     SetValue( &k, key );
     Table_SetTable(L, table, &k, value);
@@ -383,12 +1517,28 @@ void Table_SetTable(lua_State* L, Table* table, const char* key, Value* value)
 bool Table_Update(lua_State* L, Table* table, Value* key, Value* value)
 {
 
+    int index = Table_GetArrayIndex(table, key);
+    if (index != -1)
+    {
+        Value* slot = &table->array[index];
+        if (Value_GetIsNil(slot))
+        {
+            return false;
+        }
+        *slot = *value;
+        Gc_WriteBarrier(L, table, value);
+        return true;
+    }
+
+    // Any write to the hash part could add or remove a tag method.
+    table->tagMethodFlags = 0;
+
     if (Value_GetIsNil(value))
     {
-        return Table_Remove(table, key);
+        return Table_Remove(table, key) || Table_RemoveOld(table, key);
     }
 
-    TableNode* node = Table_GetNode(table, key);
+    TableNode* node = Table_FindKey(table, key);
     if (node == NULL)
     {
         return false;
@@ -400,159 +1550,47 @@ bool Table_Update(lua_State* L, Table* table, Value* key, Value* value)
 
 }
 
-static TableNode* Table_UnlinkDeadNode(Table* table, TableNode* node)
-{
-    ASSERT(node->dead);
-
-    if (node->prev != NULL)
-    {
-        // This node is in the middle of a list, so just unhook it from the
-        // previous and next nodes.
-        node->prev->next = node->next;
-        if (node->next != NULL && node->next->dead)
-        {
-            node->next->prev = node->prev;
-        }
-    }
-    else
-    {
-        // This is the head of the list. We can't unlink it from the chain since
-        // nothing will point to the rest of the list, so move another node the
-        // head of the list.
-        TableNode* next = node->next;
-        if (next != NULL)
-        {
-            *node = *next;
-            if (node->dead)
-            {
-                node->prev = NULL;
-            }
-            if (node->next != NULL && node->next->dead)
-            {
-                node->next->prev = node;
-            }
-            node = next;
-        }
-    }
-
-    return node;
-}
-
 void Table_Insert(lua_State* L, Table* table, Value* key, Value* value)
 {
 
     ASSERT( !Value_GetIsNil(value) );
 
-    if (table->numNodes == 0)
+    int arrayIndex = Table_GetArrayIndex(table, key);
+    if (arrayIndex != -1)
     {
-        Table_Resize(L, table, 2);
+        table->array[arrayIndex] = *value;
+        Gc_WriteBarrier(L, table, value);
+        return;
     }
 
-Start:
+    table->tagMethodFlags = 0;
 
-    Gc_WriteBarrier(L, table, key);
-    Gc_WriteBarrier(L, table, value);
-
-    size_t index = Table_GetMainIndex(table, key);
-    TableNode* node = &table->nodes[index];
-
-    if ( node->dead )
+    if (table->oldNodes != NULL)
     {
-        // If this node is in another list, we need to remove it from that list
-        // since our new node shouldn't be part of that list.
-        if (node->prev != NULL)
+        // While the table is being migrated, the hash part only holds some of
+        // the keys, so it's only rehashed when it's full.
+        if ( Table_Migrate(L, table, TABLE_MIGRATE_STEP) &&
+             Table_InsertNode(L, table, key, value) )
         {
-            node->prev->next = node->next;
-            if (node->next != NULL && node->next->dead)
-            {
-                node->next->prev = node->prev;
-            }
-            node->next = NULL;
+            return;
         }
-        node->dead  = false;
-        node->key   = *key;
-        node->value = *value;
     }
-    else
+    // If the table has mostly been emptied by removes, rehash so that it
+    // shrinks and the chains are compacted. Otherwise (including a presized
+    // table that is still being filled) only rehash when the hash part is full.
+    else if ( (table->numDeadNodes * 2 <= table->numNodes ||
+               (table->numLiveNodes + 1) * 4 > table->numNodes) &&
+              Table_InsertNode(L, table, key, value) )
     {
-
-        ASSERT(!node->dead);
-
-        // Need to insert a new node into the table.
-        TableNode* freeNode = Table_GetFreeNode(table);
-        if (freeNode == NULL)
-        {
-            // Table is full, so resize.
-            if (Table_Resize(L, table, table->numNodes * 2))
-            {
-                goto Start;
-            }
-        }
-        freeNode = Table_UnlinkDeadNode(table, freeNode);
-
-        if (freeNode == node)
-        {
-            // The thing we were colliding with was moved in the unlinking
-            // process, so we can just insert our data into the free node.
-            freeNode->key   = *key;
-            freeNode->value = *value;
-            freeNode->dead  = false;
-            freeNode->next  = NULL;
-        }
-        else
-        {
-
-            // Something else is in our primary slot, check if it's in its
-            // primary slot.
-            size_t collisionIndex = Table_GetMainIndex(table, &node->key);
-            if (index != collisionIndex)
-            {
-
-                // Update the previous node in the chain.
-                TableNode* prevNode = &table->nodes[collisionIndex];
-                while (prevNode->next != node)
-                {
-                    prevNode = prevNode->next;
-                }
-                prevNode->next = freeNode;
-
-                // The object in its current spot is not it's primary index,
-                // so we can freely move it somewhere else.
-                *freeNode = *node;
-                node->key   = *key;
-                node->value = *value;
-                node->next  = NULL;
-                node->dead  = false;
-
-                if (freeNode->next != NULL && freeNode->next->dead)
-                {
-                    freeNode->next->prev = freeNode;
-                }
-
-            }
-            else
-            {
-                // The current slot is the primary index, so add our new key into a
-                // the free slot and chain it to the other node.
-                freeNode->key   = *key;
-                freeNode->value = *value;
-                freeNode->dead  = false;
-                freeNode->next  = node->next;
-                node->next      = freeNode;
-
-                if (freeNode->next != NULL && freeNode->next->dead)
-                {
-                    freeNode->next->prev = freeNode;
-                }
-            }
-
-        }
-
+        return;
     }
 
-#ifdef TABLE_CHECK_CONSISTENCY
-    ASSERT( Table_CheckConsistency(table) );
-#endif
+    // Redistribute the keys between the array and hash parts and try again.
+    if (!Table_Rehash(L, table, key))
+    {
+        State_Error(L);
+    }
+    Table_Insert(L, table, key, value);
 
 }
 
@@ -573,31 +1611,99 @@ Value* Table_GetTable(lua_State* L, Table* table, String* key)
 
 Value* Table_GetTable(lua_State* L, Table* table, const Value* key)
 {
-    TableNode* node = Table_GetNode(table, key);
+    int index = Table_GetArrayIndex(table, key);
+    if (index != -1)
+    {
+        Value* value = &table->array[index];
+        return Value_GetIsNil(value) ? NULL : value;
+    }
+    // Lookups don't advance a migration, since migrating moves nodes and
+    // callers may be holding values from earlier lookups in the same table
+    // (e.g. two tag methods from one metatable).
+    TableNode* node = Table_FindKey(table, key);
     if (node == NULL)
     {
         return NULL;
     }
-    ASSERT( !Table_NodeIsEmpty(node) );
     return &node->value;
 }
 
 Value* Table_GetTable(lua_State* L, Table* table, int key)
 {
-    // TODO: Implement fast array access.
+    if (static_cast<unsigned int>(key - 1) < static_cast<unsigned int>(table->arraySize))
+    {
+        Value* value = &table->array[key - 1];
+        return Value_GetIsNil(value) ? NULL : value;
+    }
     Value value;
     SetValue( &value, key );
     return Table_GetTable(L, table, &value);
 }
 
-int Table_GetSize(lua_State* L, Table* table)
+Value* Table_GetTagMethod(lua_State* L, Table* table, TagMethod method)
 {
+    unsigned int flag = 1 << method;
+    if (table->tagMethodFlags & flag)
+    {
+        return NULL;
+    }
+    Value* value = Table_GetTable(L, table, L->tagMethodName[method]);
+    if (value == NULL)
+    {
+        table->tagMethodFlags |= flag;
+    }
+    return value;
+}
+
+/**
+ * Returns true if t[key] is non-nil.
+ */
+FORCE_INLINE static bool Table_HasIntegerKey(lua_State* L, Table* table, int key)
+{
+    if (static_cast<unsigned int>(key - 1) < static_cast<unsigned int>(table->arraySize))
+    {
+        return !Value_GetIsNil(&table->array[key - 1]);
+    }
+    return table->numNodes > 0 && Table_GetTable(L, table, key) != NULL;
+}
+
+/**
+ * Searches the table for a border (an n where t[n] is non-nil and t[n + 1]
+ * is nil) without using the cached border.
+ */
+static int Table_FindBorder(lua_State* L, Table* table)
+{
+
+    int arraySize = table->arraySize;
+    if (arraySize > 0 && Value_GetIsNil(&table->array[arraySize - 1]))
+    {
+        // There is a border in the array part, so binary search for it.
+        int min = 0;
+        int max = arraySize;
+        while (max - min > 1)
+        {
+            int mid = (min + max) / 2;
+            if (Value_GetIsNil(&table->array[mid - 1]))
+            {
+                max = mid;
+            }
+            else
+            {
+                min = mid;
+            }
+        }
+        return min;
+    }
+    else if (table->numNodes == 0)
+    {
+        return arraySize;
+    }
 
     // Find min, max such that min is non-nil and max is nil. These will
     // bracket our length.
     
-    int min = 0;
-    int max = 1;
+    int min = arraySize;
+    int max = arraySize + 1;
 
     while (1)
     {
@@ -634,23 +1740,88 @@ int Table_GetSize(lua_State* L, Table* table)
 
 }
 
-const Value* Table_Next(Table* table, Value* key)
+int Table_GetSize(lua_State* L, Table* table)
+{
+
+    // Check the border from the last call. Appending or removing an element
+    // at the end of the array only moves the border by one, so those cases
+    // are checked before falling back to a full search.
+
+    int border = table->border;
+
+    if (border == 0 || Table_HasIntegerKey(L, table, border))
+    {
+        if (!Table_HasIntegerKey(L, table, border + 1))
+        {
+            return border;
+        }
+        if (!Table_HasIntegerKey(L, table, border + 2))
+        {
+            table->border = border + 1;
+            return border + 1;
+        }
+    }
+    else if (border == 1 || Table_HasIntegerKey(L, table, border - 1))
+    {
+        table->border = border - 1;
+        return border - 1;
+    }
+
+    border = Table_FindBorder(L, table);
+    table->border = border;
+    return border;
+
+}
+
+const Value* Table_Next(lua_State* L, Table* table, Value* key)
 {
+
+    if (table->oldNodes != NULL)
+    {
+        // Traversing the table visits every node anyway, so finishing the
+        // migration doesn't add to the cost.
+        Table_FinishMigration(L, table);
+    }
     
+    // The array part is traversed first, followed by the hash part. The index
+    // spans both parts.
     int index = 0;
     if (!Value_GetIsNil(key))
     {
-        TableNode* node = Table_GetNodeIncludeDead(table, key);
-        if (node == NULL)
+        index = Table_GetArrayIndex(table, key);
+        if (index == -1)
         {
-            return NULL;
+            // When traversing the table, the key is the one we returned last
+            // time, so check that node before looking the key up.
+            int nodeIndex = table->nextNode;
+            if (nodeIndex >= table->numNodes || !Table_GetNodeHasKey(table, nodeIndex, key))
+            {
+                TableNode* node = Table_GetNodeIncludeDead(table, key);
+                if (node == NULL)
+                {
+                    return NULL;
+                }
+                nodeIndex = static_cast<int>(node - table->nodes);
+            }
+            index = table->arraySize + nodeIndex;
         }
         // Start from the next slot after the last key we encountered.
-        index = static_cast<int>(node - table->nodes) + 1;
+        ++index;
+    }
+
+    for (; index < table->arraySize; ++index)
+    {
+        if (!Value_GetIsNil(&table->array[index]))
+        {
+            SetValue(key, index + 1);
+            return &table->array[index];
+        }
     }
 
+    index -= table->arraySize;
+
     int numNodes = table->numNodes;
-    while (index < numNodes && table->nodes[index].dead)
+    while (index < numNodes && !Table_GetNodeIsLive(table->nodes, numNodes, index))
     {
         ++index;
     }
@@ -658,6 +1829,7 @@ const Value* Table_Next(Table* table, Value* key)
     if (index < numNodes)
     {
         TableNode* node = &table->nodes[index];
+        table->nextNode = index;
         *key = node->key;
         return &node->value;
     }
@@ -666,6 +1838,8 @@ const Value* Table_Next(Table* table, Value* key)
 
 }
 
+#ifndef TABLE_OPEN_ADDRESSING
+
 /**
  * Writes the table in the dot format that can be visualized by graphviz. This
  * is useful for debugging.
@@ -691,19 +1865,20 @@ static bool Table_WriteDot(const Table* table, const char* fileName)
     {
 
         const TableNode* node = &table->nodes[i];
+        const Value key = Table_GetNodeKey(node);
 
         char buffer[256];
-        int  type = Value_GetType(&node->key);
+        int  type = Value_GetType(&key);
 
         if (type == LUA_TLIGHTUSERDATA)
         {
-            sprintf(buffer, "%p", node->key.lightUserdata);
+            sprintf(buffer, "%p", key.lightUserdata);
         }
-        else if (Value_GetIsObject(&node->key))
+        else if (Value_GetIsObject(&key))
         {
-            sprintf(buffer, "%p", node->key.object);
+            sprintf(buffer, "%p", key.object);
         }
-        else if (Value_GetIsNil(&node->key))
+        else if (Value_GetIsNil(&key))
         {
             sprintf(buffer, "nil");
         }
@@ -712,7 +1887,7 @@ static bool Table_WriteDot(const Table* table, const char* fileName)
             sprintf(buffer, "???");
         }
 
-        if (node->dead)
+        if (Table_NodeIsDead(node))
         {
             fprintf(file, "<tr><td port=\"f%d\" bgcolor=\"#FF0000\">%s</td></tr>\n", i, buffer);
         }
@@ -734,7 +1909,7 @@ static bool Table_WriteDot(const Table* table, const char* fileName)
 
         const TableNode* node = &table->nodes[i];
 
-        if (node->next != NULL)
+        if (node->next != TABLE_NO_NODE)
         {
             const char* label = "";
             if (!nextLabeled)
@@ -743,11 +1918,11 @@ static bool Table_WriteDot(const Table* table, const char* fileName)
                 nextLabeled = true;
             }
 
-            int j = static_cast<int>(node->next - table->nodes);
+            int j = node->next;
             fprintf(file, "\"table\":f%d:w -> \"table\":f%d:w [colorscheme=set17, color=%d, label=\"%s\"];\n", i, j, i % 10, label);
         }
 
-        if (node->dead && node->prev != NULL)
+        if (Table_NodeIsDead(node) && node->prev != TABLE_NO_NODE)
         {
             const char* label = "";
             if (!prevLabeled)
@@ -755,7 +1930,7 @@ static bool Table_WriteDot(const Table* table, const char* fileName)
                 label = "prev";
                 prevLabeled = true;
             }
-            int j = static_cast<int>(node->prev - table->nodes);
+            int j = node->prev;
             fprintf(file, "\"table\":f%d:e -> \"table\":f%d:e [colorscheme=set17, color=%d, label=\"%s\"];\n", i, j, i % 10, label);
         }
 
@@ -766,4 +1941,6 @@ static bool Table_WriteDot(const Table* table, const char* fileName)
 
     return true;
 
-}
\ No newline at end of file
+}
+
+#endif
\ No newline at end of file
@@ -10,34 +10,151 @@
 #include "State.h"
 #include "Gc.h"
 
+// This define selects the open addressing engine for the hash part of tables
+// instead of the default chained scatter table.
+//#define TABLE_OPEN_ADDRESSING
+
+#ifdef TABLE_OPEN_ADDRESSING
+
+// Number of control bytes that are compared at once.
+#define TABLE_GROUP_SIZE        16
+
+// Special values for the control bytes. A live node has a control byte below
+// TABLE_CONTROL_EMPTY (the low 7 bits of the hash of its key).
+#define TABLE_CONTROL_EMPTY     0x80
+#define TABLE_CONTROL_DELETED   0xFE
+#define TABLE_CONTROL_SENTINEL  0xFF
+
+/**
+ * With the open addressing engine, the nodes are followed in the same
+ * allocation by one control byte per node. Lookups compare the control bytes
+ * for a group of nodes at once, so only the keys that are likely to match need
+ * to be loaded. To facilitate iterating over a table whilst removing elements,
+ * removed nodes are marked as deleted but keep their key.
+ */
+struct TableNode
+{
+    Value           key;
+    Value           value;
+};
+
+#else
+
 /**
  * To facilitate iterating over a table whilst removing elements, a nodes are
  * marked as dead. When a node is dead, the key should be treated as nil for
  * all purposes except iterating. If the node is marked as dead, then references
- * to the key should not prevent the key from being collected.
+ * to the key should not prevent the key from being collected. A node is marked
+ * as dead by replacing the tag of its key with Tag_DeadKey; the original tag is
+ * kept in deadTag. The next and prev links are indices into the node array.
  */
 struct TableNode
 {
-    bool            dead;
     Value           key;
-    TableNode*      next;
     union
     {
-        Value       value;  // Valid when the node is alive.
-        TableNode*  prev;   // Valid when the node is dead.
+        Value       value;      // Valid when the node is alive.
+        struct
+        {
+            int     prev;       // Valid when the node is dead.
+            Tag     deadTag;    // Valid when the node is dead.
+        };
     };
+    int             next;
 };
 
+#endif
+
+/**
+ * A table is split into two parts. Values with the integer keys 1..arraySize
+ * are stored contiguously in the array part (where an empty slot is nil) and
+ * all other keys are stored in the hash part. The split between the two parts
+ * is recomputed whenever the hash part fills up (see Table_Rehash). When a
+ * large hash part is resized, the previous nodes are kept in oldNodes and
+ * moved into the new hash part a few at a time (see Table_Migrate).
+ */
 struct Table : public Gc_Object
 {
     int             numNodes;
+    int             numLiveNodes;
+    int             numDeadNodes;   // Nodes emptied by removes since the last rehash.
     TableNode*      nodes;
+#ifdef TABLE_OPEN_ADDRESSING
+    int             numFreeNodes;   // Empty nodes that can be used before rehashing.
+#else
+    TableNode*      lastFree;   // Cursor for the free node search.
+#endif
+    int             numOldNodes;
+    TableNode*      oldNodes;       // Hash part being migrated, or NULL.
+    int             migrateIndex;   // Next node in oldNodes to migrate.
+    int             arraySize;
+    Value*          array;
+    int             border;     // Result of the last Table_GetSize (a hint).
+    int             nextNode;   // Node of the last key returned by Table_Next (a hint).
+    unsigned int    tagMethodFlags; // Bit set for each tag method known to be absent.
     Table*          metatable;
 };
 
 extern "C" Table* Table_Create(lua_State* L);
+
+/**
+ * Creates a table with space preallocated for arraySize elements in the array
+ * part and numNodes elements in the hash part.
+ */
+Table* Table_Create(lua_State* L, int arraySize, int numNodes);
 void   Table_Destroy(lua_State* L, Table* table);
 
+/**
+ * Grows the array part of the table so that it can hold at least the keys
+ * 1..arraySize. This is used when the size of the array is known in advance
+ * (i.e. when initializing a table from a constructor).
+ */
+void Table_ResizeArray(lua_State* L, Table* table, int arraySize);
+
+#ifdef TABLE_OPEN_ADDRESSING
+
+/**
+ * Returns the control bytes for the nodes in the hash part.
+ */
+static FORCE_INLINE unsigned char* Table_GetControl(TableNode* nodes, int numNodes)
+{
+    return reinterpret_cast<unsigned char*>(nodes + numNodes);
+}
+
+#endif
+
+/**
+ * Returns true if the node at index in the hash part holds a key, value pair.
+ */
+static FORCE_INLINE bool Table_GetNodeIsLive(TableNode* nodes, int numNodes, int index)
+{
+#ifdef TABLE_OPEN_ADDRESSING
+    return Table_GetControl(nodes, numNodes)[index] < TABLE_CONTROL_EMPTY;
+#else
+    (void)numNodes;
+    return nodes[index].key.tag != Tag_DeadKey;
+#endif
+}
+
+/**
+ * Returns the slot in the array part of the table for the key, or NULL if the
+ * key doesn't fall within the array part. Note that the slot may be nil.
+ */
+static FORCE_INLINE Value* Table_GetArraySlot(Table* table, const Value* key)
+{
+    if (Value_GetIsNumber(key))
+    {
+        lua_Number n = key->number;
+        int k;
+        lua_number2int(k, n);
+        if (static_cast<lua_Number>(k) == n && static_cast<unsigned int>(k - 1) < static_cast<unsigned int>(table->arraySize))
+        {
+            return &table->array[k - 1];
+        }
+    }
+    return NULL;
+}
+
 /**
  * Updates the value for the key in the table. If the key does not exist
  * in the table, the function has no effect and returns false. If the value
@@ -47,7 +164,10 @@ bool Table_Update(lua_State* L, Table* table, Value* key, Value* value);
 
 /**
  * Inserts a new key, value pair into the table. The key is assumed to not
- * exist in the table already.
+ * exist in the table already. If the hash part is full, or has mostly been
+ * emptied by removes, the table is rehashed first, which compacts out the
+ * dead nodes and may shrink the table. Since this never happens when a key is
+ * removed, removing keys while iterating over the table is safe.
  */
 void Table_Insert(lua_State* L, Table* table, Value* key, Value* value);
 
@@ -55,16 +175,36 @@ void Table_SetTable(lua_State* L, Table* table, int key, Value* value);
 void Table_SetTable(lua_State* L, Table* table, const char* key, Value* value);
 void Table_SetTable(lua_State* L, Table* table, Value* key, Value* value);
 
+/**
+ * Returns the value for the key, or NULL if the key isn't in the table.
+ * Lookups never move the nodes of the table, so the pointer remains valid
+ * until the next insert into the table.
+ */
 Value* Table_GetTable(lua_State* L, Table* table, const Value* key);
 Value* Table_GetTable(lua_State* L, Table* table, int key);
 Value* Table_GetTable(lua_State* L, Table* table, String* key);
 
 /**
- * For a hash table the size is t[n] is non-nil and t[n+1] is nil.
+ * Returns the tag method from the table (which is being used as a metatable),
+ * or NULL if the table doesn't have that tag method. The absence of a tag
+ * method is cached in the table until the next time the table is written to,
+ * so that looking up a missing tag method doesn't require hashing.
+ */
+Value* Table_GetTagMethod(lua_State* L, Table* table, TagMethod method);
+
+/**
+ * For a hash table the size is t[n] is non-nil and t[n+1] is nil. When the
+ * array part has a nil at its end, the border is found within the array part
+ * without touching the hash part. The last border that was found is cached in
+ * the table and revalidated on the next call, so the size of a table that is
+ * being appended to or popped from is computed in constant time.
  */
 int Table_GetSize(lua_State* L, Table* table);
 
-// The key will be updated to the next key.
-const Value* Table_Next(Table* table, Value* key);
+// The key will be updated to the next key. If the hash part is being
+// migrated, the migration is finished first so that the nodes don't move
+// during the traversal. The node of the returned key is remembered so that a
+// traversal doesn't need to look up each key again in the next call.
+const Value* Table_Next(lua_State* L, Table* table, Value* key);
 
 #endif
\ No newline at end of file
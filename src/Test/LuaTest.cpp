@@ -32,3 +32,8 @@ bool DoString(lua_State* L, const char* string)
     }
     return true;
 }
+
+size_t GetTotalBytes(lua_State* L)
+{
+    return lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
+}
@@ -27,4 +27,9 @@ struct LuaFixture
 
 bool DoString(lua_State* L, const char* string);
 
+/**
+ * Returns the number of bytes of memory in use by the state.
+ */
+size_t GetTotalBytes(lua_State* L);
+
 #endif
@@ -9,6 +9,8 @@
 #include "LuaTest.h"
 
 #include <memory.h>
+#include <ctype.h>
+#include <locale.h>
 
 TEST(StringUpper)
 {
@@ -76,4 +78,504 @@ TEST(StringLower)
     
     lua_close(L);
 
-}
\ No newline at end of file
+}
+
+TEST(StringBuffer)
+{
+
+    // Results which don't fit in the buffer on the C stack are built in a
+    // string buffer, which is freed if an error occurs while building.
+
+    lua_State* L = luaL_newstate();
+
+    luaopen_base(L);
+    luaopen_string(L);
+    luaopen_table(L);
+
+    const char* code =
+        "local s = string.rep('ab', 100000)\n"
+        "local t = {}\n"
+        "for i = 1, 10000 do t[i] = i end\n"
+        "local c = table.concat(t, ',')\n"
+        "local g = string.gsub(s, 'a', 'xyz')\n"
+        "local e = pcall(string.gsub, s, 'b', function() error('stop') end)\n"
+        "return #s, s:sub(199999), #c, c:sub(-10), #g, g:sub(1, 4), e\n";
+
+    CHECK( DoString(L, code) );
+    CHECK_EQ( lua_tonumber(L, -7), 200000 );
+    CHECK_EQ( lua_tostring(L, -6), "ab" );
+    CHECK_EQ( lua_tonumber(L, -5), 48893 );
+    CHECK_EQ( lua_tostring(L, -4), "9999,10000" );
+    CHECK_EQ( lua_tonumber(L, -3), 400000 );
+    CHECK_EQ( lua_tostring(L, -2), "xyzb" );
+    CHECK( !lua_toboolean(L, -1) );
+    lua_pop(L, 7);
+
+    // Results which fit in the buffer on the C stack.
+    CHECK( DoString(L, "return table.concat({ 'a', 'b' })") );
+    CHECK_EQ( lua_tostring(L, -1), "ab" );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "return string.rep('x', 0)") );
+    CHECK_EQ( lua_tostring(L, -1), "" );
+    lua_pop(L, 1);
+
+    lua_close(L);
+
+}
+
+TEST(StringPatternCache)
+{
+
+    // Patterns are compiled and cached the first time they're used. The
+    // results must be the same as matching the pattern text, including when
+    // entries are evicted from the cache and for malformed patterns.
+
+    lua_State* L = luaL_newstate();
+
+    luaopen_base(L);
+    luaopen_string(L);
+
+    // More patterns than fit in the cache, each used twice.
+    const char* code =
+        "matches = 0\n"
+        "for i = 1, 200 do\n"
+        "  local p = 'k' .. i .. '=(%d+)'\n"
+        "  for j = 1, 2 do\n"
+        "    if string.match('x k' .. i .. '=42 y', p) == '42' then matches = matches + 1 end\n"
+        "  end\n"
+        "end\n";
+    CHECK( DoString(L, code) );
+    lua_getglobal(L, "matches");
+    CHECK_EQ( lua_tonumber(L, -1), 400 );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "return select(2, string.gsub('abcabc', 'bc', 'X'))") );
+    CHECK_EQ( lua_tonumber(L, -1), 2 );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "return (string.gsub('hello world', '(o)', '[%1]'))") );
+    CHECK_EQ( lua_tostring(L, -1), "hell[o] w[o]rld" );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "return string.find('a.b', '.', 1, true)") );
+    CHECK_EQ( lua_tonumber(L, -2), 2 );
+    lua_pop(L, 2);
+
+    CHECK( DoString(L, "return string.find('ab', '^b')") );
+    CHECK( lua_isnil(L, -1) );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "return string.match('[[x]]', '%b[]')") );
+    CHECK_EQ( lua_tostring(L, -1), "[[x]]" );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "return string.find('THE (quick)', '%f[%a]%a+', 2)") );
+    CHECK_EQ( lua_tonumber(L, -2), 6 );
+    lua_pop(L, 2);
+
+    // gmatch with a leading `^' isn't anchored, and matches a literal `^'.
+    code =
+        "local n = 0\n"
+        "for k, v in string.gmatch('a=1, b=2', '(%w+)=(%w+)') do n = n + v end\n"
+        "for w in string.gmatch('x^y', '^y') do n = n + 10 end\n"
+        "return n\n";
+    CHECK( DoString(L, code) );
+    CHECK_EQ( lua_tonumber(L, -1), 13 );
+    lua_pop(L, 1);
+
+    // Malformed patterns raise an error only when they're reached.
+    CHECK( DoString(L, "return pcall(string.find, 'abc', 'b%')") );
+    CHECK( !lua_toboolean(L, -2) );
+    lua_pop(L, 2);
+
+    CHECK( DoString(L, "return string.find('abc', 'x%')") );
+    CHECK( lua_isnil(L, -1) );
+    lua_pop(L, 1);
+
+    lua_close(L);
+
+}
+
+TEST(StringPatternLocale)
+{
+
+    // Character classes in compiled patterns follow LC_CTYPE, so a cached
+    // pattern must classify characters with the locale set since it was
+    // compiled.
+
+    lua_State* L = luaL_newstate();
+
+    luaopen_base(L);
+    luaopen_string(L);
+    luaopen_os(L);
+
+    const char* match = "return string.match('\\233', '%a')";
+
+    CHECK( DoString(L, "return os.setlocale('C', 'ctype')") );
+    CHECK_EQ( lua_tostring(L, -1), "C" );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, match) );
+    CHECK( lua_isnil(L, -1) );
+    lua_pop(L, 1);
+
+    // In a Latin-1 locale \233 is a letter. If none is installed, only the
+    // switch back to "C" is checked.
+    const char* code =
+        "for _, l in ipairs({ 'en_US.ISO-8859-1', 'en_US.iso88591', 'de_DE.ISO-8859-1',\n"
+        "                     'de_DE.iso88591', 'fr_FR.ISO-8859-1', 'English_United States.1252' }) do\n"
+        "  if os.setlocale(l, 'ctype') then return l end\n"
+        "end\n"
+        "return nil\n";
+    CHECK( DoString(L, code) );
+    bool latin1 = !lua_isnil(L, -1);
+    lua_pop(L, 1);
+
+    if (latin1)
+    {
+        CHECK( DoString(L, match) );
+        CHECK( (lua_isnil(L, -1) != 0) == (isalpha(233) == 0) );
+        lua_pop(L, 1);
+    }
+
+    CHECK( DoString(L, "os.setlocale('C', 'ctype')") );
+
+    CHECK( DoString(L, match) );
+    CHECK( lua_isnil(L, -1) );
+    lua_pop(L, 1);
+
+    lua_close(L);
+
+}
+
+TEST(StringLongSearch)
+{
+
+    // Long strings are searched and converted 16 characters at a time, with
+    // the remaining characters handled one at a time.
+
+    lua_State* L = luaL_newstate();
+
+    luaopen_base(L);
+    luaopen_string(L);
+
+    CHECK( DoString(L, "s = string.rep('abcdefghij', 100) .. 'needle' .. string.rep('x', 7)") );
+
+    CHECK( DoString(L, "return string.find(s, 'needle', 1, true)") );
+    CHECK_EQ( lua_tonumber(L, -2), 1001 );
+    lua_pop(L, 2);
+
+    CHECK( DoString(L, "return string.find(s, 'needlf', 1, true)") );
+    CHECK( lua_isnil(L, -1) );
+    lua_pop(L, 1);
+
+    // Matches in the characters after the last whole block of 16.
+    CHECK( DoString(L, "return string.find(s, 'xx', 1, true)") );
+    CHECK_EQ( lua_tonumber(L, -2), 1007 );
+    lua_pop(L, 2);
+
+    CHECK( DoString(L, "return string.find(s, 'xxxxxxx', 1, true)") );
+    CHECK_EQ( lua_tonumber(L, -2), 1007 );
+    lua_pop(L, 2);
+
+    CHECK( DoString(L, "return string.find(s, 'ja', 1, true)") );
+    CHECK_EQ( lua_tonumber(L, -2), 10 );
+    lua_pop(L, 2);
+
+    // Characters next to the letters and outside ASCII are unchanged.
+    CHECK( DoString(L, "u = string.upper(s .. '\\200[`{@')") );
+    CHECK( DoString(L, "return u == string.rep('ABCDEFGHIJ', 100) .. 'NEEDLE' .. string.rep('X', 7) .. '\\200[`{@'") );
+    CHECK( lua_toboolean(L, -1) );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "return string.lower(u) == s .. '\\200[`{@'") );
+    CHECK( lua_toboolean(L, -1) );
+    lua_pop(L, 1);
+
+    lua_close(L);
+
+}
+
+TEST(StringFormat)
+{
+
+    // Formats are compiled and cached the first time they're used, so each
+    // format is used twice. Malformed formats are interpreted to raise the
+    // same errors.
+
+    lua_State* L = luaL_newstate();
+
+    luaopen_base(L);
+    luaopen_string(L);
+
+    for (int i = 0; i < 2; ++i)
+    {
+
+        CHECK( DoString(L, "return string.format('%s %d %.3f', 'x', -12.7, 0.5)") );
+        CHECK_EQ( lua_tostring(L, -1), "x -12 0.500" );
+        lua_pop(L, 1);
+
+        CHECK( DoString(L, "return string.format('%d%%%i', -2147483648, 0)") );
+        CHECK_EQ( lua_tostring(L, -1), "-2147483648%0" );
+        lua_pop(L, 1);
+
+        // Larger values only fit when LUA_INTFRM_T is 64 bits.
+        if (sizeof(LUA_INTFRM_T) > 4)
+        {
+            CHECK( DoString(L, "return string.format('%d', 2147483648)") );
+            CHECK_EQ( lua_tostring(L, -1), "2147483648" );
+            lua_pop(L, 1);
+        }
+
+        CHECK( DoString(L, "return string.format('[%5s|%-5d|%x]', 'ab', 7, 255)") );
+        CHECK_EQ( lua_tostring(L, -1), "[   ab|7    |ff]" );
+        lua_pop(L, 1);
+
+        CHECK( DoString(L, "return string.format('%s', 12)") );
+        CHECK_EQ( lua_tostring(L, -1), "12" );
+        lua_pop(L, 1);
+
+        CHECK( DoString(L, "return string.format('%q', 'a\\nb')") );
+        CHECK_EQ( lua_tostring(L, -1), "\"a\\\nb\"" );
+        lua_pop(L, 1);
+
+        // Strings of 100 characters or more are added whole, so they keep
+        // their embedded 0s; shorter ones stop at the first 0 like sprintf.
+        size_t length;
+        const char* s;
+
+        CHECK( DoString(L, "return string.format('%s', string.rep('a\\0', 60))") );
+        s = lua_tolstring(L, -1, &length);
+        CHECK( length == 120 );
+        CHECK( memcmp(s, "a\0a\0a\0", 6) == 0 );
+        lua_pop(L, 1);
+
+        CHECK( DoString(L, "return string.format('%s', 'a\\0b')") );
+        s = lua_tolstring(L, -1, &length);
+        CHECK( length == 1 );
+        CHECK_EQ( s, "a" );
+        lua_pop(L, 1);
+
+        CHECK( DoString(L, "return string.format('a\\0%%')") );
+        s = lua_tolstring(L, -1, &length);
+        CHECK( length == 3 );
+        CHECK( memcmp(s, "a\0%", 3) == 0 );
+        lua_pop(L, 1);
+
+        CHECK( DoString(L, "return pcall(string.format, '%d %y', 1)") );
+        CHECK( !lua_toboolean(L, -2) );
+        lua_pop(L, 2);
+
+        CHECK( DoString(L, "return pcall(string.format, '%d', 'x')") );
+        CHECK( !lua_toboolean(L, -2) );
+        lua_pop(L, 2);
+
+        CHECK( DoString(L, "return pcall(string.format, '%d %d', 1)") );
+        CHECK( !lua_toboolean(L, -2) );
+        lua_pop(L, 2);
+
+    }
+
+    lua_close(L);
+
+}
+
+TEST(StringPack)
+{
+
+    lua_State* L = luaL_newstate();
+
+    luaopen_base(L);
+    luaopen_string(L);
+
+    CHECK( DoString(L, "s = string.pack('<i4 >I2 b d s1 z', -2, 0x1234, -128, 1.5, 'hi', 'abc')") );
+    lua_getglobal(L, "s");
+    size_t length;
+    const char* s = lua_tolstring(L, -1, &length);
+    CHECK( length == 22 );
+    CHECK( memcmp(s, "\376\377\377\377\022\064\200\077\370\0\0\0\0\0\0\002hiabc\0", 22) == 0 );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "return string.unpack('<i4 >I2 b d s1 z', s)") );
+    CHECK_EQ( lua_tonumber(L, -7), -2 );
+    CHECK_EQ( lua_tonumber(L, -6), 0x1234 );
+    CHECK_EQ( lua_tonumber(L, -5), -128 );
+    CHECK_EQ( lua_tonumber(L, -4), 1.5 );
+    CHECK_EQ( lua_tostring(L, -3), "hi" );
+    CHECK_EQ( lua_tostring(L, -2), "abc" );
+    CHECK_EQ( lua_tonumber(L, -1), 23 );
+    lua_pop(L, 7);
+
+    // Unpacking from a position and with the other byte order.
+    CHECK( DoString(L, "return (string.unpack('<I2', s, 5))") );
+    CHECK_EQ( lua_tonumber(L, -1), 0x3412 );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "return (string.unpack('<I8', string.pack('<I8', 2^53)))") );
+    CHECK_EQ( lua_tonumber(L, -1), 9007199254740992.0 );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "return (string.unpack('>i16', string.pack('>i16', -5)))") );
+    CHECK_EQ( lua_tonumber(L, -1), -5 );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "return string.packsize('!4 b i4 Xi4 c3')") );
+    CHECK_EQ( lua_tonumber(L, -1), 11 );
+    lua_pop(L, 1);
+
+    // Values which don't fit and data which is too short are errors.
+    CHECK( DoString(L, "return pcall(string.pack, 'i2', 32768)") );
+    CHECK( !lua_toboolean(L, -2) );
+    lua_pop(L, 2);
+
+    CHECK( DoString(L, "return pcall(string.pack, 'i4', 1.5)") );
+    CHECK( !lua_toboolean(L, -2) );
+    lua_pop(L, 2);
+
+    CHECK( DoString(L, "return pcall(string.unpack, 'i4', 'abc')") );
+    CHECK( !lua_toboolean(L, -2) );
+    lua_pop(L, 2);
+
+    CHECK( DoString(L, "return pcall(string.unpack, 'z', 'abc')") );
+    CHECK( !lua_toboolean(L, -2) );
+    lua_pop(L, 2);
+
+    lua_close(L);
+
+}
+
+TEST(StringBufferObject)
+{
+
+    lua_State* L = luaL_newstate();
+
+    luaopen_base(L);
+    luaopen_string(L);
+
+    // Values are converted like tostring, and a buffer can add itself.
+    CHECK( DoString(L, "b = string.buffer() b:put('ab', 12, 0.5):put(b)") );
+
+    CHECK( DoString(L, "return tostring(b)") );
+    CHECK_EQ( lua_tostring(L, -1), "ab120.5ab120.5" );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "return b:len()") );
+    CHECK_EQ( lua_tonumber(L, -1), 14 );
+    lua_pop(L, 1);
+
+    // The string functions accept a buffer in place of a string.
+    CHECK( DoString(L, "return string.find(b, '0.5', 1, true)") );
+    CHECK_EQ( lua_tonumber(L, -2), 5 );
+    lua_pop(L, 2);
+
+    CHECK( DoString(L, "return string.match(b, '%d+')") );
+    CHECK_EQ( lua_tostring(L, -1), "120" );
+    lua_pop(L, 1);
+
+    // get removes what it returns from the front of the buffer.
+    CHECK( DoString(L, "return b:get(2)") );
+    CHECK_EQ( lua_tostring(L, -1), "ab" );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "return b:len()") );
+    CHECK_EQ( lua_tonumber(L, -1), 12 );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "return b:tostring()") );
+    CHECK_EQ( lua_tostring(L, -1), "120.5ab120.5" );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "b:reset():putf('%s=%d;', 'x', 3):put(string.pack('<i2', 258))") );
+
+    CHECK( DoString(L, "return b:get(4)") );
+    CHECK_EQ( lua_tostring(L, -1), "x=3;" );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "return (string.unpack('<i2', b))") );
+    CHECK_EQ( lua_tonumber(L, -1), 258 );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "return b:get()") );
+    size_t length;
+    const char* s = lua_tolstring(L, -1, &length);
+    CHECK( length == 2 );
+    CHECK( memcmp(s, "\2\1", 2) == 0 );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "return b:len()") );
+    CHECK_EQ( lua_tonumber(L, -1), 0 );
+    lua_pop(L, 1);
+
+    // Growing the buffer.
+    CHECK( DoString(L, "for i = 1, 1000 do b:put('abcdefghij') end") );
+
+    CHECK( DoString(L, "return b:len()") );
+    CHECK_EQ( lua_tonumber(L, -1), 10000 );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "return string.find(b, 'ja', 1, true)") );
+    CHECK_EQ( lua_tonumber(L, -2), 10 );
+    lua_pop(L, 2);
+
+    CHECK( DoString(L, "return pcall(b.put, b, {})") );
+    CHECK( !lua_toboolean(L, -2) );
+    lua_pop(L, 2);
+
+    lua_close(L);
+
+}
+
+TEST(StringFormatMissingValue)
+{
+
+    // A missing value must be reported as missing when the format is
+    // compiled, both the first time it's used and once it's cached.
+
+    lua_State* L = luaL_newstate();
+
+    luaopen_base(L);
+    luaopen_string(L);
+
+    lua_getglobal(L, "string");
+    lua_getfield(L, -1, "format");
+    int format = lua_gettop(L);
+
+    for (int i = 0; i < 2; ++i)
+    {
+
+        lua_pushvalue(L, format);
+        lua_pushstring(L, "%d %d");
+        lua_pushinteger(L, 1);
+        CHECK( lua_pcall(L, 2, 1, 0) != 0 );
+        CHECK_EQ( lua_tostring(L, -1), "bad argument #3 to '?' (number expected, got no value)" );
+        lua_pop(L, 1);
+
+        lua_pushvalue(L, format);
+        lua_pushstring(L, "%s");
+        CHECK( lua_pcall(L, 1, 1, 0) != 0 );
+        CHECK_EQ( lua_tostring(L, -1), "bad argument #2 to '?' (string expected, got no value)" );
+        lua_pop(L, 1);
+
+        lua_pushvalue(L, format);
+        lua_pushstring(L, "%q");
+        CHECK( lua_pcall(L, 1, 1, 0) != 0 );
+        CHECK_EQ( lua_tostring(L, -1), "bad argument #2 to '?' (string expected, got no value)" );
+        lua_pop(L, 1);
+
+    }
+
+    // The buffer is the first argument of putf.
+    lua_getfield(L, format - 1, "buffer");
+    CHECK( lua_pcall(L, 0, 1, 0) == 0 );
+    int buffer = lua_gettop(L);
+    lua_getfield(L, buffer, "putf");
+    lua_pushvalue(L, buffer);
+    lua_pushstring(L, "%d %d");
+    lua_pushinteger(L, 1);
+    CHECK( lua_pcall(L, 3, 1, 0) != 0 );
+    CHECK_EQ( lua_tostring(L, -1), "bad argument #4 to '?' (number expected, got no value)" );
+
+    lua_close(L);
+
+}
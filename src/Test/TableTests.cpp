@@ -8,6 +8,8 @@
 #include "Test.h"
 #include "LuaTest.h"
 
+#include <stdio.h>
+
 TEST_FIXTURE(ArrayRemove, LuaFixture)
 {
 
@@ -101,6 +103,49 @@ TEST_FIXTURE(LocalTable, LuaFixture)
 
 }
 
+TEST_FIXTURE(ArrayAndHashParts, LuaFixture)
+{
+
+    // Mix sequential integer keys (which are stored in the array part) with
+    // other keys and check that all of them can be found and iterated.
+    const char* code =
+        "t = {}\n"
+        "for i = 1, 1000 do t[i] = i end\n"
+        "t.x = 'x'\n"
+        "t[2000] = 2000\n"
+        "t[1.5] = 1.5\n";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "t");
+    int table = lua_gettop(L);
+
+    CHECK( lua_objlen(L, table) == 1000 );
+
+    lua_rawgeti(L, table, 1000);
+    CHECK( lua_tonumber(L, -1) == 1000 );
+    lua_pop(L, 1);
+
+    lua_rawgeti(L, table, 2000);
+    CHECK( lua_tonumber(L, -1) == 2000 );
+    lua_pop(L, 1);
+
+    int count = 0;
+    lua_pushnil(L);
+    while (lua_next(L, table))
+    {
+        ++count;
+        lua_pop(L, 1);
+    }
+    CHECK( count == 1003 );
+
+    // Removing from the end of the array should update the length.
+    lua_pushnil(L);
+    lua_rawseti(L, table, 1000);
+    CHECK( lua_objlen(L, table) == 999 );
+
+}
+
 /*
 TEST_FIXTURE(WeakKeys, LuaFixture)
 {
@@ -125,4 +170,314 @@ TEST_FIXTURE(WeakKeys, LuaFixture)
     CHECK( lua_next(L, table) == 0 );
 
 }
-*/
\ No newline at end of file
+*/
+
+TEST_FIXTURE(TableSizeHints, LuaFixture)
+{
+
+    // The hints must allocate the array and hash parts up front: the table
+    // should take at least a value per array slot and a key and value per
+    // node, and filling it to the hinted size must not reallocate anything.
+    // (Number keys and values don't allocate, so the memory only changes if
+    // the parts of the table do.)
+    size_t bytes = GetTotalBytes(L);
+    lua_createtable(L, 0, 0);
+    size_t emptySize = GetTotalBytes(L) - bytes;
+    lua_pop(L, 1);
+
+    bytes = GetTotalBytes(L);
+    lua_createtable(L, 100, 10);
+    int table = lua_gettop(L);
+    size_t size = GetTotalBytes(L) - bytes;
+    CHECK( size >= emptySize + 100 * sizeof(lua_Number) + 10 * 2 * sizeof(lua_Number) );
+
+    bytes = GetTotalBytes(L);
+    CHECK( lua_objlen(L, table) == 0 );
+    for (int i = 1; i <= 100; ++i)
+    {
+        lua_pushinteger(L, i);
+        lua_rawseti(L, table, i);
+    }
+    CHECK( GetTotalBytes(L) == bytes );
+    for (int i = 0; i < 10; ++i)
+    {
+        lua_pushnumber(L, i + 0.5);
+        lua_pushinteger(L, i);
+        lua_rawset(L, table);
+    }
+    CHECK( GetTotalBytes(L) == bytes );
+
+    // Tables created with size hints should behave like any other table when
+    // they grow past them.
+    for (int i = 101; i <= 150; ++i)
+    {
+        lua_pushinteger(L, i);
+        lua_rawseti(L, table, i);
+    }
+    lua_pushstring(L, "value");
+    lua_setfield(L, table, "key");
+
+    CHECK( lua_objlen(L, table) == 150 );
+    lua_rawgeti(L, table, 150);
+    CHECK( lua_tointeger(L, -1) == 150 );
+    lua_pop(L, 1);
+
+    luaopen_table(L);
+    const char* code =
+        "local t = table.new(1000, 4)\n"
+        "local count = collectgarbage('count')\n"
+        "for i = 1, 1000 do t[i] = i end\n"
+        "for i = 1, 4 do t[i + 0.5] = i end\n"
+        "unchanged = collectgarbage('count') == count\n"
+        "t.x = 1\n"
+        "n = #t\n"
+        "c = { 1, 2, 3, x = 1, y = 2 }\n";
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "unchanged");
+    CHECK( lua_toboolean(L, -1) );
+
+    lua_getglobal(L, "n");
+    CHECK( lua_tointeger(L, -1) == 1000 );
+
+    lua_getglobal(L, "c");
+    CHECK( lua_objlen(L, -1) == 3 );
+
+}
+
+TEST_FIXTURE(TablePresizedInsert, LuaFixture)
+{
+
+    // Filling a presized hash part must not rehash it, and neither should a
+    // few removes. Number keys and values don't allocate anything, so the
+    // memory in use only changes if the nodes are reallocated.
+    const int n = 1000;
+    lua_createtable(L, 0, n);
+    int table = lua_gettop(L);
+
+    size_t bytes = GetTotalBytes(L);
+
+    lua_pushnumber(L, 0.5);
+    lua_pushinteger(L, 0);
+    lua_rawset(L, table);
+    CHECK( GetTotalBytes(L) == bytes );
+
+    for (int i = 1; i < n; ++i)
+    {
+        lua_pushnumber(L, i + 0.5);
+        lua_pushinteger(L, i);
+        lua_rawset(L, table);
+    }
+    CHECK( GetTotalBytes(L) == bytes );
+
+    for (int i = 0; i < n / 10; ++i)
+    {
+        lua_pushnumber(L, i + 0.5);
+        lua_pushnil(L);
+        lua_rawset(L, table);
+    }
+    for (int i = 0; i < n / 10; ++i)
+    {
+        lua_pushnumber(L, i + 0.5);
+        lua_pushinteger(L, i);
+        lua_rawset(L, table);
+    }
+    CHECK( GetTotalBytes(L) == bytes );
+
+    lua_pushnumber(L, 999.5);
+    lua_rawget(L, table);
+    CHECK( lua_tointeger(L, -1) == 999 );
+
+}
+
+TEST_FIXTURE(TableLengthBorder, LuaFixture)
+{
+
+    // The length is cached between calls, so make sure it's still a valid
+    // border after the table is changed in various ways.
+    const char* code =
+        "function border(t)\n"
+        "  local n = #t\n"
+        "  return (n == 0 or t[n] ~= nil) and t[n + 1] == nil\n"
+        "end\n"
+        "t = {}\n";
+    CHECK( DoString(L, code) );
+
+    CHECK( DoString(L, "for i = 1, 100 do t[#t + 1] = i end return #t") );
+    CHECK_EQ( lua_tonumber(L, -1), 100 );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "for i = 1, 10 do t[#t] = nil end return #t") );
+    CHECK_EQ( lua_tonumber(L, -1), 90 );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "t[50] = nil return border(t)") );
+    CHECK( lua_toboolean(L, -1) );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "for i = 1, 90 do t[i] = nil end return #t") );
+    CHECK_EQ( lua_tonumber(L, -1), 0 );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "t[1] = 1 t[2] = 2 t[3] = 3 return #t") );
+    CHECK_EQ( lua_tonumber(L, -1), 3 );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "for i = 4, 200 do t[i] = i end t[100] = nil return border(t)") );
+    CHECK( lua_toboolean(L, -1) );
+    lua_pop(L, 1);
+
+}
+
+TEST_FIXTURE(TableChurn, LuaFixture)
+{
+
+    // Remove most of the keys while iterating, then insert new keys so that
+    // the table is rehashed into a smaller size.
+    const char* code =
+        "t = {}\n"
+        "for i = 1, 1000 do t['k' .. i] = i end\n"
+        "local n = 0\n"
+        "for k, v in pairs(t) do\n"
+        "  n = n + 1\n"
+        "  if v > 10 then t[k] = nil end\n"
+        "end\n"
+        "return n\n";
+    CHECK( DoString(L, code) );
+    CHECK_EQ( lua_tonumber(L, -1), 1000 );
+    lua_pop(L, 1);
+
+    code =
+        "for i = 1, 10000 do\n"
+        "  t['q' .. i] = i\n"
+        "  t['q' .. i] = nil\n"
+        "end\n";
+    CHECK( DoString(L, code) );
+
+    // Only k1 to k10 are left.
+    lua_getglobal(L, "t");
+    int table = lua_gettop(L);
+    int count = 0;
+    lua_pushnil(L);
+    while (lua_next(L, table))
+    {
+        char key[16];
+        sprintf(key, "k%d", (int)lua_tointeger(L, -1));
+        CHECK_EQ( lua_tostring(L, -2), key );
+        lua_pop(L, 1);
+        ++count;
+    }
+    CHECK_EQ( count, 10 );
+
+}
+
+TEST_FIXTURE(TableIncrementalRehash, LuaFixture)
+{
+
+    // Grow the hash part just past the size where it's migrated incrementally,
+    // so that the table is still being migrated while it's collected, accessed
+    // and traversed.
+    const int n = 65536 + 100;
+    const int removed = (n + 6) / 7;
+
+    char code[512];
+    sprintf(code,
+        "function fill()\n"
+        "  local t = {}\n"
+        "  for i = 1, %d do t['k' .. i] = i end\n"
+        "  return t\n"
+        "end\n"
+        "t = fill()\n"
+        "collectgarbage()\n"
+        "local found = 0\n"
+        "for i = 1, %d, 7 do\n"
+        "  if t['k' .. i] == i then found = found + 1 end\n"
+        "  t['k' .. i] = nil\n"
+        "end\n"
+        "return found\n", n, n);
+    CHECK( DoString(L, code) );
+    CHECK_EQ( lua_tonumber(L, -1), removed );
+    lua_pop(L, 1);
+
+    for (int pass = 0; pass < 2; ++pass)
+    {
+
+        // The second pass traverses a new table which is being migrated.
+        if (pass == 1)
+        {
+            CHECK( DoString(L, "t = fill()") );
+        }
+
+        lua_getglobal(L, "t");
+        int table = lua_gettop(L);
+        int count = 0;
+        lua_pushnil(L);
+        while (lua_next(L, table))
+        {
+            int value = (int)lua_tointeger(L, -1);
+            if (pass == 0)
+            {
+                CHECK( value % 7 != 1 );
+            }
+            lua_pushvalue(L, -2);
+            lua_rawget(L, table);
+            CHECK_EQ( lua_tonumber(L, -1), value );
+            lua_pop(L, 2);
+            ++count;
+        }
+        CHECK_EQ( count, pass == 0 ? n - removed : n );
+        lua_pop(L, 1);
+
+    }
+
+}
+
+TEST_FIXTURE(TableMigrationLookups, LuaFixture)
+{
+
+    // Comparisons look up a tag method in each operand's metatable and hold
+    // the first while looking up the second. The lookups must not move the
+    // nodes of a metatable that is being migrated.
+    const char* code =
+        "local mt = {}\n"
+        "mt.__lt = function(a, b) return a.v < b.v end\n"
+        "for i = 1, 65536 + 100 do mt['k' .. i] = i end\n"
+        "local a = setmetatable({ v = 1 }, mt)\n"
+        "local b = setmetatable({ v = 2 }, mt)\n"
+        "lt = 0\n"
+        "for i = 1, 2000 do\n"
+        "  if a < b and not (b < a) then lt = lt + 1 end\n"
+        "end\n";
+
+    CHECK( DoString(L, code) );
+    lua_getglobal(L, "lt");
+    CHECK( lua_tointeger(L, -1) == 2000 );
+
+}
+
+TEST_FIXTURE(TableNestedTraversal, LuaFixture)
+{
+
+    // Two traversals of the same table interleave their calls to next, so the
+    // node remembered from the previous call is usually for the other one.
+    const char* code =
+        "local t = {}\n"
+        "for i = 1, 100 do t['k' .. i] = i end\n"
+        "local outer = 0\n"
+        "local inner = 0\n"
+        "for k1, v1 in pairs(t) do\n"
+        "  outer = outer + v1\n"
+        "  for k2, v2 in pairs(t) do\n"
+        "    inner = inner + 1\n"
+        "  end\n"
+        "end\n"
+        "local k, v = next(t)\n"
+        "local k2 = next(t, k)\n"
+        "return outer, inner, next(t, k) == k2\n";
+
+    CHECK( DoString(L, code) );
+    CHECK_EQ( lua_tonumber(L, -3), 5050 );
+    CHECK_EQ( lua_tonumber(L, -2), 10000 );
+    CHECK( lua_toboolean(L, -1) );
+
+}
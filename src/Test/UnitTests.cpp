@@ -12,11 +12,6 @@
 #include <stdlib.h>
 #include <stdio.h>
 
-static size_t GetTotalBytes(lua_State* L)
-{
-    return lua_gc(L, LUA_GCCOUNT, 0) * 1024 + lua_gc(L, LUA_GCCOUNTB, 0);
-}
-
 TEST(GcTest)
 {
     
@@ -43,6 +38,97 @@ TEST(GcTest)
 
 }
 
+TEST_FIXTURE(GcScratchBuffer, LuaFixture)
+{
+
+    // The buffer used to concatenate a long string is freed by the next
+    // collection instead of being kept for the life of the state.
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    size_t bytes = GetTotalBytes(L);
+
+    const char* code =
+        "local s = 'x'\n"
+        "for i = 1, 20 do s = s .. s end\n"
+        "s = s .. s .. s\n";
+    CHECK( DoString(L, code) );
+
+    lua_gc(L, LUA_GCCOLLECT, 0);
+    CHECK( GetTotalBytes(L) < bytes + 64 * 1024 );
+
+}
+
+TEST_FIXTURE(GcGenerational, LuaFixture)
+{
+
+    CHECK( lua_gc(L, LUA_GCGEN, 0) == LUA_GCINC );
+    CHECK( lua_gc(L, LUA_GCGEN, 0) == LUA_GCGEN );
+
+    // Old tables and closed up values that are given young values must keep
+    // them alive through minor collections (collectgarbage('step') runs one).
+    const char* code =
+        "old = {}\n"
+        "for i = 1, 1000 do old[i] = { id = i } end\n"
+        "value = {}\n"
+        "local function set(v) value = v end\n"
+        "collectgarbage()\n"
+        "for i = 1, 1000 do\n"
+        "  old[i].young = { 'v' .. i }\n"
+        "  set({ i })\n"
+        "  local garbage = { 'garbage' .. i }\n"
+        "  if i % 100 == 0 then collectgarbage('step') end\n"
+        "end\n"
+        "collectgarbage('step')\n";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "value");
+    lua_rawgeti(L, -1, 1);
+    CHECK_EQ( lua_tonumber(L, -1), 1000 );
+    lua_pop(L, 2);
+
+    char young[16];
+
+    lua_getglobal(L, "old");
+    int old = lua_gettop(L);
+    for (int i = 1; i <= 1000; ++i)
+    {
+        lua_rawgeti(L, old, i);
+        lua_getfield(L, -1, "id");
+        CHECK_EQ( lua_tonumber(L, -1), i );
+        lua_getfield(L, -2, "young");
+        lua_rawgeti(L, -1, 1);
+        sprintf(young, "v%d", i);
+        CHECK_EQ( lua_tostring(L, -1), young );
+        lua_pop(L, 4);
+    }
+
+    // The young values survive switching back to incremental mode and a
+    // full collection.
+    CHECK( DoString(L, "mode = collectgarbage('incremental') collectgarbage()") );
+    lua_getglobal(L, "mode");
+    CHECK_EQ( lua_tostring(L, -1), "generational" );
+    lua_pop(L, 1);
+
+    for (int i = 1; i <= 1000; ++i)
+    {
+        lua_rawgeti(L, old, i);
+        lua_getfield(L, -1, "young");
+        lua_rawgeti(L, -1, 1);
+        sprintf(young, "v%d", i);
+        CHECK_EQ( lua_tostring(L, -1), young );
+        lua_pop(L, 3);
+    }
+    lua_settop(L, 0);
+
+    // The garbage created between minor collections is freed.
+    lua_gc(L, LUA_GCGEN, 0);
+    size_t bytes1 = GetTotalBytes(L);
+    CHECK( DoString(L, "for i = 1, 10000 do local t = { i } end") );
+    lua_gc(L, LUA_GCSTEP, 0);
+    CHECK( GetTotalBytes(L) < bytes1 + 64 * 1024 );
+
+}
+
 TEST_FIXTURE(ToCFunction, LuaFixture)
 {
 
@@ -1091,6 +1177,39 @@ TEST_FIXTURE(NewIndexMetamethod, LuaFixture)
 
 }
 
+TEST_FIXTURE(TagMethodAddedLater, LuaFixture)
+{
+
+    // The absence of a tag method is cached in the metatable, so make sure
+    // adding (and removing) one after it has been looked up is noticed.
+    CHECK( DoString(L, "mt = {} t = setmetatable({}, mt)") );
+
+    CHECK( DoString(L, "return t.x") );
+    CHECK( lua_isnil(L, -1) );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "return pcall(function() return t + 1 end)") );
+    CHECK( !lua_toboolean(L, -2) );
+    lua_pop(L, 2);
+
+    CHECK( DoString(L, "mt.__index = function(t, k) return k end return t.x") );
+    CHECK_EQ( lua_tostring(L, -1), "x" );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "mt.__add = function(a, b) return b end return t + 1") );
+    CHECK_EQ( lua_tonumber(L, -1), 1 );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "mt.__index = nil return t.x") );
+    CHECK( lua_isnil(L, -1) );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "rawset(mt, '__index', { x = 2 }) return t.x") );
+    CHECK_EQ( lua_tonumber(L, -1), 2 );
+    lua_pop(L, 1);
+
+}
+
 TEST_FIXTURE(GetUpValueCFunction, LuaFixture)
 {
 
@@ -2348,6 +2467,225 @@ TEST_FIXTURE(ConcatOperatorNumber, LuaFixture)
 
 }
 
+TEST_FIXTURE(LongStrings, LuaFixture)
+{
+
+    // Long strings aren't stored in the string pool, so two long strings with
+    // the same contents can be different objects. They must still compare
+    // equal and be the same table key.
+    const char* code =
+        "a = ''\n"
+        "for i = 1, 100 do a = a .. 'x' end\n"
+        "b = ''\n"
+        "for i = 1, 50 do b = b .. 'xx' end\n"
+        "c = a .. 'y'\n"
+        "t = { [a] = 1 }\n"
+        "t[c] = 2\n"
+        "collectgarbage()\n";
+
+    CHECK( DoString(L, code) );
+
+    CHECK( DoString(L, "return a == b, a ~= c, rawequal(a, b)") );
+    CHECK( lua_toboolean(L, -3) );
+    CHECK( lua_toboolean(L, -2) );
+    CHECK( lua_toboolean(L, -1) );
+    lua_pop(L, 3);
+
+    CHECK( DoString(L, "return t[b], t[c]") );
+    CHECK_EQ( lua_tonumber(L, -2), 1 );
+    CHECK_EQ( lua_tonumber(L, -1), 2 );
+    lua_pop(L, 2);
+
+    CHECK( DoString(L, "t[b] = nil return t[a], next(t) == c") );
+    CHECK( lua_isnil(L, -2) );
+    CHECK( lua_toboolean(L, -1) );
+    lua_pop(L, 2);
+
+}
+
+TEST_FIXTURE(StringPoolResize, LuaFixture)
+{
+
+    // Short strings are compared by identity, so a string must be found in
+    // the string pool while the pool is growing (and being migrated), across
+    // collections and after the pool has shrunk.
+    const char* code =
+        "t = {}\n"
+        "for i = 1, 20000 do\n"
+        "  t['k' .. i] = i\n"
+        "  if i % 5000 == 0 then collectgarbage() end\n"
+        "end\n";
+
+    CHECK( DoString(L, code) );
+
+    char key[16];
+
+    lua_getglobal(L, "t");
+    for (int i = 1; i <= 20000; ++i)
+    {
+        sprintf(key, "k%d", i);
+        lua_getfield(L, -1, key);
+        CHECK_EQ( lua_tonumber(L, -1), i );
+        lua_pop(L, 1);
+    }
+    lua_pop(L, 1);
+
+    code =
+        "u = {}\n"
+        "for i = 1, 100 do u[i] = 'k' .. i end\n"
+        "t = nil\n"
+        "collectgarbage()\n";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "u");
+    for (int i = 1; i <= 100; ++i)
+    {
+        sprintf(key, "k%d", i);
+        lua_rawgeti(L, -1, i);
+        lua_pushstring(L, key);
+        CHECK( lua_rawequal(L, -1, -2) );
+        lua_pop(L, 2);
+    }
+    lua_pop(L, 1);
+
+}
+
+TEST_FIXTURE(StringCollation, LuaFixture)
+{
+
+    // Both collation orders must handle embedded zeros and strings which are
+    // prefixes of other strings.
+    const char* code =
+        "return 'a\\0b' < 'a\\0c', 'a' < 'a\\0', 'ab' < 'abc',\n"
+        "       'b' < 'a', 'abc' <= 'abc', 'abd' <= 'abc'\n";
+
+    const int collations[] = { LUA_COLLATE_BYTES, LUA_COLLATE_LOCALE };
+
+    for (int i = 0; i < 2; ++i)
+    {
+        lua_setcollation(L, collations[i]);
+        CHECK( DoString(L, code) );
+        CHECK(  lua_toboolean(L, -6) );
+        CHECK(  lua_toboolean(L, -5) );
+        CHECK(  lua_toboolean(L, -4) );
+        CHECK( !lua_toboolean(L, -3) );
+        CHECK(  lua_toboolean(L, -2) );
+        CHECK( !lua_toboolean(L, -1) );
+        lua_pop(L, 6);
+    }
+
+    // In byte order, characters above 127 come after the ASCII characters.
+    lua_setcollation(L, LUA_COLLATE_BYTES);
+    CHECK( DoString(L, "return '\\200' > 'z'") );
+    CHECK( lua_toboolean(L, -1) );
+    lua_pop(L, 1);
+
+}
+
+TEST_FIXTURE(NumberToString, LuaFixture)
+{
+
+    // Numbers are converted without sprintf when possible; the results must
+    // be the same as "%.14g".
+    const lua_Number number[] =
+        {
+            0, -0.0, 42, -7, 1e14, 0.1, -2.5, 1.0 / 3, 123.456, 99999999999999.95,
+            0.0001, 0.00001, 1e100, 5e-324
+        };
+
+    for (int i = 0; i < sizeof(number) / sizeof(number[0]); ++i)
+    {
+        char expected[64];
+        sprintf(expected, "%.14g", number[i]);
+        lua_pushnumber(L, number[i]);
+        CHECK_EQ( lua_tostring(L, -1), expected );
+        lua_pop(L, 1);
+    }
+
+}
+
+TEST_FIXTURE(StringToNumber, LuaFixture)
+{
+
+    // Plain decimals are converted without strtod, other formats with it.
+    struct Case
+    {
+        const char* string;
+        double      value;
+    };
+
+    const Case cases[] =
+        {
+            { "12",                 12                 },
+            { " -3.25 ",            -3.25              },
+            { "0.1",                0.1                },
+            { "1.",                 1                  },
+            { ".5",                 0.5                },
+            { "1e3",                1000               },
+            { "0x10",               16                 },
+            { "1234567890.1234567", 1234567890.1234567 },
+        };
+
+    char code[64];
+
+    for (int i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); ++i)
+    {
+        sprintf(code, "return '%s' + 0", cases[i].string);
+        CHECK( DoString(L, code) );
+        CHECK_EQ( lua_tonumber(L, -1), cases[i].value );
+        lua_pop(L, 1);
+    }
+
+    CHECK( DoString(L, "return 1 / ('-0' + 0) < 0") );
+    CHECK( lua_toboolean(L, -1) );
+    lua_pop(L, 1);
+
+    CHECK( DoString(L, "return pcall(function() return '1 2' + 0 end)") );
+    CHECK( !lua_toboolean(L, -2) );
+    lua_pop(L, 2);
+
+    CHECK( DoString(L, "return pcall(function() return '.' + 0 end)") );
+    CHECK( !lua_toboolean(L, -2) );
+    lua_pop(L, 2);
+
+}
+
+TEST_FIXTURE(PushFString, LuaFixture)
+{
+
+    const char* s = lua_pushfstring(L, "%s=%d %f %c%% %s%q", "x", -12, 0.5, 'y', NULL);
+    CHECK_EQ( s, "x=-12 0.5 y% (null)%q" );
+
+    s = lua_pushfstring(L, "no arguments");
+    CHECK_EQ( s, "no arguments" );
+
+    s = lua_pushfstring(L, "");
+    CHECK_EQ( s, "" );
+
+}
+
+TEST_FIXTURE(ConcatOperatorMetamethod, LuaFixture)
+{
+
+    // Concatenation is right associative, so the values after the table are
+    // joined and passed to the metamethod, and its result is joined with the
+    // values before the table.
+    const char* code =
+        "local mt = { __concat = function(a, b) return 'T(' .. b .. ')' end }\n"
+        "local t = setmetatable({}, mt)\n"
+        "s = 'a' .. 1 .. t .. 2 .. 'b' .. 'c'";
+
+    CHECK( DoString(L, code) );
+
+    lua_getglobal(L, "s");
+    const char* s = lua_tostring(L, -1);
+
+    CHECK( s != NULL );
+    CHECK( strcmp(s, "a1T(2bc)") == 0 );
+
+}
+
 TEST_FIXTURE(VarArg1, LuaFixture)
 {
 
@@ -88,6 +88,8 @@ void CloseUpValue(lua_State* L, UpValue* upValue)
     // Copy over the value so we have our own storage.
     upValue->storage = *upValue->value;
     upValue->value   = &upValue->storage;
+    // The value was referenced from the stack until now.
+    Gc_WriteBarrier(L, upValue, &upValue->storage);
 }
 
 void CloseUpValues(lua_State* L, Value* value)
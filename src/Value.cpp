@@ -11,6 +11,8 @@
 #include "Table.h"
 
 #include <ctype.h>
+#include <math.h>
+#include <stdio.h>
 
 void Value_SetMetatable(lua_State* L, Value* value, Table* table)
 {
@@ -50,6 +52,10 @@ Table* Value_GetMetatable(lua_State* L, const Value* value)
         return value->table->metatable;
     case Tag_Userdata:
         return value->userData->metatable;
+    case Tag_DeadKey:
+        // Dead keys are only stored in table nodes.
+        ASSERT(0);
+        return NULL;
     }
     // Get the global metatable for the type.
     int type = Value_GetType(value);
@@ -73,6 +79,9 @@ int Value_SetEnv(lua_State* L, Value* value, Table* table)
         value->userData->env = table;
         Gc_WriteBarrier(L, value->userData, table);
         return 1;
+    case Tag_DeadKey:
+        ASSERT(0);
+        return 0;
     }
     return 0;
 }
@@ -89,13 +98,95 @@ Table* Value_GetEnv(const Value* value)
         return 0;
     case Tag_Userdata:
         return value->userData->env;
+    case Tag_DeadKey:
+        ASSERT(0);
+        return 0;
     }
     return 0;
 }
 
+/**
+ * Converts a plain decimal number (optional sign, digits and an optional
+ * fraction) without the C library. Returns false if the string has another
+ * form, or has too many digits for the result to be exact, in which case the
+ * conversion should be done by strtod.
+ */
+static bool DecimalToNumber(const char* string, lua_Number* result)
+{
+
+    // Powers of 10 which are exactly representable as doubles.
+    static const double power[] =
+        {
+            1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,
+            1e10, 1e11, 1e12, 1e13, 1e14, 1e15
+        };
+
+    const char* p = string;
+    while (isspace(static_cast<unsigned char>(*p)))
+    {
+        ++p;
+    }
+
+    bool negative = false;
+    if (*p == '-' || *p == '+')
+    {
+        negative = (*p == '-');
+        ++p;
+    }
+
+    // Up to 15 digits always fit exactly in the mantissa of a double.
+    unsigned long long mantissa = 0;
+    int numDigits = 0;
+    int numFractionDigits = 0;
+
+    while (*p >= '0' && *p <= '9')
+    {
+        mantissa = mantissa * 10 + (*p - '0');
+        ++numDigits;
+        ++p;
+    }
+    if (*p == '.')
+    {
+        ++p;
+        while (*p >= '0' && *p <= '9')
+        {
+            mantissa = mantissa * 10 + (*p - '0');
+            ++numDigits;
+            ++numFractionDigits;
+            ++p;
+        }
+    }
+
+    if (numDigits == 0 || numDigits > 15)
+    {
+        return false;
+    }
+
+    while (isspace(static_cast<unsigned char>(*p)))
+    {
+        ++p;
+    }
+    if (*p != '\0')
+    {
+        return false;
+    }
+
+    // Both the mantissa and the power of 10 are exact, so the division is
+    // correctly rounded.
+    lua_Number number = static_cast<lua_Number>(mantissa) / power[numFractionDigits];
+    *result = negative ? -number : number;
+    return true;
+
+}
+
 bool StringToNumber(const char* string, lua_Number* result)
 {
 
+    if (DecimalToNumber(string, result))
+    {
+        return true;
+    }
+
     char* end;
     *result = lua_str2number(string, &end);
 
@@ -123,3 +214,145 @@ bool StringToNumber(const char* string, lua_Number* result)
     return false;
 
 }
+
+/**
+ * Writes the decimal digits of an unsigned integer to the end of the buffer
+ * and returns a pointer to the first digit.
+ */
+static char* WriteDigits(char* end, unsigned long long n)
+{
+    do
+    {
+        *--end = static_cast<char>('0' + n % 10);
+        n /= 10;
+    }
+    while (n != 0);
+    return end;
+}
+
+int NumberToString(lua_Number number, char* buffer)
+{
+
+    // Numbers which hold an integer below 10^14 are printed by "%.14g" as
+    // that integer, which is most numbers in practice.
+    if (number > -1e14 && number < 1e14 && number == floor(number) && (number != 0 || !signbit(number)))
+    {
+        char temp[LUAI_MAXNUMBER2STR];
+        char* end = temp + sizeof(temp);
+        char* digits = WriteDigits(end, static_cast<unsigned long long>(fabs(number)));
+        char* dst = buffer;
+        if (number < 0)
+        {
+            *dst++ = '-';
+        }
+        memcpy(dst, digits, end - digits);
+        dst += end - digits;
+        *dst = 0;
+        return static_cast<int>(dst - buffer);
+    }
+
+    // For other numbers between 10^-4 and 10^14, "%.14g" is the number rounded
+    // to 14 significant digits without an exponent. The digits are found by
+    // scaling the number by an exact power of 10 into [10^13, 10^14) and
+    // rounding it to an integer. The scaling is rounded by at most 1/128, so
+    // the result is the correctly rounded one unless the fraction is close to
+    // one half, which is left to sprintf.
+    static const double power[] =
+        {
+            1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,
+            1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17
+        };
+
+    double magnitude = fabs(number);
+    if (magnitude >= 1e-4 && magnitude < 1e14)
+    {
+
+        // log10 can be off by one near a power of 10, which is corrected
+        // after scaling.
+        int exponent = static_cast<int>( floor(log10(magnitude)) );
+        if (exponent < -4)  exponent = -4;
+        if (exponent > 13)  exponent = 13;
+
+        int scale = 13 - exponent;
+        double scaled = magnitude * power[scale];
+        if (scaled >= 1e14 && scale > 0)
+        {
+            ++exponent;
+            --scale;
+            scaled = magnitude * power[scale];
+        }
+        else if (scaled < 1e13 && scale < 17)
+        {
+            --exponent;
+            ++scale;
+            scaled = magnitude * power[scale];
+        }
+
+        double integer  = floor(scaled);
+        double fraction = scaled - integer;
+        if (scaled >= 1e13 && scaled < 1e14 && fabs(fraction - 0.5) > 0.01)
+        {
+
+            unsigned long long digits = static_cast<unsigned long long>(integer) + (fraction > 0.5);
+            if (digits == 100000000000000ULL)
+            {
+                // Rounded up to the next power of 10.
+                digits /= 10;
+                ++exponent;
+            }
+
+            if (exponent >= -4 && exponent < 14)
+            {
+
+                char temp[LUAI_MAXNUMBER2STR];
+                char* end = temp + sizeof(temp);
+                char* first = WriteDigits(end, digits);
+                ASSERT(end - first == 14);
+
+                // Trailing zeros are removed from the fraction.
+                while (end[-1] == '0')
+                {
+                    --end;
+                }
+
+                char* dst = buffer;
+                if (number < 0)
+                {
+                    *dst++ = '-';
+                }
+                if (exponent < 0)
+                {
+                    *dst++ = '0';
+                    *dst++ = '.';
+                    for (int i = -1; i > exponent; --i)
+                    {
+                        *dst++ = '0';
+                    }
+                    memcpy(dst, first, end - first);
+                    dst += end - first;
+                }
+                else
+                {
+                    int numIntegerDigits = exponent + 1;
+                    memcpy(dst, first, numIntegerDigits);
+                    dst   += numIntegerDigits;
+                    first += numIntegerDigits;
+                    if (first < end)
+                    {
+                        *dst++ = '.';
+                        memcpy(dst, first, end - first);
+                        dst += end - first;
+                    }
+                }
+                *dst = 0;
+                return static_cast<int>(dst - buffer);
+
+            }
+
+        }
+
+    }
+
+    return sprintf(buffer, LUA_NUMBER_FMT, number);
+
+}
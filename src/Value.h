@@ -14,6 +14,7 @@ extern "C"
 }
 
 #include "Global.h"
+#include "String.h"
 
 //
 // Forward declarations.
@@ -41,6 +42,7 @@ enum Tag
     Tag_Thread          = ~8u,
     Tag_Prototype       = ~9u,
     Tag_FunctionP       = ~10u,
+    Tag_DeadKey         = ~11u,     // Used for the keys of dead table nodes.
     
     Tag_Filler = INT_MAX //Needed for gcc to force the enum to be a 32bit value
 };
@@ -147,6 +149,7 @@ inline int Value_GetType(const Value* value)
     case Tag_Closure:       return LUA_TFUNCTION;
     case Tag_Userdata:      return LUA_TUSERDATA;
     case Tag_Thread:        return LUA_TTHREAD;
+    case Tag_DeadKey:       ASSERT(0); break;   // Only stored in dead table nodes.
     }
     return LUA_TNONE;
 }
@@ -208,6 +211,10 @@ inline int Value_Equal(const Value* arg1, const Value* arg2)
     {
         return 1;
     }
+    else if (Value_GetIsString(arg1))
+    {
+        return String_Equal(arg1->string, arg2->string);
+    }
     return arg1->object == arg2->object;
 }
 
@@ -238,4 +245,11 @@ trailing whitespace. This function can accomodate strings in any format that is
 permissiable by the Lua language and uses the current locale settings. */
 bool StringToNumber(const char* string, lua_Number* number);
 
+/**
+ * Writes the string representation of a number into buffer, which must hold at
+ * least LUAI_MAXNUMBER2STR characters, and returns its length. The result is
+ * the same as lua_number2str (i.e. "%.14g").
+ */
+int NumberToString(lua_Number number, char* buffer);
+
 #endif
\ No newline at end of file
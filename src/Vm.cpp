@@ -168,7 +168,7 @@ static Value* GetTagMethod(lua_State* L, const Value* value, TagMethod method)
     Table* metatable = Value_GetMetatable(L, value);
     if (metatable != NULL)
     {
-        return Table_GetTable(L, metatable, L->tagMethodName[method]);
+        return Table_GetTagMethod(L, metatable, method);
     }
     return NULL;
 }
@@ -438,7 +438,7 @@ FORCE_INLINE int Vm_Less(lua_State* L, const Value* arg1, const Value* arg2)
     {
         if (Value_GetIsString(arg1))
         {
-            return String_Compare(arg1->string, arg2->string) < 0;
+            return String_Compare(L, arg1->string, arg2->string) < 0;
         }
         int result = ComparisionTagMethod(L, arg1, arg2, TagMethod_Lt);
         if (result != -1)
@@ -460,7 +460,7 @@ FORCE_INLINE int Vm_LessEqual(lua_State* L, const Value* arg1, const Value* arg2
     {
         if (Value_GetIsString(arg1))
         {
-            return String_Compare(arg1->string, arg2->string) <= 0;
+            return String_Compare(L, arg1->string, arg2->string) <= 0;
         }
         int result = ComparisionTagMethod(L, arg1, arg2, TagMethod_Le);
         if (result != -1)
@@ -975,12 +975,21 @@ Start:
             break;
         case Opcode_GetTable:
             {
-                PROTECT(
-                    int b = GET_B(inst);
-                    const Value* table = &stackBase[b];
-                    const Value* key   = RESOLVE_RK( GET_C(inst) );
-                    Vm_GetTable(L, table, key, &stackBase[a], false);
-                )
+                int b = GET_B(inst);
+                const Value* table = &stackBase[b];
+                const Value* key   = RESOLVE_RK( GET_C(inst) );
+                // Fast path for reading an element of the array part.
+                const Value* slot = Value_GetIsTable(table) ? Table_GetArraySlot(table->table, key) : NULL;
+                if (slot != NULL && !Value_GetIsNil(slot))
+                {
+                    stackBase[a] = *slot;
+                }
+                else
+                {
+                    PROTECT(
+                        Vm_GetTable(L, table, key, &stackBase[a], false);
+                    )
+                }
             }
             break;
         case Opcode_GetTableRef:
@@ -995,12 +1004,23 @@ Start:
             break;
         case Opcode_SetTable:
             {
-                PROTECT(
-                    Value* table = &stackBase[a];
-                    Value* key   = RESOLVE_RK( GET_B(inst) );
-                    Value* value = RESOLVE_RK( GET_C(inst) );
-                    Vm_SetTable(L, table, key, value);
-                )
+                Value* table = &stackBase[a];
+                Value* key   = RESOLVE_RK( GET_B(inst) );
+                Value* value = RESOLVE_RK( GET_C(inst) );
+                // Fast path for updating an existing element of the array
+                // part (no metamethods are involved since the key exists).
+                Value* slot = Value_GetIsTable(table) ? Table_GetArraySlot(table->table, key) : NULL;
+                if (slot != NULL && !Value_GetIsNil(slot))
+                {
+                    *slot = *value;
+                    Gc_WriteBarrier(L, table->table, value);
+                }
+                else
+                {
+                    PROTECT(
+                        Vm_SetTable(L, table, key, value);
+                    )
+                }
             }
             break;
         case Opcode_Call:
@@ -1226,7 +1246,9 @@ Start:
             break;
         case Opcode_NewTable:
             {
-                SetValue( &stackBase[a], Table_Create(L) );
+                int arraySize = Opcode_DecodeSize( GET_B(inst) );
+                int numNodes  = Opcode_DecodeSize( GET_C(inst) );
+                SetValue( &stackBase[a], Table_Create(L, arraySize, numNodes) );
             }
             break;
         case Opcode_Closure:
@@ -1251,6 +1273,7 @@ Start:
                     {
                         ASSERT( GET_OPCODE(inst) == Opcode_GetUpVal );
                         c->lclosure.upValue[i] = lclosure->upValue[b];
+                        Gc_WriteBarrier(L, c, c->lclosure.upValue[i]);
                     }
                 }
 
@@ -1399,6 +1422,12 @@ Start:
                         // Restore the top of the stack from the previous call.
                         L->stackTop = frame->stackTop;
                     }
+                    // Grow the array part up front so that all of the elements
+                    // are stored directly into it.
+                    if (offset + b > table->arraySize)
+                    {
+                        Table_ResizeArray(L, table, offset + b);
+                    }
                     for (int i = 1; i <= b; ++i)
                     {
                         Value* value = &stackBase[a + i];
@@ -1459,6 +1488,7 @@ int Vm_RunProtected(lua_State* L, ProtectedFunction function, Value* stackTop, v
     // Save off the pre-call state so we can restore it in the case of an error.
     CallFrame* oldFrame = L->callStackTop;
     Value*     oldBase  = L->stackBase;
+    String*    oldStringBuffer = L->openStringBuffer;
 
     int result = setjmp(errorHandler.jump);
 
@@ -1496,6 +1526,9 @@ int Vm_RunProtected(lua_State* L, ProtectedFunction function, Value* stackTop, v
             CloseUpValues(L, oldBase);
         }
 
+        // Free the string buffers that were abandoned by the error.
+        String_FreeBuffers(L, oldStringBuffer);
+
         // Move the error message to the top of the pre-call stack.
         Value_Copy(stackTop, L->stackTop - 1);
         L->stackTop = stackTop + 1;